@@ -0,0 +1,234 @@
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "hash.h"
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+static uint64_t readLittleEndian(const uint8_t *bytes)
+{
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; i--) {
+		value = value << 8 | bytes[i];
+	}
+	return value;
+}
+
+static void sipRound(uint64_t *v)
+{
+	v[0] += v[1]; v[1] = ROTL(v[1], 13); v[1] ^= v[0]; v[0] = ROTL(v[0], 32);
+	v[2] += v[3]; v[3] = ROTL(v[3], 16); v[3] ^= v[2];
+	v[0] += v[3]; v[3] = ROTL(v[3], 21); v[3] ^= v[0];
+	v[2] += v[1]; v[1] = ROTL(v[1], 17); v[1] ^= v[2]; v[2] = ROTL(v[2], 32);
+}
+
+/*
+ * SipHash-2-4 of a message with a SIPHASH_KEY_LEN-byte key
+ */
+uint64_t sipHash(const uint8_t *key, const void *message, size_t len)
+{
+	const uint8_t *bytes = message;
+	uint64_t k0 = readLittleEndian(key), k1 = readLittleEndian(key + 8);
+	uint64_t v[4] = { k0 ^ 0x736f6d6570736575ULL, k1 ^ 0x646f72616e646f6dULL,
+		k0 ^ 0x6c7967656e657261ULL, k1 ^ 0x7465646279746573ULL };
+
+	size_t i;
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t m = readLittleEndian(bytes + i);
+		v[3] ^= m;
+		sipRound(v);
+		sipRound(v);
+		v[0] ^= m;
+	}
+	// The last block holds the remaining bytes and the length
+	uint8_t last[8] = { 0 };
+	memcpy(last, bytes + i, len - i);
+	last[7] = len;
+	uint64_t m = readLittleEndian(last);
+	v[3] ^= m;
+	sipRound(v);
+	sipRound(v);
+	v[0] ^= m;
+
+	v[2] ^= 0xff;
+	for (i = 0; i < 4; i++) {
+		sipRound(v);
+	}
+	return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+static const uint32_t SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotr32(uint32_t x, int b)
+{
+	return x >> b | x << (32 - b);
+}
+
+static uint32_t readBigEndian32(const uint8_t *bytes)
+{
+	return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+static void hashBlocksPortable(uint32_t *state, const uint8_t *data, size_t numBlocks)
+{
+	for ( ; numBlocks; numBlocks--, data += SHA256_BLOCK_LEN) {
+		uint32_t w[64];
+		for (int i = 0; i < 16; i++) {
+			w[i] = readBigEndian32(data + 4 * i);
+		}
+		for (int i = 16; i < 64; i++) {
+			uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ w[i - 15] >> 3;
+			uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ w[i - 2] >> 10;
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i = 0; i < 64; i++) {
+			uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g))
+				+ SHA256_K[i] + w[i];
+			uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*
+ * Hash blocks with the SHA extensions, which do two rounds per instruction. The state is kept as ABEF and CDGH,
+ * the order the instructions expect.
+ */
+__attribute__((target("sha,sse4.1")))
+static void hashBlocksSHANI(uint32_t *state, const uint8_t *data, size_t numBlocks)
+{
+	const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0xb1);  // CDAB
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(state + 4)), 0x1b);  // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);  // CDGH
+
+	for ( ; numBlocks; numBlocks--, data += SHA256_BLOCK_LEN) {
+		__m128i saved0 = state0, saved1 = state1;
+		__m128i w[4];  // The last 16 words of the message schedule
+		for (int i = 0; i < 16; i++) {
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), byteSwap);
+			} else {
+				__m128i next = _mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]);
+				next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+				w[i % 4] = _mm_sha256msg2_epu32(next, w[(i + 3) % 4]);
+			}
+			__m128i message = _mm_add_epi32(w[i % 4], _mm_loadu_si128((const __m128i *)(SHA256_K + 4 * i)));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(message, 0x0e));
+		}
+		state0 = _mm_add_epi32(state0, saved0);
+		state1 = _mm_add_epi32(state1, saved1);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);  // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xb1);  // DCHG
+	_mm_storeu_si128((__m128i *)state, _mm_blend_epi16(tmp, state1, 0xf0));  // DCBA
+	_mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(state1, tmp, 8));  // HGFE
+}
+
+static int hasSHAExtensions(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3)) {
+		return 0;
+	}
+	return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+}
+#endif
+
+void initSha256(struct Sha256 *sha)
+{
+	static const uint32_t initialState[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(sha->state, initialState, sizeof(initialState));
+	sha->bufferLen = 0;
+	sha->len = 0;
+	sha->hashBlocks = hashBlocksPortable;
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (hasSHAExtensions()) {
+		sha->hashBlocks = hashBlocksSHANI;
+	}
+#endif
+}
+
+/*
+ * Continue a hash from its state after len bytes, which must be a multiple of SHA256_BLOCK_LEN
+ */
+void resumeSha256(struct Sha256 *sha, const uint32_t *state, uint64_t len)
+{
+	memcpy(sha->state, state, sizeof(sha->state));
+	sha->bufferLen = 0;
+	sha->len = len;
+}
+
+void updateSha256(struct Sha256 *sha, const void *data, size_t len)
+{
+	const uint8_t *bytes = data;
+	sha->len += len;
+	if (sha->bufferLen) {
+		size_t n = SHA256_BLOCK_LEN - sha->bufferLen;
+		n = len < n ? len : n;
+		memcpy(sha->buffer + sha->bufferLen, bytes, n);
+		bytes += n;
+		len -= n;
+		if ((sha->bufferLen += n) < SHA256_BLOCK_LEN) {
+			return;
+		}
+		sha->hashBlocks(sha->state, sha->buffer, 1);
+		sha->bufferLen = 0;
+	}
+	// Whole blocks are hashed straight from the data
+	sha->hashBlocks(sha->state, bytes, len / SHA256_BLOCK_LEN);
+	bytes += len / SHA256_BLOCK_LEN * SHA256_BLOCK_LEN;
+	sha->bufferLen = len % SHA256_BLOCK_LEN;
+	memcpy(sha->buffer, bytes, sha->bufferLen);
+}
+
+/*
+ * Pad the data and write its SHA256_LEN-byte digest
+ */
+void finishSha256(struct Sha256 *sha, uint8_t *digest)
+{
+	uint64_t bitLen = sha->len * 8;
+	uint8_t padding[2 * SHA256_BLOCK_LEN] = { 0x80 };
+	// The padding ends with the length and fills the last block
+	int paddingLen = (sha->bufferLen < SHA256_BLOCK_LEN - 8 ? SHA256_BLOCK_LEN : 2 * SHA256_BLOCK_LEN) - sha->bufferLen;
+	for (int i = 0; i < 8; i++) {
+		padding[paddingLen - 1 - i] = bitLen >> (8 * i);
+	}
+	updateSha256(sha, padding, paddingLen);
+	for (int i = 0; i < 8; i++) {
+		for (int j = 0; j < 4; j++) {
+			digest[4 * i + j] = sha->state[i] >> (8 * (3 - j));
+		}
+	}
+}
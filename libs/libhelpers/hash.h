@@ -0,0 +1,29 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIPHASH_KEY_LEN 16
+#define SHA256_LEN 32
+#define SHA256_BLOCK_LEN 64
+
+/*
+ * SHA-256 of data fed in pieces of any size. Blocks are hashed with the SHA extensions where the CPU has them.
+ */
+struct Sha256 {
+	uint32_t state[8];
+	uint8_t buffer[SHA256_BLOCK_LEN];  // Data that does not fill a block yet
+	int bufferLen;
+	uint64_t len;  // Data hashed so far
+	void (*hashBlocks)(uint32_t *, const uint8_t *, size_t);
+};
+
+uint64_t sipHash(const uint8_t *, const void *, size_t);
+
+void initSha256(struct Sha256 *);
+void resumeSha256(struct Sha256 *, const uint32_t *, uint64_t);
+void updateSha256(struct Sha256 *, const void *, size_t);
+void finishSha256(struct Sha256 *, uint8_t *);
+
+#endif
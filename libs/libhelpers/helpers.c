@@ -1,6 +1,9 @@
 #include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "helpers.h"
 
@@ -62,6 +65,31 @@ int isValidIP(const char *ip)
 	return 1;
 }
 
+/*
+ * Parse a rate in bytes per second, with an optional K, M, or G suffix (powers of 1000). Return 0 if it is invalid.
+ */
+uint64_t parseRate(const char *rateStr)
+{
+	char *end;
+	if (!isdigit(*rateStr)) {
+		return 0;
+	}
+	uint64_t rate = strtoull(rateStr, &end, 10);
+	switch (toupper(*end)) {
+	case 'G':
+		rate *= 1000;
+		// Fall through
+	case 'M':
+		rate *= 1000;
+		// Fall through
+	case 'K':
+		rate *= 1000;
+		end++;
+		break;
+	}
+	return *end ? 0 : rate;
+}
+
 /*
  * Get the number of microseconds between two timevals
  */
@@ -79,3 +107,54 @@ void setMicroTime(struct timeval *tv, int totalMicro)
 	tv->tv_sec = totalMicro / SI_MICRO;
 	tv->tv_usec = totalMicro % SI_MICRO;
 }
+
+/*
+ * Get a monotonic timestamp in microseconds. It wraps around every 71 minutes,
+ * so only differences between timestamps are meaningful.
+ */
+uint32_t getMicroTimestamp(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * SI_MICRO + ts.tv_nsec / 1000);
+}
+
+/*
+ * Write the low len bytes of value into buffer, most significant first
+ */
+void writeUint(char *buffer, uint64_t value, int len)
+{
+	for (int i = 0; i < len; i++) {
+		buffer[i] = value >> (8 * (len - 1 - i));
+	}
+}
+
+/*
+ * Read a len-byte big-endian integer from buffer
+ */
+uint64_t readUint(const char *buffer, int len)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < len; i++) {
+		value = value << 8 | (uint8_t)buffer[i];
+	}
+	return value;
+}
+
+/*
+ * Read exactly len bytes of fd starting at offset. Return 0, or -1 on failure or if the file ends first.
+ */
+int readFully(int fd, void *buffer, size_t len, off_t offset)
+{
+	size_t total = 0;
+	while (total < len) {
+		ssize_t n = pread(fd, (char *)buffer + total, len - total, offset + total);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return -1;
+		}
+		total += n;
+	}
+	return 0;
+}
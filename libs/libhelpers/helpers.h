@@ -1,7 +1,9 @@
 #ifndef HELPERS_H 
 #define HELPERS_H
 
+#include <stdint.h>
 #include <sys/time.h>
+#include <sys/types.h>
 
 #define SI_MICRO 1000000
 
@@ -10,7 +12,12 @@
 int isNumber(const char *);
 int getPort(const char *);
 int isValidIP(const char *);
+uint64_t parseRate(const char *);
 int getMicroDiff(const struct timeval *, const struct timeval *);
 void setMicroTime(struct timeval *, int);
+uint32_t getMicroTimestamp(void);
+void writeUint(char *, uint64_t, int);
+uint64_t readUint(const char *, int);
+int readFully(int, void *, size_t, off_t);
 
 #endif
@@ -0,0 +1,69 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+/*
+ * Initialize a ring that holds at least capacity elements of elemSize bytes each
+ */
+int initRing(struct Ring *ring, size_t capacity, size_t elemSize)
+{
+	size_t roundedCapacity = 1;
+	while (roundedCapacity < capacity) {
+		roundedCapacity <<= 1;
+	}
+	if (!(ring->buffer = malloc(roundedCapacity * elemSize))) {
+		return -1;
+	}
+	ring->elemSize = elemSize;
+	ring->mask = roundedCapacity - 1;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return 0;
+}
+
+void freeRing(struct Ring *ring)
+{
+	free(ring->buffer);
+}
+
+/*
+ * Copy an element into the ring. Only the producer may call this.
+ * Returns 0 if the ring is full.
+ */
+int ringPush(struct Ring *ring, const void *elem)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (tail - head > ring->mask) {
+		return 0;
+	}
+	memcpy(ring->buffer + (tail & ring->mask) * ring->elemSize, elem, ring->elemSize);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+/*
+ * Copy the oldest element out of the ring. Only the consumer may call this.
+ * Returns 0 if the ring is empty.
+ */
+int ringPop(struct Ring *ring, void *elem)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head == tail) {
+		return 0;
+	}
+	memcpy(elem, ring->buffer + (head & ring->mask) * ring->elemSize, ring->elemSize);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return 1;
+}
+
+/*
+ * Get the number of elements in the ring (exact only when called by the producer or consumer)
+ */
+size_t ringSize(struct Ring *ring)
+{
+	return atomic_load_explicit(&ring->tail, memory_order_acquire)
+		- atomic_load_explicit(&ring->head, memory_order_acquire);
+}
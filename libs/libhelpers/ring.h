@@ -0,0 +1,27 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define CACHE_LINE 64
+
+/*
+ * A lock-free ring buffer of fixed-size elements with one producer and one consumer
+ */
+struct Ring {
+	char *buffer;
+	size_t elemSize;
+	size_t mask;  // capacity - 1 (capacity is a power of two)
+	alignas(CACHE_LINE) atomic_size_t head;  // Next element to pop, written by the consumer
+	alignas(CACHE_LINE) atomic_size_t tail;  // Next slot to push into, written by the producer
+};
+
+int initRing(struct Ring *, size_t, size_t);
+void freeRing(struct Ring *);
+int ringPush(struct Ring *, const void *);
+int ringPop(struct Ring *, void *);
+size_t ringSize(struct Ring *);
+
+#endif
@@ -0,0 +1,92 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "helpers.h"
+
+/*
+ * Identify the sender's copy of a file, so that a checkpoint left by a transfer of another version is not resumed
+ */
+void makeResumeId(const struct stat *info, uint8_t *resumeId)
+{
+	writeUint((char *)resumeId, info->st_ino, 8);
+	writeUint((char *)resumeId + 8, (uint64_t)info->st_mtim.tv_sec * 1000000000 + info->st_mtim.tv_nsec, 8);
+}
+
+static void encodeCheckpoint(const struct Checkpoint *checkpoint, uint8_t *record)
+{
+	uint8_t *pos = record;
+	memcpy(pos, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_LEN);
+	pos += CHECKPOINT_MAGIC_LEN;
+	memcpy(pos, checkpoint->resumeId, RESUME_ID_LEN);
+	pos += RESUME_ID_LEN;
+	writeUint((char *)pos, checkpoint->fileSize, 8);
+	writeUint((char *)pos + 8, checkpoint->offset, 8);
+	pos += 16;
+	for (int i = 0; i < 8; i++, pos += 4) {
+		writeUint((char *)pos, checkpoint->state[i], 4);
+	}
+
+	// A record torn by a crash in the middle of writing it fails this hash
+	struct Sha256 sha;
+	initSha256(&sha);
+	updateSha256(&sha, record, pos - record);
+	finishSha256(&sha, pos);
+}
+
+/*
+ * Read the checkpoint at path. Return 1 if there is a valid one, or 0 if there is none or it is damaged.
+ */
+int loadCheckpoint(const char *path, struct Checkpoint *checkpoint)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			perror("open");
+		}
+		return 0;
+	}
+	uint8_t record[CHECKPOINT_LEN];
+	ssize_t len = read(fd, record, CHECKPOINT_LEN);
+	close(fd);
+	if (len != CHECKPOINT_LEN || memcmp(record, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_LEN)) {
+		fprintf(stderr, "warning: ignoring a malformed checkpoint\n");
+		return 0;
+	}
+
+	const uint8_t *pos = record + CHECKPOINT_MAGIC_LEN;
+	memcpy(checkpoint->resumeId, pos, RESUME_ID_LEN);
+	pos += RESUME_ID_LEN;
+	checkpoint->fileSize = readUint((const char *)pos, 8);
+	checkpoint->offset = readUint((const char *)pos + 8, 8);
+	pos += 16;
+	for (int i = 0; i < 8; i++, pos += 4) {
+		checkpoint->state[i] = readUint((const char *)pos, 4);
+	}
+
+	uint8_t expected[CHECKPOINT_LEN];
+	encodeCheckpoint(checkpoint, expected);
+	if (memcmp(record, expected, CHECKPOINT_LEN) || checkpoint->offset % SHA256_BLOCK_LEN) {
+		fprintf(stderr, "warning: ignoring a damaged checkpoint\n");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Have the writer sync fd and then overwrite the record in checkpointFd, so that the record never claims
+ * data that could still be lost. Return -1 if an earlier write failed.
+ */
+int queueCheckpoint(struct FileWriter *writer, int fd, int checkpointFd, const struct Checkpoint *checkpoint)
+{
+	uint8_t record[CHECKPOINT_LEN];
+	encodeCheckpoint(checkpoint, record);
+	if (queueFileSync(writer, fd) < 0 || queueFileWrite(writer, checkpointFd, 0, (const char *)record,
+		CHECKPOINT_LEN) < 0) {
+		return -1;
+	}
+	return queueFileSync(writer, checkpointFd);
+}
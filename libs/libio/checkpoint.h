@@ -0,0 +1,31 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "writer.h"
+
+#define CHECKPOINT_INTERVAL (64 * 1024 * 1024)  // Amount of the file received between checkpoints
+#define RESUME_ID_LEN 16  // Identifies the sender's copy of the file (inode and modification time, 8 bytes each)
+#define CHECKPOINT_MAGIC "XFERCKP1"
+#define CHECKPOINT_MAGIC_LEN 8
+// Magic, resume id, file size (8 bytes), offset (8 bytes), digest state (8 words), and the SHA-256 of all of that
+#define CHECKPOINT_LEN (CHECKPOINT_MAGIC_LEN + RESUME_ID_LEN + 8 + 8 + 32 + SHA256_LEN)
+
+/*
+ * How much of a file is known to be on the disk: every byte before offset has been synced, and state is
+ * the SHA-256 state after hashing them (offset is always a multiple of SHA256_BLOCK_LEN)
+ */
+struct Checkpoint {
+	uint8_t resumeId[RESUME_ID_LEN];
+	uint64_t fileSize;
+	uint64_t offset;
+	uint32_t state[8];
+};
+
+void makeResumeId(const struct stat *, uint8_t *);
+int loadCheckpoint(const char *, struct Checkpoint *);
+int queueCheckpoint(struct FileWriter *, int, int, const struct Checkpoint *);
+
+#endif
@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+#include "helpers.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5  // The last bytes of a block are always literals
+#define MATCH_FIND_LIMIT 12  // No match starts this close to the end of a block
+#define SKIP_SHIFT 6  // The search speeds up by a byte for every 64 bytes without a match
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint32_t hashSequence(uint32_t sequence)
+{
+	return sequence * 2654435761U >> (32 - CODEC_HASH_BITS);
+}
+
+/*
+ * Write a length that did not fit in a token's 4 bits as a run of bytes
+ */
+static uint8_t *writeLength(uint8_t *op, int len)
+{
+	for (len -= 15; len >= 255; len -= 255) {
+		*op++ = 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/*
+ * Write a sequence of literals followed by a match (if matchLen is not 0) into the room left in dst.
+ * Return the position after it, or NULL if it does not fit.
+ */
+static uint8_t *writeSequence(uint8_t *op, const uint8_t *opEnd, const uint8_t *literals, int numLiterals,
+	int offset, int matchLen)
+{
+	if (opEnd - op < 1 + numLiterals / 255 + 1 + numLiterals + 2 + matchLen / 255 + 1) {
+		return NULL;
+	}
+	uint8_t *token = op++;
+	*token = (numLiterals < 15 ? numLiterals : 15) << 4;
+	if (numLiterals >= 15) {
+		op = writeLength(op, numLiterals);
+	}
+	memcpy(op, literals, numLiterals);
+	op += numLiterals;
+	if (!matchLen) {
+		return op;
+	}
+
+	op[0] = offset;
+	op[1] = offset >> 8;
+	op += 2;
+	matchLen -= MIN_MATCH;
+	*token |= matchLen < 15 ? matchLen : 15;
+	if (matchLen >= 15) {
+		op = writeLength(op, matchLen);
+	}
+	return op;
+}
+
+/*
+ * Compress srcLen bytes (at most CODEC_BLOCK_SIZE) into dst in the LZ4 block format. table is scratch space
+ * with 2^CODEC_HASH_BITS entries. Return the compressed length, or 0 if it would be more than dstCap.
+ */
+int compressLZ(uint32_t *table, const char *src, int srcLen, char *dst, int dstCap)
+{
+	const uint8_t *base = (const uint8_t *)src;
+	const uint8_t *ip = base, *anchor = base, *end = base + srcLen;
+	const uint8_t *matchLimit = end - LAST_LITERALS;
+	const uint8_t *findLimit = srcLen > MATCH_FIND_LIMIT ? end - MATCH_FIND_LIMIT : base;
+	uint8_t *op = (uint8_t *)dst;
+	const uint8_t *opEnd = op + dstCap;
+
+	memset(table, 0, sizeof(uint32_t) << CODEC_HASH_BITS);
+	while (ip < findLimit) {
+		uint32_t sequence = read32(ip);
+		uint32_t *entry = table + hashSequence(sequence);
+		const uint8_t *ref = base + *entry;
+		*entry = ip - base;
+		if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != sequence) {
+			ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+			continue;
+		}
+
+		// Extend the match backwards over literals and then forwards
+		while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+		const uint8_t *matchEnd = ip + MIN_MATCH;
+		for (const uint8_t *refEnd = ref + MIN_MATCH; matchEnd < matchLimit && *matchEnd == *refEnd; refEnd++) {
+			matchEnd++;
+		}
+
+		if (!(op = writeSequence(op, opEnd, anchor, ip - anchor, ip - ref, matchEnd - ip))) {
+			return 0;
+		}
+		anchor = ip = matchEnd;
+		// Remember a position inside the match so that repeats of its tail are found too
+		if (ip < findLimit) {
+			table[hashSequence(read32(ip - 2))] = ip - 2 - base;
+		}
+	}
+
+	if (!(op = writeSequence(op, opEnd, anchor, end - anchor, 0, 0))) {
+		return 0;
+	}
+	return op - (uint8_t *)dst;
+}
+
+/*
+ * Read the rest of a length that did not fit in a token's 4 bits. Return -1 if it runs past the end of the data
+ * or past max.
+ */
+static int readLength(const uint8_t **ip, const uint8_t *ipEnd, int len, int max)
+{
+	uint8_t byte;
+	do {
+		if (*ip == ipEnd || len > max) {
+			return -1;
+		}
+		byte = *(*ip)++;
+		len += byte;
+	} while (byte == 255);
+	return len;
+}
+
+/*
+ * Decompress srcLen bytes in the LZ4 block format into exactly dstLen bytes.
+ * Return dstLen, or -1 if the data is malformed (nothing is read or written outside the buffers).
+ */
+int decompressLZ(const char *src, int srcLen, char *dst, int dstLen)
+{
+	const uint8_t *ip = (const uint8_t *)src, *ipEnd = ip + srcLen;
+	uint8_t *op = (uint8_t *)dst;
+	const uint8_t *opEnd = op + dstLen;
+
+	for (;;) {
+		if (ip == ipEnd) {
+			return -1;
+		}
+		uint8_t token = *ip++;
+		int numLiterals = token >> 4;
+		if (numLiterals == 15 && (numLiterals = readLength(&ip, ipEnd, numLiterals, dstLen)) < 0) {
+			return -1;
+		}
+		if (numLiterals > ipEnd - ip || numLiterals > opEnd - op) {
+			return -1;
+		}
+		memcpy(op, ip, numLiterals);
+		op += numLiterals;
+		ip += numLiterals;
+		if (ip == ipEnd) {
+			// The last sequence has no match
+			break;
+		}
+
+		if (ipEnd - ip < 2) {
+			return -1;
+		}
+		int offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		int matchLen = token & 15;
+		if (matchLen == 15 && (matchLen = readLength(&ip, ipEnd, matchLen, dstLen)) < 0) {
+			return -1;
+		}
+		matchLen += MIN_MATCH;
+		if (offset == 0 || offset > op - (uint8_t *)dst || matchLen > opEnd - op) {
+			return -1;
+		}
+		// The match may overlap the bytes it produces, so copy a byte at a time
+		const uint8_t *match = op - offset;
+		for (int i = 0; i < matchLen; i++) {
+			op[i] = match[i];
+		}
+		op += matchLen;
+	}
+	return op == opEnd ? dstLen : -1;
+}
+
+void initCompressor(struct Compressor *compressor)
+{
+	memset(compressor, 0, sizeof(struct Compressor));
+}
+
+/*
+ * Compress one block of at most CODEC_BLOCK_SIZE bytes, with its header, into out. Return the number of bytes written.
+ */
+static int compressBlock(struct Compressor *compressor, const char *data, int len, char *out)
+{
+	int storedLen = 0;
+	if (compressor->blocksToSkip) {
+		compressor->blocksToSkip--;
+	} else if ((storedLen = compressLZ(compressor->table, data, len, out + CODEC_HEADER_LEN,
+		len - len / CODEC_MIN_SAVING - 1)) > 0) {
+		compressor->numIncompressible = 0;
+	} else {
+		// Skip exponentially more blocks for as long as sampled blocks do not shrink
+		int shift = ++compressor->numIncompressible;
+		compressor->blocksToSkip = (1 << (shift < CODEC_MAX_SKIP_SHIFT ? shift : CODEC_MAX_SKIP_SHIFT)) - 1;
+	}
+
+	if (storedLen > 0) {
+		writeUint(out, storedLen, 4);
+	} else {
+		storedLen = len;
+		writeUint(out, storedLen | CODEC_RAW_BIT, 4);
+		memcpy(out + CODEC_HEADER_LEN, data, len);
+	}
+	writeUint(out + 4, len, 4);
+	return CODEC_HEADER_LEN + storedLen;
+}
+
+/*
+ * Compress len bytes into out, which must hold CODEC_BOUND(len) bytes. Return the number of bytes written.
+ */
+size_t compressData(struct Compressor *compressor, const char *data, size_t len, char *out)
+{
+	size_t outLen = 0;
+	for (size_t pos = 0; pos < len; pos += CODEC_BLOCK_SIZE) {
+		int blockLen = len - pos < CODEC_BLOCK_SIZE ? len - pos : CODEC_BLOCK_SIZE;
+		outLen += compressBlock(compressor, data + pos, blockLen, out + outLen);
+	}
+	compressor->rawBytes += len;
+	compressor->compressedBytes += outLen;
+	return outLen;
+}
+
+int initDecompressor(struct Decompressor *decompressor)
+{
+	memset(decompressor, 0, sizeof(struct Decompressor));
+	decompressor->stored = malloc(CODEC_BLOCK_SIZE);
+	decompressor->raw = malloc(CODEC_BLOCK_SIZE);
+	if (!decompressor->stored || !decompressor->raw) {
+		freeDecompressor(decompressor);
+		return -1;
+	}
+	return 0;
+}
+
+void freeDecompressor(struct Decompressor *decompressor)
+{
+	free(decompressor->stored);
+	free(decompressor->raw);
+}
+
+/*
+ * Consume up to len bytes of the stream, stopping at the end of a block. If a block was completed,
+ * point *block at its data and set *blockLen (which is only valid until the next call); otherwise, set *block to NULL.
+ * Return the number of bytes consumed, or -1 if the stream is malformed.
+ */
+int decompressData(struct Decompressor *decompressor, const char *data, int len, const char **block, int *blockLen)
+{
+	*block = NULL;
+	int consumed = 0;
+	if (decompressor->headerLen < CODEC_HEADER_LEN) {
+		consumed = CODEC_HEADER_LEN - decompressor->headerLen;
+		consumed = len < consumed ? len : consumed;
+		memcpy(decompressor->header + decompressor->headerLen, data, consumed);
+		if ((decompressor->headerLen += consumed) < CODEC_HEADER_LEN) {
+			return consumed;
+		}
+
+		uint32_t storedLen = readUint(decompressor->header, 4);
+		decompressor->isRaw = (storedLen & CODEC_RAW_BIT) != 0;
+		decompressor->blockLen = storedLen & ~CODEC_RAW_BIT;
+		decompressor->rawLen = readUint(decompressor->header + 4, 4);
+		decompressor->storedLen = 0;
+		if (decompressor->blockLen > CODEC_BLOCK_SIZE || decompressor->rawLen > CODEC_BLOCK_SIZE
+			|| (decompressor->isRaw && decompressor->blockLen != decompressor->rawLen)) {
+			return -1;
+		}
+	}
+
+	int copyLen = decompressor->blockLen - decompressor->storedLen;
+	copyLen = len - consumed < copyLen ? len - consumed : copyLen;
+	memcpy(decompressor->stored + decompressor->storedLen, data + consumed, copyLen);
+	consumed += copyLen;
+	if ((decompressor->storedLen += copyLen) < decompressor->blockLen) {
+		return consumed;
+	}
+
+	if (decompressor->isRaw) {
+		*block = decompressor->stored;
+	} else if (decompressLZ(decompressor->stored, decompressor->blockLen,
+		decompressor->raw, decompressor->rawLen) < 0) {
+		return -1;
+	} else {
+		*block = decompressor->raw;
+	}
+	*blockLen = decompressor->rawLen;
+	decompressor->rawBytes += decompressor->rawLen;
+	decompressor->headerLen = 0;
+	return consumed;
+}
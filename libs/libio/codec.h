@@ -0,0 +1,59 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Codecs
+#define CODEC_NONE 0
+#define CODEC_LZ 1  // LZ4 block format
+
+#define CODEC_BLOCK_SIZE (64 * 1024)  // Most data compressed at a time (so match offsets fit in 2 bytes)
+#define CODEC_HEADER_LEN 8  // Stored length (4 bytes) and original length (4 bytes) in front of each block
+#define CODEC_RAW_BIT 0x80000000  // Set in the stored length if the block is stored uncompressed
+#define CODEC_HASH_BITS 14
+#define CODEC_MIN_SAVING 8  // A block is only stored compressed if it shrinks by at least 1/8
+#define CODEC_MAX_SKIP_SHIFT 6  // Incompressible data is sampled at least once every 64 blocks
+
+// Most bytes compressData writes for len bytes of data
+#define CODEC_BOUND(len) ((len) + ((len) / CODEC_BLOCK_SIZE + 1) * CODEC_HEADER_LEN)
+
+/*
+ * Compresses data into a stream of blocks, each with a header (in network byte order) that says how long it is
+ * and whether it is compressed. Blocks that do not shrink enough are stored as they are, and after such a block,
+ * the next 2^n - 1 blocks are stored without trying (where n counts such blocks in a row),
+ * so incompressible data costs little more than a copy.
+ */
+struct Compressor {
+	uint32_t table[1 << CODEC_HASH_BITS];  // Last position of each hashed 4-byte sequence
+	int blocksToSkip;  // Blocks left to store without trying to compress them
+	int numIncompressible;  // Blocks in a row that did not shrink enough
+	uint64_t rawBytes;  // Data compressed so far
+	uint64_t compressedBytes;  // Bytes written for it, including headers
+};
+
+/*
+ * Turns a stream of blocks back into data. The stream can be fed in pieces of any size.
+ */
+struct Decompressor {
+	char header[CODEC_HEADER_LEN];
+	int headerLen;  // Amount of the current block's header received so far
+	char *stored;  // Current block as it was sent
+	int storedLen;  // Amount of the current block received so far
+	int blockLen;  // Stored length of the current block
+	int rawLen;  // Original length of the current block
+	int isRaw;
+	char *raw;  // Data of the last compressed block
+	uint64_t rawBytes;  // Data produced so far
+};
+
+int compressLZ(uint32_t *, const char *, int, char *, int);
+int decompressLZ(const char *, int, char *, int);
+
+void initCompressor(struct Compressor *);
+size_t compressData(struct Compressor *, const char *, size_t, char *);
+int initDecompressor(struct Decompressor *);
+void freeDecompressor(struct Decompressor *);
+int decompressData(struct Decompressor *, const char *, int, const char **, int *);
+
+#endif
@@ -0,0 +1,303 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "delta.h"
+#include "helpers.h"
+
+#define SIGNATURE_READ_SIZE (1024 * 1024)  // Amount of the old file hashed at a time
+
+/*
+ * The rsync rolling checksum of a block: the sum of its bytes in the low 16 bits,
+ * and the sum of each byte weighted by its distance from the end in the high 16 bits
+ */
+static uint32_t getWeakChecksum(const uint8_t *data, int len)
+{
+	uint32_t a = 0, b = 0;
+	for (int i = 0; i < len; i++) {
+		a += data[i];
+		b += (uint32_t)(len - i) * data[i];
+	}
+	return (a & 0xffff) | b << 16;
+}
+
+/*
+ * Slide a block's checksum one byte forward, dropping out and taking in
+ */
+static uint32_t rollWeakChecksum(uint32_t weak, uint8_t out, uint8_t in, int len)
+{
+	uint32_t a = (weak - out + in) & 0xffff;
+	uint32_t b = ((weak >> 16) - (uint32_t)len * out + a) & 0xffff;
+	return a | b << 16;
+}
+
+/*
+ * Pick a block size for a file of fileSize bytes: about the square root of the size (as rsync does),
+ * which balances the size of the signature against the data resent around each change
+ */
+int getDeltaBlockSize(uint64_t fileSize)
+{
+	int blockSize = MIN_DELTA_BLOCK;
+	while (blockSize < MAX_DELTA_BLOCK && (uint64_t)blockSize * blockSize < fileSize) {
+		blockSize *= 2;
+	}
+	return blockSize;
+}
+
+/*
+ * Write the signature of the first numBlocks blocks of fd: a random key for the strong hashes, followed by
+ * an entry for each block. The signature takes SIPHASH_KEY_LEN + numBlocks * SIGNATURE_ENTRY_LEN bytes.
+ */
+int makeSignature(int fd, int blockSize, uint32_t numBlocks, char *signature)
+{
+	// A random key keeps anyone from making a block that collides with the old file's on purpose
+	uint8_t *key = (uint8_t *)signature;
+	int randomFd = open("/dev/urandom", O_RDONLY);
+	if (randomFd < 0) {
+		perror("open");
+		return -1;
+	}
+	int status = readFully(randomFd, (char *)key, SIPHASH_KEY_LEN, 0);
+	close(randomFd);
+	if (status < 0) {
+		fprintf(stderr, "error: failed to read /dev/urandom\n");
+		return -1;
+	}
+
+	char *buffer = malloc(SIGNATURE_READ_SIZE);
+	if (!buffer) {
+		perror("malloc");
+		return -1;
+	}
+	int blocksPerRead = SIGNATURE_READ_SIZE / blockSize;
+	char *entry = signature + SIPHASH_KEY_LEN;
+	for (uint32_t i = 0; i < numBlocks; i += blocksPerRead) {
+		int count = numBlocks - i < (uint32_t)blocksPerRead ? (int)(numBlocks - i) : blocksPerRead;
+		if (readFully(fd, buffer, (size_t)count * blockSize, (off_t)i * blockSize) < 0) {
+			perror("pread");
+			free(buffer);
+			return -1;
+		}
+		for (int j = 0; j < count; j++, entry += SIGNATURE_ENTRY_LEN) {
+			const char *block = buffer + (size_t)j * blockSize;
+			uint64_t strong = sipHash(key, block, blockSize);
+			writeUint(entry, getWeakChecksum((const uint8_t *)block, blockSize), 4);
+			writeUint(entry + 4, strong >> 32, 4);
+			writeUint(entry + 8, strong, 4);
+		}
+	}
+	free(buffer);
+	return 0;
+}
+
+static uint32_t hashWeakChecksum(uint32_t weak)
+{
+	return (uint64_t)weak * 0x9e3779b97f4a7c15ULL >> 32;
+}
+
+/*
+ * Load a signature of numBlocks blocks of blockSize bytes. Pieces of data will be at most maxLen bytes.
+ */
+int initDeltaEncoder(struct DeltaEncoder *encoder, const char *signature, int blockSize, uint32_t numBlocks,
+	size_t maxLen)
+{
+	memset(encoder, 0, sizeof(struct DeltaEncoder));
+	encoder->blockSize = blockSize;
+	encoder->numBlocks = numBlocks;
+	memcpy(encoder->key, signature, SIPHASH_KEY_LEN);
+	uint32_t numBuckets = 1;
+	while (numBuckets < 2 * numBlocks) {
+		numBuckets *= 2;
+	}
+	encoder->bucketMask = numBuckets - 1;
+	encoder->workSize = maxLen + blockSize;
+	encoder->entries = malloc(numBlocks * sizeof(struct SignatureEntry));
+	encoder->buckets = malloc(numBuckets * sizeof(int32_t));
+	encoder->work = malloc(encoder->workSize);
+	if ((numBlocks && !encoder->entries) || !encoder->buckets || !encoder->work) {
+		freeDeltaEncoder(encoder);
+		return -1;
+	}
+
+	memset(encoder->buckets, -1, numBuckets * sizeof(int32_t));
+	const char *entry = signature + SIPHASH_KEY_LEN;
+	for (uint32_t i = 0; i < numBlocks; i++, entry += SIGNATURE_ENTRY_LEN) {
+		encoder->entries[i].weak = readUint(entry, 4);
+		encoder->entries[i].strong = readUint(entry + 4, 8);
+	}
+	// Insert from the end so that each bucket lists earlier blocks first
+	for (int32_t i = numBlocks - 1; i >= 0; i--) {
+		int32_t *bucket = encoder->buckets + (hashWeakChecksum(encoder->entries[i].weak) & encoder->bucketMask);
+		encoder->entries[i].next = *bucket;
+		*bucket = i;
+	}
+	return 0;
+}
+
+void freeDeltaEncoder(struct DeltaEncoder *encoder)
+{
+	free(encoder->entries);
+	free(encoder->buckets);
+	free(encoder->work);
+}
+
+/*
+ * Find a block of the old file with the same data as block. Return its index, or -1 if there is none.
+ */
+static int32_t findBlock(const struct DeltaEncoder *encoder, uint32_t weak, const char *block)
+{
+	int hasStrong = 0;
+	uint64_t strong = 0;
+	for (int32_t i = encoder->buckets[hashWeakChecksum(weak) & encoder->bucketMask]; i >= 0;
+		i = encoder->entries[i].next) {
+		if (encoder->entries[i].weak != weak) {
+			continue;
+		}
+		// The strong hash is only worth computing once the weak checksum matches
+		if (!hasStrong) {
+			strong = sipHash(encoder->key, block, encoder->blockSize);
+			hasStrong = 1;
+		}
+		if (encoder->entries[i].strong == strong) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static char *writeLiteral(struct DeltaEncoder *encoder, char *out, const char *data, size_t len)
+{
+	if (!len) {
+		return out;
+	}
+	out[0] = DELTA_LITERAL;
+	writeUint(out + 1, len, 4);
+	memcpy(out + DELTA_LITERAL_HEADER_LEN, data, len);
+	encoder->literalBytes += len;
+	return out + DELTA_LITERAL_HEADER_LEN + len;
+}
+
+/*
+ * Encode the next len bytes of the file into out, which must hold DELTA_BOUND(len) bytes. Up to a block of data
+ * may be held back until the next piece, unless isLast is set. Return the number of bytes written.
+ */
+size_t encodeDelta(struct DeltaEncoder *encoder, const char *data, size_t len, int isLast, char *out)
+{
+	char *work = encoder->work;
+	memcpy(work + encoder->pendingLen, data, len);
+	size_t workLen = encoder->pendingLen + len;
+	size_t blockSize = encoder->blockSize;
+	char *outPos = out;
+	char *lastCopy = NULL;  // Copy record that nothing has been written after, which the next copy may extend
+	size_t pos = 0, literalStart = 0;
+	uint32_t weak = 0;
+	int isRolling = 0;
+
+	while (encoder->numBlocks && pos + blockSize <= workLen) {
+		const uint8_t *block = (const uint8_t *)work + pos;
+		if (!isRolling) {
+			weak = getWeakChecksum(block, blockSize);
+			isRolling = 1;
+		}
+		int32_t match = findBlock(encoder, weak, (const char *)block);
+		if (match < 0) {
+			if (pos + blockSize < workLen) {
+				weak = rollWeakChecksum(weak, block[0], block[blockSize], blockSize);
+			}
+			pos++;
+			continue;
+		}
+
+		if (pos > literalStart) {
+			outPos = writeLiteral(encoder, outPos, work + literalStart, pos - literalStart);
+			lastCopy = NULL;
+		}
+		if (lastCopy && readUint(lastCopy + 1, 4) + readUint(lastCopy + 5, 4) == (uint32_t)match) {
+			writeUint(lastCopy + 5, readUint(lastCopy + 5, 4) + 1, 4);
+		} else {
+			lastCopy = outPos;
+			outPos[0] = DELTA_COPY;
+			writeUint(outPos + 1, match, 4);
+			writeUint(outPos + 5, 1, 4);
+			outPos += DELTA_COPY_LEN;
+		}
+		encoder->copiedBytes += blockSize;
+		pos += blockSize;
+		literalStart = pos;
+		isRolling = 0;
+	}
+
+	// Data after pos may still start a block once the next piece arrives
+	size_t literalEnd = isLast || !encoder->numBlocks ? workLen : pos;
+	outPos = writeLiteral(encoder, outPos, work + literalStart, literalEnd - literalStart);
+	encoder->pendingLen = workLen - literalEnd;
+	memmove(work, work + literalEnd, encoder->pendingLen);
+	return outPos - out;
+}
+
+/*
+ * Start rebuilding a file from oldFd, which has numBlocks blocks of blockSize bytes
+ */
+void initDeltaDecoder(struct DeltaDecoder *decoder, int oldFd, int blockSize, uint32_t numBlocks)
+{
+	memset(decoder, 0, sizeof(struct DeltaDecoder));
+	decoder->oldFd = oldFd;
+	decoder->blockSize = blockSize;
+	decoder->numBlocks = numBlocks;
+}
+
+/*
+ * Apply the next len bytes of records, queueing writes of literal data and copies of old blocks to fd.
+ * Return -1 if the records are malformed or cannot be written.
+ */
+int applyDelta(struct DeltaDecoder *decoder, struct FileWriter *writer, int fd, const char *data, int len)
+{
+	while (len > 0) {
+		if (decoder->literalLeft) {
+			int n = len < decoder->literalLeft ? len : (int)decoder->literalLeft;
+			if (queueFileWrite(writer, fd, decoder->offset, data, n) < 0) {
+				return -1;
+			}
+			decoder->offset += n;
+			decoder->literalLeft -= n;
+			data += n;
+			len -= n;
+			continue;
+		}
+
+		int type = decoder->headerLen ? decoder->header[0] : data[0];
+		if (type != DELTA_LITERAL && type != DELTA_COPY) {
+			fprintf(stderr, "error: malformed delta\n");
+			return -1;
+		}
+		int headerLen = type == DELTA_LITERAL ? DELTA_LITERAL_HEADER_LEN : DELTA_COPY_LEN;
+		int n = headerLen - decoder->headerLen;
+		n = len < n ? len : n;
+		memcpy(decoder->header + decoder->headerLen, data, n);
+		data += n;
+		len -= n;
+		if ((decoder->headerLen += n) < headerLen) {
+			break;
+		}
+		decoder->headerLen = 0;
+
+		if (type == DELTA_LITERAL) {
+			decoder->literalLeft = readUint(decoder->header + 1, 4);
+			continue;
+		}
+		uint64_t first = readUint(decoder->header + 1, 4), count = readUint(decoder->header + 5, 4);
+		if (!count || first + count > decoder->numBlocks) {
+			fprintf(stderr, "error: malformed delta\n");
+			return -1;
+		}
+		size_t copyLen = count * decoder->blockSize;
+		if (queueFileCopy(writer, fd, decoder->offset, decoder->oldFd, first * decoder->blockSize, copyLen) < 0) {
+			return -1;
+		}
+		decoder->offset += copyLen;
+		decoder->copiedBytes += copyLen;
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+#include "writer.h"
+
+#define SIGNATURE_FLAG 0x40  // Marks a request for part of the server's signature, or the answer to one (the ECE bit, which is otherwise unused)
+#define SIGNATURE_ENTRY_LEN 12  // Weak checksum (4 bytes) and strong hash (8 bytes) of a block, in network byte order
+#define MIN_DELTA_BLOCK 1024
+#define MAX_DELTA_BLOCK (64 * 1024)
+#define MAX_SIGNATURE_BLOCKS (1 << 24)  // Keeps a signature under 200 MB (a file of up to 1 TB with the largest blocks)
+
+// Delta records
+#define DELTA_LITERAL 1  // Data that follows the record (length, 4 bytes)
+#define DELTA_COPY 2  // Blocks of the old file (first block, 4 bytes, and number of blocks, 4 bytes)
+#define DELTA_LITERAL_HEADER_LEN 5
+#define DELTA_COPY_LEN 9
+
+// Most bytes encodeDelta writes for len bytes of data
+#define DELTA_BOUND(len) ((len) + MAX_DELTA_BLOCK + DELTA_LITERAL_HEADER_LEN)
+
+/*
+ * A block of the receiver's copy of the file
+ */
+struct SignatureEntry {
+	uint32_t weak;
+	uint64_t strong;
+	int32_t next;  // Next entry in the same bucket, or -1
+};
+
+/*
+ * Turns a file into a list of records that copy blocks the receiver already has from its old copy,
+ * given the old copy's signature, and carry everything else as it is. Blocks are found at any offset
+ * with a rolling checksum, and a match is confirmed with a keyed strong hash.
+ * Data can be fed in pieces of any size.
+ */
+struct DeltaEncoder {
+	int blockSize;
+	uint32_t numBlocks;
+	uint8_t key[SIPHASH_KEY_LEN];
+	struct SignatureEntry *entries;
+	int32_t *buckets;  // First entry with each weak checksum hash, or -1
+	uint32_t bucketMask;
+	char *work;  // Data left over from the last piece followed by the current piece
+	size_t workSize;
+	int pendingLen;  // Amount of data left over from the last piece (less than a block)
+	uint64_t copiedBytes;
+	uint64_t literalBytes;
+};
+
+/*
+ * Rebuilds a file from records, copying blocks from the old copy in the background through a FileWriter
+ */
+struct DeltaDecoder {
+	int oldFd;
+	int blockSize;
+	uint32_t numBlocks;
+	char header[DELTA_COPY_LEN];
+	int headerLen;  // Amount of the current record's header received so far
+	uint32_t literalLeft;  // Data of the current literal record not received yet
+	uint64_t offset;  // Where the next data goes in the new file
+	uint64_t copiedBytes;
+};
+
+int getDeltaBlockSize(uint64_t);
+int makeSignature(int, int, uint32_t, char *);
+
+int initDeltaEncoder(struct DeltaEncoder *, const char *, int, uint32_t, size_t);
+void freeDeltaEncoder(struct DeltaEncoder *);
+size_t encodeDelta(struct DeltaEncoder *, const char *, size_t, int, char *);
+
+void initDeltaDecoder(struct DeltaDecoder *, int, int, uint32_t);
+int applyDelta(struct DeltaDecoder *, struct FileWriter *, int, const char *, int);
+
+#endif
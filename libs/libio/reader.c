@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "reader.h"
+
+#define WAIT_INTERVAL 100  // How long either side sleeps when it has to wait, in microseconds
+
+/*
+ * Fill a buffer from the file, stopping early only at the end of the file
+ */
+static ssize_t readBlock(int fd, char *buffer)
+{
+	size_t len = 0;
+	while (len < READER_BLOCK_SIZE) {
+		ssize_t n = read(fd, buffer + len, READER_BLOCK_SIZE - len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		} else if (n == 0) {
+			break;
+		}
+		len += n;
+	}
+	return len;
+}
+
+static void *runReader(void *arg)
+{
+	struct FileReader *reader = arg;
+	struct ReaderBlock block;
+	off_t offset = lseek(reader->fd, 0, SEEK_CUR);  // The caller may have skipped the start of the file
+	offset = offset < 0 ? 0 : offset;
+
+	while (!atomic_load(&reader->isStopping)) {
+		if (!ringPop(&reader->freeBlocks, &block.index)) {
+			usleep(WAIT_INTERVAL);
+			continue;
+		}
+#ifdef POSIX_FADV_WILLNEED
+		// Ask the kernel to start on the buffers after this one while this one is read
+		posix_fadvise(reader->fd, offset + READER_BLOCK_SIZE,
+			(off_t)reader->numBlocks * READER_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+#endif
+		char *buffer = reader->buffers + (size_t)block.index * reader->bufferSize;
+		ssize_t len = readBlock(reader->fd, reader->input ? reader->input : buffer);
+		if (len < 0) {
+			perror("read");
+			atomic_store(&reader->error, errno);
+			break;
+		}
+		offset += len;
+		// Hashing and encoding here keeps them off the caller's thread
+		if (reader->digest) {
+			updateSha256(reader->digest, reader->input ? reader->input : buffer, len);
+		}
+		block.len = len;
+		const char *encoded = reader->input;
+		if (reader->delta) {
+			char *deltaOutput = reader->compressor ? reader->deltaOutput : buffer;
+			block.len = encodeDelta(reader->delta, reader->input, len, len < READER_BLOCK_SIZE, deltaOutput);
+			encoded = deltaOutput;
+		}
+		if (reader->compressor) {
+			block.len = compressData(reader->compressor, encoded, block.len, buffer);
+		}
+		// Never full since there are only numBlocks buffers
+		ringPush(&reader->filledBlocks, &block);
+		if (len < READER_BLOCK_SIZE) {
+			break;
+		}
+	}
+	atomic_store(&reader->isDone, 1);
+	return NULL;
+}
+
+/*
+ * Start a thread that reads fd from its current position into numBlocks pooled buffers.
+ * If delta is set, the caller reads the file as a delta made with it, and if codec is CODEC_LZ,
+ * the caller reads the file (or delta) compressed. If digest is set, the file is hashed into it as it is read,
+ * and the digest is complete once readFileAhead returns 0.
+ */
+int startFileReader(struct FileReader *reader, int fd, int numBlocks, struct DeltaEncoder *delta, int codec,
+	struct Sha256 *digest)
+{
+	memset(reader, 0, sizeof(struct FileReader));
+	reader->fd = fd;
+	reader->numBlocks = numBlocks;
+	reader->current.index = -1;
+	reader->delta = delta;
+	reader->digest = digest;
+	reader->bufferSize = delta ? DELTA_BOUND(READER_BLOCK_SIZE) : READER_BLOCK_SIZE;
+	if (codec == CODEC_LZ) {
+		reader->bufferSize = CODEC_BOUND(reader->bufferSize);
+		if (!(reader->compressor = malloc(sizeof(struct Compressor)))
+			|| (delta && !(reader->deltaOutput = malloc(DELTA_BOUND(READER_BLOCK_SIZE))))) {
+			perror("malloc");
+			goto failBuffers;
+		}
+		initCompressor(reader->compressor);
+	}
+	if ((delta || codec == CODEC_LZ) && !(reader->input = malloc(READER_BLOCK_SIZE))) {
+		perror("malloc");
+		goto failBuffers;
+	}
+	if (!(reader->buffers = malloc((size_t)numBlocks * reader->bufferSize))) {
+		perror("malloc");
+		goto failBuffers;
+	}
+	if (initRing(&reader->filledBlocks, numBlocks, sizeof(struct ReaderBlock)) < 0) {
+		perror("malloc");
+		free(reader->buffers);
+		goto failBuffers;
+	}
+	if (initRing(&reader->freeBlocks, numBlocks, sizeof(int)) < 0) {
+		perror("malloc");
+		goto fail;
+	}
+	for (int i = 0; i < numBlocks; i++) {
+		ringPush(&reader->freeBlocks, &i);
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	if ((errno = pthread_create(&reader->thread, NULL, runReader, reader))) {
+		perror("pthread_create");
+		freeRing(&reader->freeBlocks);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	freeRing(&reader->filledBlocks);
+	free(reader->buffers);
+failBuffers:
+	free(reader->compressor);
+	free(reader->input);
+	free(reader->deltaOutput);
+	return -1;
+}
+
+/*
+ * Get the next filled buffer. Returns 0 if there is none yet, or -1 if there will be no more.
+ */
+static int nextBlock(struct FileReader *reader)
+{
+	if (ringPop(&reader->filledBlocks, &reader->current)) {
+		reader->currentPos = 0;
+		return 1;
+	}
+	// The thread may have queued its last buffer just before finishing
+	if (atomic_load(&reader->isDone)) {
+		if (ringPop(&reader->filledBlocks, &reader->current)) {
+			reader->currentPos = 0;
+			return 1;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copy up to len bytes of the file. Fewer bytes are copied only at the end of the file.
+ * If shouldWait is not set and the data has not been read yet, this fails with EAGAIN instead of waiting.
+ * Returns the number of bytes copied, 0 at the end of the file, or -1 on failure.
+ */
+ssize_t readFileAhead(struct FileReader *reader, char *buffer, size_t len, int shouldWait)
+{
+	// Only wait if there is not enough data in this buffer and the next one is not ready
+	if (!shouldWait && (reader->current.index < 0
+		|| reader->current.len - reader->currentPos < len)
+		&& !ringSize(&reader->filledBlocks) && !atomic_load(&reader->isDone)) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	size_t copied = 0;
+	while (copied < len) {
+		if (reader->current.index < 0) {
+			int status = nextBlock(reader);
+			if (status < 0) {
+				break;
+			} else if (status == 0) {
+				usleep(WAIT_INTERVAL);
+				continue;
+			}
+		}
+
+		size_t copyLen = reader->current.len - reader->currentPos;
+		copyLen = len - copied < copyLen ? len - copied : copyLen;
+		memcpy(buffer + copied, reader->buffers + (size_t)reader->current.index * reader->bufferSize
+			+ reader->currentPos, copyLen);
+		copied += copyLen;
+		reader->currentPos += copyLen;
+		if (reader->currentPos == reader->current.len) {
+			ringPush(&reader->freeBlocks, &reader->current.index);
+			reader->current.index = -1;
+		}
+	}
+
+	if (!copied && atomic_load(&reader->error)) {
+		errno = atomic_load(&reader->error);
+		return -1;
+	}
+	return copied;
+}
+
+/*
+ * Stop the thread and free the buffers
+ */
+void stopFileReader(struct FileReader *reader)
+{
+	atomic_store(&reader->isStopping, 1);
+	pthread_join(reader->thread, NULL);
+	freeRing(&reader->filledBlocks);
+	freeRing(&reader->freeBlocks);
+	free(reader->buffers);
+	free(reader->compressor);
+	free(reader->input);
+	free(reader->deltaOutput);
+}
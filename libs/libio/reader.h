@@ -0,0 +1,56 @@
+#ifndef READER_H
+#define READER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "codec.h"
+#include "delta.h"
+#include "hash.h"
+#include "ring.h"
+
+#define READER_BLOCK_SIZE (1024 * 1024)  // Size of each pooled buffer
+#define DEFAULT_READER_BLOCKS 4  // Number of pooled buffers (4 MB in total)
+
+/*
+ * A filled buffer waiting to be consumed
+ */
+struct ReaderBlock {
+	size_t len;
+	int index;  // Which pooled buffer holds the data
+};
+
+/*
+ * Reads a file ahead of the caller from a background thread. The thread fills pooled buffers and hands
+ * them to the caller through a ring, and the caller hands emptied buffers back through a second ring.
+ * If the reader has a delta encoder, the thread turns the file into a delta against the receiver's copy,
+ * and if it has a compressor, the thread compresses the result. The caller gets the stream that comes out.
+ * Only one thread may call readFileAhead.
+ */
+struct FileReader {
+	int fd;
+	char *buffers;
+	size_t bufferSize;  // Size of each pooled buffer (room for an encoded block if the file is encoded)
+	int numBlocks;
+	struct DeltaEncoder *delta;  // NULL unless the file is sent as a delta (owned by the caller)
+	struct Sha256 *digest;  // NULL unless the file is hashed as it is read (owned by the caller)
+	struct Compressor *compressor;  // NULL unless the file is compressed
+	char *input;  // Block read from the file before it is encoded
+	char *deltaOutput;  // Delta of a block before it is compressed
+	struct Ring filledBlocks;  // ReaderBlocks, from the thread to the caller
+	struct Ring freeBlocks;  // Buffer indices, from the caller to the thread
+	struct ReaderBlock current;  // Buffer being consumed by the caller (index is -1 if none)
+	size_t currentPos;
+	atomic_int isDone;  // Set by the thread after it queues the last buffer
+	atomic_int isStopping;
+	atomic_int error;  // errno of a failed read, or 0
+	pthread_t thread;
+};
+
+int startFileReader(struct FileReader *, int, int, struct DeltaEncoder *, int, struct Sha256 *);
+ssize_t readFileAhead(struct FileReader *, char *, size_t, int);
+void stopFileReader(struct FileReader *);
+
+#endif
@@ -0,0 +1,346 @@
+#define _GNU_SOURCE  // For copy_file_range
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "writer.h"
+
+#define WRITE_BATCH 64  // Maximum number of buffers written with one pwritev
+#define WAIT_INTERVAL 100  // How long either side sleeps when it has to wait, in microseconds
+
+static void setError(struct FileWriter *writer, const char *msg)
+{
+	perror(msg);
+	int expected = 0;
+	atomic_compare_exchange_strong(&writer->error, &expected, errno);
+}
+
+/*
+ * Write a batch of contiguous buffers, retrying until all of it is written
+ */
+static void writeBatch(struct FileWriter *writer, const struct WriterBlock *batch, int batchLen)
+{
+	struct iovec iov[WRITE_BATCH];
+	for (int i = 0; i < batchLen; i++) {
+		iov[i].iov_base = writer->buffers + (size_t)batch[i].index * WRITER_BLOCK_SIZE;
+		iov[i].iov_len = batch[i].len;
+		if (writer->digest) {
+			updateSha256(writer->digest, iov[i].iov_base, iov[i].iov_len);
+		}
+	}
+
+	struct iovec *currIov = iov;
+	int iovLeft = batchLen;
+	off_t offset = batch[0].offset;
+	while (iovLeft && !atomic_load_explicit(&writer->error, memory_order_relaxed)) {
+		ssize_t written = pwritev(batch[0].fd, currIov, iovLeft, offset);
+		if (written < 0) {
+			if (errno != EINTR) {
+				setError(writer, "pwritev");
+			}
+			continue;
+		}
+		offset += written;
+		// Skip what was written, which may end in the middle of a buffer
+		for ( ; iovLeft && (size_t)written >= currIov->iov_len; currIov++, iovLeft--) {
+			written -= currIov->iov_len;
+		}
+		if (iovLeft) {
+			currIov->iov_base = (char *)currIov->iov_base + written;
+			currIov->iov_len -= written;
+		}
+	}
+
+	for (int i = 0; i < batchLen; i++) {
+		ringPush(&writer->freeBlocks, &batch[i].index);
+	}
+}
+
+/*
+ * Copy a range of one file into another, letting the kernel do it where it can
+ * (which may share the blocks instead of copying them). Data that is hashed has to pass through memory.
+ */
+static void copyRange(struct FileWriter *writer, const struct WriterBlock *block)
+{
+	off_t sourceOffset = block->sourceOffset, offset = block->offset;
+	size_t len = block->len;
+#ifdef __linux__
+	while (len && !writer->digest && !atomic_load_explicit(&writer->error, memory_order_relaxed)) {
+		ssize_t copied = copy_file_range(block->sourceFd, &sourceOffset, block->fd, &offset, len, 0);
+		if (copied < 0 && errno == EINTR) {
+			continue;
+		} else if (copied <= 0) {
+			// Not supported between these files (or the source is short), so fall back to reading and writing
+			break;
+		}
+		len -= copied;
+	}
+#endif
+
+	char buffer[WRITER_BLOCK_SIZE];
+	while (len && !atomic_load_explicit(&writer->error, memory_order_relaxed)) {
+		ssize_t n = pread(block->sourceFd, buffer, len < sizeof(buffer) ? len : sizeof(buffer), sourceOffset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			if (n == 0) {
+				errno = EIO;
+			}
+			setError(writer, "pread");
+			return;
+		}
+		if (writer->digest) {
+			updateSha256(writer->digest, buffer, n);
+		}
+		for (ssize_t written = 0; written < n; ) {
+			ssize_t m = pwrite(block->fd, buffer + written, n - written, offset + written);
+			if (m < 0 && errno != EINTR) {
+				setError(writer, "pwrite");
+				return;
+			}
+			written += m < 0 ? 0 : m;
+		}
+		sourceOffset += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+static void syncFile(struct FileWriter *writer, const struct WriterBlock *block)
+{
+	if (!atomic_load(&writer->error) && fsync(block->fd) < 0) {
+		setError(writer, "fsync");
+	}
+}
+
+static void closeFile(struct FileWriter *writer, const struct WriterBlock *block)
+{
+	if (block->index == WRITER_SYNC_AND_CLOSE && !atomic_load(&writer->error) && fsync(block->fd) < 0) {
+		setError(writer, "fsync");
+	}
+	if (close(block->fd) < 0) {
+		setError(writer, "close");
+	}
+}
+
+static void *runWriter(void *arg)
+{
+	struct FileWriter *writer = arg;
+	struct WriterBlock batch[WRITE_BATCH];
+	struct WriterBlock block;
+	int batchLen = 0;
+
+	for (;;) {
+		int isFinishing = atomic_load(&writer->isFinishing);
+		int hasWork = 0;
+		// Collect buffers until one is not contiguous with the rest, the batch is full, or there are none left
+		while (batchLen < WRITE_BATCH && ringPop(&writer->filledBlocks, &block)) {
+			hasWork = 1;
+			if (batchLen && (block.index < 0 || block.fd != batch[0].fd
+				|| block.offset != batch[batchLen - 1].offset + (off_t)batch[batchLen - 1].len)) {
+				writeBatch(writer, batch, batchLen);
+				batchLen = 0;
+			}
+			if (block.index == WRITER_COPY) {
+				copyRange(writer, &block);
+			} else if (block.index == WRITER_SYNC) {
+				syncFile(writer, &block);
+			} else if (block.index < 0) {
+				closeFile(writer, &block);
+			} else {
+				batch[batchLen++] = block;
+			}
+		}
+		if (batchLen) {
+			writeBatch(writer, batch, batchLen);
+			batchLen = 0;
+		} else if (!hasWork && isFinishing) {
+			break;
+		} else if (!hasWork) {
+			usleep(WAIT_INTERVAL);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Start a thread that writes using numBlocks pooled buffers
+ */
+int startFileWriter(struct FileWriter *writer, int numBlocks)
+{
+	memset(writer, 0, sizeof(struct FileWriter));
+	writer->numBlocks = numBlocks;
+	writer->currentIndex = -1;
+	if (!(writer->buffers = malloc((size_t)numBlocks * WRITER_BLOCK_SIZE))) {
+		perror("malloc");
+		return -1;
+	}
+	// Twice as many slots as buffers so that closes rarely have to wait
+	if (initRing(&writer->filledBlocks, 2 * numBlocks, sizeof(struct WriterBlock)) < 0) {
+		perror("malloc");
+		free(writer->buffers);
+		return -1;
+	}
+	if (initRing(&writer->freeBlocks, numBlocks, sizeof(int)) < 0) {
+		perror("malloc");
+		goto fail;
+	}
+	for (int i = 0; i < numBlocks; i++) {
+		ringPush(&writer->freeBlocks, &i);
+	}
+
+	if ((errno = pthread_create(&writer->thread, NULL, runWriter, writer))) {
+		perror("pthread_create");
+		freeRing(&writer->freeBlocks);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	freeRing(&writer->filledBlocks);
+	free(writer->buffers);
+	return -1;
+}
+
+/*
+ * Hand a block to the thread, waiting if the ring is full
+ */
+static void pushBlock(struct FileWriter *writer, const struct WriterBlock *block)
+{
+	while (!ringPush(&writer->filledBlocks, block)) {
+		usleep(WAIT_INTERVAL);
+	}
+}
+
+/*
+ * Hand the buffer being filled (if any) to the thread
+ */
+static void queueCurrentBlock(struct FileWriter *writer)
+{
+	if (writer->currentIndex < 0) {
+		return;
+	}
+	struct WriterBlock block = { .fd = writer->currentFd, .offset = writer->offset - writer->currentLen,
+		.len = writer->currentLen, .index = writer->currentIndex };
+	pushBlock(writer, &block);
+	writer->currentIndex = -1;
+	writer->currentLen = 0;
+}
+
+/*
+ * Copy data to be written at offset in fd. This only waits if every buffer is full.
+ * Returns -1 if an earlier write failed.
+ */
+int queueFileWrite(struct FileWriter *writer, int fd, off_t offset, const char *data, size_t len)
+{
+	if (writer->currentIndex >= 0 && (fd != writer->currentFd || offset != writer->offset)) {
+		queueCurrentBlock(writer);
+	}
+	if (writer->currentIndex < 0) {
+		writer->currentFd = fd;
+		writer->offset = offset;
+	}
+	while (len) {
+		if (atomic_load_explicit(&writer->error, memory_order_relaxed)) {
+			return -1;
+		}
+		if (writer->currentIndex < 0 && !ringPop(&writer->freeBlocks, &writer->currentIndex)) {
+			usleep(WAIT_INTERVAL);
+			continue;
+		}
+
+		size_t copyLen = WRITER_BLOCK_SIZE - writer->currentLen;
+		copyLen = len < copyLen ? len : copyLen;
+		memcpy(writer->buffers + (size_t)writer->currentIndex * WRITER_BLOCK_SIZE
+			+ writer->currentLen, data, copyLen);
+		writer->currentLen += copyLen;
+		writer->offset += copyLen;
+		data += copyLen;
+		len -= copyLen;
+		if (writer->currentLen == WRITER_BLOCK_SIZE) {
+			queueCurrentBlock(writer);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Have the thread copy len bytes at sourceOffset in sourceFd to offset in fd.
+ * Returns -1 if an earlier write failed.
+ */
+int queueFileCopy(struct FileWriter *writer, int fd, off_t offset, int sourceFd, off_t sourceOffset, size_t len)
+{
+	queueCurrentBlock(writer);
+	struct WriterBlock block = { .fd = fd, .offset = offset, .len = len, .index = WRITER_COPY,
+		.sourceFd = sourceFd, .sourceOffset = sourceOffset };
+	pushBlock(writer, &block);
+	return atomic_load(&writer->error) ? -1 : 0;
+}
+
+/*
+ * Have the thread close fd (syncing it first if shouldSync is set) after everything queued for it is written.
+ * Returns -1 if an earlier write failed (fd is still closed).
+ */
+int queueFileClose(struct FileWriter *writer, int fd, int shouldSync)
+{
+	if (writer->currentIndex >= 0 && writer->currentFd == fd) {
+		queueCurrentBlock(writer);
+	}
+	struct WriterBlock block = { .fd = fd, .index = shouldSync ? WRITER_SYNC_AND_CLOSE : WRITER_CLOSE };
+	pushBlock(writer, &block);
+	return atomic_load(&writer->error) ? -1 : 0;
+}
+
+/*
+ * Have the thread sync fd after everything queued for it is written, so that it is on the disk before
+ * anything queued after this. Returns -1 if an earlier write failed.
+ */
+int queueFileSync(struct FileWriter *writer, int fd)
+{
+	if (writer->currentIndex >= 0 && writer->currentFd == fd) {
+		queueCurrentBlock(writer);
+	}
+	struct WriterBlock block = { .fd = fd, .index = WRITER_SYNC };
+	pushBlock(writer, &block);
+	return atomic_load(&writer->error) ? -1 : 0;
+}
+
+/*
+ * Hash everything that is queued into digest, which is complete once the thread is stopped. This must be called
+ * before anything is queued, and the digest only covers a file's data if its writes and copies are queued in order.
+ */
+void hashFileWrites(struct FileWriter *writer, struct Sha256 *digest)
+{
+	// The thread only reads digest after popping a block, and the ring orders this before that
+	writer->digest = digest;
+}
+
+/*
+ * Queue any partly filled buffer and let the thread exit once it is done.
+ * This does not wait for the thread.
+ */
+void finishFileWriter(struct FileWriter *writer)
+{
+	if (atomic_load(&writer->isFinishing)) {
+		return;
+	}
+	queueCurrentBlock(writer);
+	atomic_store(&writer->isFinishing, 1);
+}
+
+/*
+ * Finish writing, wait for the thread, and free the buffers.
+ * Returns -1 if any write, sync, or close failed.
+ */
+int stopFileWriter(struct FileWriter *writer)
+{
+	finishFileWriter(writer);
+	pthread_join(writer->thread, NULL);
+	freeRing(&writer->filledBlocks);
+	freeRing(&writer->freeBlocks);
+	free(writer->buffers);
+	return atomic_load(&writer->error) ? -1 : 0;
+}
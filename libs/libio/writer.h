@@ -0,0 +1,63 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "hash.h"
+#include "ring.h"
+
+#define WRITER_BLOCK_SIZE (64 * 1024)  // Size of each pooled buffer
+#define DEFAULT_WRITER_BLOCKS 64  // Number of pooled buffers (4 MB in total)
+#define WRITER_CLOSE -1  // Block index that closes the file once everything before it is written
+#define WRITER_SYNC_AND_CLOSE -2  // Same as WRITER_CLOSE, but the file is synced first
+#define WRITER_COPY -3  // Block index that copies len bytes from another file instead of writing a buffer
+#define WRITER_SYNC -4  // Block index that syncs the file once everything before it is written
+
+/*
+ * A filled buffer waiting to be written, or a request to close, sync, or copy into a file
+ */
+struct WriterBlock {
+	int fd;
+	off_t offset;  // Where the data goes in the file
+	size_t len;
+	int index;  // Which pooled buffer holds the data, or one of the requests above
+	int sourceFd;  // File a copy reads from
+	off_t sourceOffset;
+};
+
+/*
+ * Writes data to files from a background thread. The caller copies data into a pooled buffer,
+ * and a buffer is handed to the thread through a ring when it is full or the next write is not contiguous with it.
+ * The thread writes contiguous buffers with one pwritev and hands them back through a second ring.
+ * Files handed to queueFileClose are closed by the thread, and syncs queued with queueFileSync and copies between files
+ * queued with queueFileCopy are done by the thread too. If the writer has a digest, the thread also hashes the data in the order it was queued.
+ * Only one thread may queue writes, copies, and closes.
+ */
+struct FileWriter {
+	char *buffers;
+	int numBlocks;
+	struct Ring filledBlocks;  // WriterBlocks, from the caller to the thread
+	struct Ring freeBlocks;  // Buffer indices, from the thread to the caller
+	int currentIndex;  // Buffer being filled by the caller, or -1
+	int currentFd;  // File the current buffer goes to
+	size_t currentLen;  // Amount of data in the current buffer
+	off_t offset;  // File offset right after the data in the current buffer
+	struct Sha256 *digest;  // NULL unless the data is hashed (owned by the caller)
+	atomic_int isFinishing;
+	atomic_int error;  // errno of the first failed write, sync, or close, or 0
+	pthread_t thread;
+};
+
+int startFileWriter(struct FileWriter *, int);
+int queueFileWrite(struct FileWriter *, int, off_t, const char *, size_t);
+int queueFileCopy(struct FileWriter *, int, off_t, int, off_t, size_t);
+int queueFileClose(struct FileWriter *, int, int);
+int queueFileSync(struct FileWriter *, int);
+void hashFileWrites(struct FileWriter *, struct Sha256 *);
+void finishFileWriter(struct FileWriter *);
+int stopFileWriter(struct FileWriter *);
+
+#endif
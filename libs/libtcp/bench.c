@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tcp.h"
+#include "window.h"
+
+#define DEFAULT_MIN_TIME 200000000L  // Minimum time spent measuring an operation, in ns
+#define MAX_RESULTS 64
+#define MAX_NAME_LEN 64
+
+struct BenchResult {
+	char name[MAX_NAME_LEN];
+	double nsPerOp;
+	double bytesPerSec;
+};
+
+static const int payloadSizes[] = { 0, 64, 256, MSS };
+static const int windowCapacities[] = { 4, 64, 1024, 16384 };
+
+static struct BenchResult results[MAX_RESULTS];
+static int numResults = 0;
+static long minTime = DEFAULT_MIN_TIME;
+
+// Written to after every operation so the compiler cannot discard the work
+static volatile uint32_t sink;
+
+static long nowNanos(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Record a result given the total time taken by a number of operations,
+ * each of which processed bytesPerOp bytes
+ */
+static void record(const char *name, int param, long elapsed, long ops, int bytesPerOp)
+{
+	if (numResults == MAX_RESULTS) {
+		return;
+	}
+	struct BenchResult *result = results + numResults++;
+	snprintf(result->name, MAX_NAME_LEN, "%s/%d", name, param);
+	result->nsPerOp = (double)elapsed / ops;
+	result->bytesPerSec = result->nsPerOp > 0 ? bytesPerOp * 1e9 / result->nsPerOp : 0;
+}
+
+struct SegmentContext {
+	struct TCPSegment segment;
+	char data[MSS];
+	int dataLen;
+};
+
+struct WindowContext {
+	struct Window *window;
+	struct TCPSegmentEntry entry;
+	int index;
+};
+
+/*
+ * Run an operation in batches of doubling size until a batch takes at least minTime.
+ * setup (if given) is called before each batch and is not timed.
+ */
+static void runBench(const char *name, int param, int bytesPerOp, void *ctx,
+	void (*setup)(void *), void (*op)(void *, long))
+{
+	for (long ops = 1; ; ops *= 2) {
+		if (setup) {
+			setup(ctx);
+		}
+		long start = nowNanos();
+		for (long i = 0; i < ops; i++) {
+			op(ctx, i);
+		}
+		long elapsed = nowNanos() - start;
+		if (elapsed >= minTime) {
+			record(name, param, elapsed, ops, bytesPerOp);
+			return;
+		}
+	}
+}
+
+static void encodeDataOp(void *ctx, long i)
+{
+	struct SegmentContext *c = ctx;
+	encodeDataSegment(&c->segment, 1234, 4444, i, 1, i, 1, c->data, c->dataLen);
+	sink = c->segment.checksum;
+}
+
+static void encodeACKOp(void *ctx, long i)
+{
+	struct SegmentContext *c = ctx;
+	encodeACKSegment(&c->segment, 1234, 4444, 1, i, i, 1, NULL, 0);
+	sink = c->segment.checksum;
+}
+
+/*
+ * Decode a copy of the segment, since decoding converts it in place
+ */
+static void decodeOp(void *ctx, long i)
+{
+	struct SegmentContext *c = ctx;
+	struct TCPSegment segment;
+	memcpy(&segment, &c->segment, HEADER_LEN);
+	sink = decodeTCPSegment(&segment) + segment.seqNum;
+}
+
+static void stampOp(void *ctx, long i)
+{
+	struct SegmentContext *c = ctx;
+	stampTCPSegment(&c->segment, i);
+	sink = c->segment.checksum;
+}
+
+static void sumOp(void *ctx, long i)
+{
+	sink = calculateSumOfHeaderWords(&((struct SegmentContext *)ctx)->segment);
+}
+
+static void checksumOp(void *ctx, long i)
+{
+	sink = isChecksumValid(&((struct SegmentContext *)ctx)->segment);
+}
+
+static void benchSegment(void)
+{
+	struct SegmentContext c;
+	memset(c.data, 'x', MSS);
+
+	for (int i = 0; i < sizeof(payloadSizes) / sizeof(*payloadSizes); i++) {
+		c.dataLen = payloadSizes[i];
+		runBench("encodeDataSegment", c.dataLen, HEADER_LEN + c.dataLen, &c, NULL, encodeDataOp);
+	}
+	runBench("encodeACKSegment", 0, HEADER_LEN, &c, NULL, encodeACKOp);
+
+	encodeACKSegment(&c.segment, 1234, 4444, 2, 1, 1, 1, NULL, 0);
+	runBench("decodeTCPSegment", HEADER_LEN, HEADER_LEN, &c, NULL, decodeOp);
+	runBench("stampTCPSegment", HEADER_LEN, HEADER_LEN, &c, NULL, stampOp);
+	decodeTCPSegment(&c.segment);
+	runBench("calculateSumOfHeaderWords", HEADER_LEN, HEADER_LEN, &c, NULL, sumOp);
+	runBench("isChecksumValid", HEADER_LEN, HEADER_LEN, &c, NULL, checksumOp);
+}
+
+/*
+ * Bring a window to half full so that offer and deleteHead never hit the edge cases
+ */
+static void halfFillWindow(void *ctx)
+{
+	struct WindowContext *c = ctx;
+	while (!isEmpty(c->window)) {
+		deleteHead(c->window);
+	}
+	while (c->window->length < c->window->capacity / 2) {
+		offer(c->window, &c->entry);
+	}
+}
+
+static void offerDeleteOp(void *ctx, long i)
+{
+	struct WindowContext *c = ctx;
+	offer(c->window, &c->entry);
+	deleteHead(c->window);
+}
+
+static void nextOp(void *ctx, long i)
+{
+	struct WindowContext *c = ctx;
+	sink = c->index = next(c->window, c->index);
+}
+
+static void benchWindow(void)
+{
+	struct WindowContext c;
+	encodeDataSegment(&c.entry.segment, 1234, 4444, 2, 1, 1, 1, NULL, 0);
+	c.entry.dataLen = MSS;
+
+	for (int i = 0; i < sizeof(windowCapacities) / sizeof(*windowCapacities); i++) {
+		int capacity = windowCapacities[i];
+		if (!(c.window = newWindow(capacity))) {
+			perror("malloc");
+			exit(1);
+		}
+
+		runBench("offer+deleteHead", capacity, sizeof(struct TCPSegmentEntry),
+			&c, halfFillWindow, offerDeleteOp);
+		c.index = 0;
+		runBench("next", capacity, 0, &c, NULL, nextOp);
+
+		freeWindow(c.window);
+	}
+}
+
+/*
+ * Print the results, comparing them against a baseline file if one is given.
+ * The output is in the same format as the baseline file.
+ */
+static void printResults(FILE *baseline)
+{
+	char line[256];
+	char baseName[MAX_NAME_LEN];
+	double baseNsPerOp, baseBytesPerSec;
+
+	for (int i = 0; i < numResults; i++) {
+		const struct BenchResult *result = results + i;
+		printf("%-36s %12.2f ns/op %14.0f B/s", result->name,
+			result->nsPerOp, result->bytesPerSec);
+		if (baseline) {
+			rewind(baseline);
+			while (fgets(line, sizeof(line), baseline)) {
+				if (sscanf(line, "%63s %lf ns/op %lf B/s", baseName,
+					&baseNsPerOp, &baseBytesPerSec) == 3
+					&& strcmp(baseName, result->name) == 0 && baseNsPerOp > 0) {
+					printf(" %+7.1f%%", 100 * (result->nsPerOp - baseNsPerOp) / baseNsPerOp);
+					break;
+				}
+			}
+		}
+		printf("\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	FILE *baseline = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:t:")) != -1) {
+		switch (opt) {
+		case 'b':
+			if (!(baseline = fopen(optarg, "r"))) {
+				perror("fopen");
+				return 1;
+			}
+			break;
+		case 't':
+			minTime = strtol(optarg, NULL, 10) * 1000000L;
+			if (minTime <= 0) {
+				fprintf(stderr, "error: invalid time\n");
+				return 1;
+			}
+			break;
+		default:
+			fprintf(stderr, "usage: tcpbench [-b baseline] [-t ms per benchmark]\n");
+			return 1;
+		}
+	}
+
+	benchSegment();
+	benchWindow();
+	printResults(baseline);
+
+	if (baseline) {
+		fclose(baseline);
+	}
+	return 0;
+}
@@ -0,0 +1,245 @@
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fec.h"
+
+static void xorInto(char *dest, const char *src, int len)
+{
+	for (int i = 0; i < len; i++) {
+		dest[i] ^= src[i];
+	}
+}
+
+/*
+ * Start an encoder with the given number of segments per group
+ */
+void initFECEncoder(struct FECEncoder *encoder, int groupSize)
+{
+	memset(encoder, 0, sizeof(struct FECEncoder));
+	encoder->groupSize = groupSize;
+}
+
+/*
+ * Add a data segment to the current group. Return 1 if the group is now full.
+ */
+int addToFECGroup(struct FECEncoder *encoder, uint32_t seqNum, const char *data, int dataLen)
+{
+	if (encoder->count == 0) {
+		encoder->startSeq = seqNum;
+	}
+	xorInto(encoder->parity, data, dataLen);
+	encoder->count++;
+	encoder->totalLen += dataLen;
+	if (dataLen > encoder->maxLen) {
+		encoder->maxLen = dataLen;
+	}
+	return encoder->count >= encoder->groupSize;
+}
+
+/*
+ * Fill a parity segment (in network byte order) for the current group and start a new group.
+ * Return the amount of data in the segment, or 0 if the group is empty.
+ */
+int fillParitySegment(struct FECEncoder *encoder, struct TCPSegment *segment,
+	uint16_t sourcePort, uint16_t destPort, uint32_t ackNum, uint32_t tsVal, uint32_t tsEcr)
+{
+	if (encoder->count == 0) {
+		return 0;
+	}
+	int dataLen = encoder->maxLen;
+	encodeTCPSegment(segment, sourcePort, destPort, encoder->startSeq, ackNum,
+		FEC_FLAG, tsVal, tsEcr, encoder->parity, dataLen);
+	segment->recvWindow = htons(encoder->totalLen);
+	segment->urgentPtr = htons(encoder->count);
+	checksumTCPSegment(segment);
+
+	initFECEncoder(encoder, encoder->groupSize);
+	return dataLen;
+}
+
+/*
+ * Construct a decoder that keeps the last capacity data segments, starting at baseSeq.
+ * Segments are received into (and rebuilt in) buffers from pool, which must have room for capacity + 2 segments.
+ */
+struct FECDecoder *newFECDecoder(int capacity, uint32_t baseSeq, struct BufferPool *pool)
+{
+	struct FECSlot *slots = calloc(capacity, sizeof(struct FECSlot));
+	if (!slots) {
+		return NULL;
+	}
+	struct FECDecoder *decoder = calloc(1, sizeof(struct FECDecoder));
+	if (!decoder) {
+		free(slots);
+		return NULL;
+	}
+
+	decoder->slots = slots;
+	decoder->pool = pool;
+	decoder->capacity = capacity;
+	decoder->baseSeq = baseSeq;
+	return decoder;
+}
+
+/*
+ * Free a decoder, releasing the segments it keeps
+ */
+void freeFECDecoder(struct FECDecoder *decoder)
+{
+	for (int i = 0; i < decoder->capacity; i++) {
+		if (decoder->slots[i].segment) {
+			releaseBuffer(decoder->slots[i].segment);
+		}
+	}
+	free(decoder->slots);
+	free(decoder);
+}
+
+static struct FECSlot *getSlot(const struct FECDecoder *decoder, uint32_t seqNum)
+{
+	return decoder->slots + (seqNum - decoder->baseSeq) / MSS % decoder->capacity;
+}
+
+/*
+ * Put a reference to a pooled segment (in host byte order) in its slot, releasing the one it replaces.
+ * Return the slot, or NULL if the segment was dropped.
+ */
+static struct FECSlot *putSegment(struct FECDecoder *decoder, uint32_t nextExpectedSeq,
+	struct TCPSegment *segment, int dataLen)
+{
+	uint32_t slotsLen = (uint32_t)decoder->capacity * MSS;
+	if (segment->seqNum - nextExpectedSeq >= slotsLen || dataLen <= 0) {
+		return NULL;
+	}
+	// Move the base up by whole rounds of slots (which keeps every segment in its slot) long before
+	// the distance from it wraps around, since 2^32 is not a multiple of a round
+	uint32_t distance = nextExpectedSeq - decoder->baseSeq;
+	if (distance >= 1U << 31) {
+		decoder->baseSeq += distance / slotsLen * slotsLen;
+	}
+	struct FECSlot *slot = getSlot(decoder, segment->seqNum);
+	if (slot->segment) {
+		releaseBuffer(slot->segment);
+	}
+	holdBuffer(segment);
+	slot->segment = segment;
+	slot->seqNum = segment->seqNum;
+	slot->dataLen = dataLen;
+	slot->isRecovered = 0;
+	slot->data = segment->data;
+	return slot;
+}
+
+/*
+ * Keep a pooled data segment (in host byte order) that has not been delivered yet (seqNum >= nextExpectedSeq)
+ * for rebuilding others. The decoder takes its own reference, so the caller still releases the segment.
+ * Segments too far past nextExpectedSeq are dropped since their slot still holds a segment that has not been delivered.
+ * Return 1 if the segment was kept, or 0 if it was dropped.
+ */
+int storeFECSegment(struct FECDecoder *decoder, uint32_t nextExpectedSeq, struct TCPSegment *segment, int dataLen)
+{
+	return putSegment(decoder, nextExpectedSeq, segment, dataLen) != NULL;
+}
+
+/*
+ * Keep a parity segment (in host byte order) until its group can be rebuilt.
+ * The oldest parity segment is replaced if there is no room.
+ */
+void storeFECParity(struct FECDecoder *decoder, const struct TCPSegment *segment, int dataLen)
+{
+	if (segment->urgentPtr == 0 || segment->urgentPtr > MAX_FEC_GROUP) {
+		return;
+	}
+	struct FECParity *parity = decoder->parities + decoder->nextParity;
+	decoder->nextParity = (decoder->nextParity + 1) % FEC_PARITY_SLOTS;
+	parity->startSeq = segment->seqNum;
+	parity->count = segment->urgentPtr;
+	parity->totalLen = segment->recvWindow;
+	memset(parity->data, 0, MSS);
+	memcpy(parity->data, segment->data, dataLen);
+}
+
+/*
+ * Rebuild the only missing segment of a group, if there is one.
+ * Return 1 if a segment was rebuilt, or 0 if the parity segment can be kept for later.
+ * A parity segment whose group is complete or cannot be rebuilt is emptied.
+ */
+static int recoverGroup(struct FECDecoder *decoder, struct FECParity *parity, uint32_t nextExpectedSeq)
+{
+	uint32_t missingSeq = 0;
+	int numMissing = 0;
+	int presentLen = 0;
+	char data[MSS];
+	memcpy(data, parity->data, MSS);
+
+	for (int i = 0; i < parity->count; i++) {
+		uint32_t seqNum = parity->startSeq + i * MSS;
+		const struct FECSlot *slot = getFECSegment(decoder, seqNum);
+		if (slot) {
+			xorInto(data, slot->data, slot->dataLen);
+			presentLen += slot->dataLen;
+		} else if ((int32_t)(seqNum - nextExpectedSeq) < 0) {
+			// Delivered but no longer kept, so the group cannot be rebuilt
+			parity->count = 0;
+			return 0;
+		} else {
+			missingSeq = seqNum;
+			numMissing++;
+		}
+	}
+	if (numMissing > 1) {
+		return 0;
+	}
+
+	int missingLen = parity->totalLen - presentLen;
+	parity->count = 0;
+	if (numMissing == 0 || missingLen <= 0 || missingLen > MSS) {
+		return 0;
+	}
+	struct TCPSegment *rebuilt = allocBuffer(decoder->pool);
+	if (!rebuilt) {
+		return 0;
+	}
+	rebuilt->seqNum = missingSeq;
+	memcpy(rebuilt->data, data, missingLen);
+	struct FECSlot *slot = putSegment(decoder, nextExpectedSeq, rebuilt, missingLen);
+	releaseBuffer(rebuilt);
+	if (!slot) {
+		return 0;
+	}
+	slot->isRecovered = 1;
+	return 1;
+}
+
+/*
+ * Rebuild as many missing segments as the kept parity segments allow.
+ * Return the number of segments rebuilt.
+ */
+int recoverFECSegments(struct FECDecoder *decoder, uint32_t nextExpectedSeq)
+{
+	int numRecovered = 0;
+	for (int i = 0; i < FEC_PARITY_SLOTS; i++) {
+		struct FECParity *parity = decoder->parities + i;
+		if (parity->count == 0) {
+			continue;
+		}
+		if ((int32_t)(parity->startSeq + parity->totalLen - nextExpectedSeq) <= 0) {
+			parity->count = 0;  // Every segment in the group was delivered
+			continue;
+		}
+		numRecovered += recoverGroup(decoder, parity, nextExpectedSeq);
+	}
+	return numRecovered;
+}
+
+/*
+ * Get the kept data segment with the given seq, or NULL if it is missing
+ */
+const struct FECSlot *getFECSegment(const struct FECDecoder *decoder, uint32_t seqNum)
+{
+	const struct FECSlot *slot = getSlot(decoder, seqNum);
+	if (slot->dataLen == 0 || slot->seqNum != seqNum) {
+		return NULL;
+	}
+	return slot;
+}
@@ -0,0 +1,69 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+
+#include "tcp.h"
+#include "pool.h"
+
+#define FEC_FLAG 0x80  // Marks a parity segment (the CWR bit, which is otherwise unused)
+#define MIN_FEC_GROUP 2
+#define MAX_FEC_GROUP 32  // Keeps the group length within the 16-bit recvWindow field
+#define DEFAULT_FEC_SLOTS 256  // Number of segments the decoder keeps when the window size is not known
+#define FEC_PARITY_SLOTS 8  // Number of parity segments the decoder keeps
+
+/*
+ * A parity segment covers a group of consecutive data segments, all of which except the last are MSS long.
+ * seqNum is the seq of the first segment, urgentPtr is the number of segments, recvWindow is the total length
+ * of the group, and the data is the XOR of the segments' data (each padded with zeros to MSS).
+ */
+struct FECEncoder {
+	char parity[MSS];
+	uint32_t startSeq;
+	int count;  // Number of segments added to the current group
+	int totalLen;
+	int maxLen;  // Length of the longest segment in the group
+	int groupSize;  // Number of segments per group
+};
+
+/*
+ * A kept data segment. The slot holds a reference to the pooled segment it was received into,
+ * so keeping a segment does not copy it.
+ */
+struct FECSlot {
+	uint32_t seqNum;
+	int dataLen;  // 0 if the slot is empty
+	int isRecovered;  // Whether the segment was rebuilt from parity instead of received
+	const char *data;
+	struct TCPSegment *segment;  // Pooled segment holding the data, or NULL
+};
+
+struct FECParity {
+	uint32_t startSeq;
+	int count;  // 0 if the slot is empty
+	int totalLen;
+	char data[MSS];
+};
+
+struct FECDecoder {
+	struct FECSlot *slots;
+	struct BufferPool *pool;  // Where received segments come from, and rebuilt ones are put
+	int capacity;
+	uint32_t baseSeq;  // Seq of the first data segment
+	struct FECParity parities[FEC_PARITY_SLOTS];
+	int nextParity;
+};
+
+void initFECEncoder(struct FECEncoder *, int);
+int addToFECGroup(struct FECEncoder *, uint32_t, const char *, int);
+int fillParitySegment(struct FECEncoder *, struct TCPSegment *, uint16_t, uint16_t,
+	uint32_t, uint32_t, uint32_t);
+
+struct FECDecoder *newFECDecoder(int, uint32_t, struct BufferPool *);
+void freeFECDecoder(struct FECDecoder *);
+int storeFECSegment(struct FECDecoder *, uint32_t, struct TCPSegment *, int);
+void storeFECParity(struct FECDecoder *, const struct TCPSegment *, int);
+int recoverFECSegments(struct FECDecoder *, uint32_t);
+const struct FECSlot *getFECSegment(const struct FECDecoder *, uint32_t);
+
+#endif
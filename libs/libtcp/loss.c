@@ -0,0 +1,103 @@
+#include <string.h>
+
+#include "loss.h"
+
+/*
+ * Write a bitmap of the segments after ackNum (up to highestSeq) that the decoder keeps. Bit i (from the high bit
+ * of the first byte) is set if the segment at ackNum + (i + 1) * MSS has arrived. Return the length of the bitmap,
+ * which is 0 if nothing has arrived past the ACK.
+ */
+int fillSackBitmap(const struct FECDecoder *decoder, uint32_t ackNum, uint32_t highestSeq, char *bitmap)
+{
+	if ((int32_t)(highestSeq - ackNum) <= MSS) {
+		return 0;
+	}
+	uint32_t numSegments = (highestSeq - ackNum - 1) / MSS;
+	numSegments = numSegments < SACK_MAX_SEGMENTS ? numSegments : SACK_MAX_SEGMENTS;
+	int len = (numSegments + 7) / 8;
+	memset(bitmap, 0, len);
+	for (uint32_t i = 0; i < numSegments; i++) {
+		if (getFECSegment(decoder, ackNum + (i + 1) * MSS)) {
+			bitmap[i / 8] |= 0x80 >> (i % 8);
+		}
+	}
+	return len;
+}
+
+/*
+ * Check whether a SACK bitmap for ackNum reports the segment at seqNum as arrived
+ */
+int isSacked(const char *bitmap, int len, uint32_t ackNum, uint32_t seqNum)
+{
+	uint32_t offset = seqNum - ackNum;
+	if (offset % MSS || offset < MSS) {
+		return 0;
+	}
+	uint32_t i = offset / MSS - 1;
+	return i < (uint32_t)len * 8 && (bitmap[i / 8] & (0x80 >> (i % 8)));
+}
+
+void initLossDetector(struct LossDetector *detector)
+{
+	memset(detector, 0, sizeof(struct LossDetector));
+}
+
+/*
+ * Note that a segment last sent at xmitTs has been delivered. If it was resent, the ACK may be for an earlier copy,
+ * and an RTT shorter than any seen before gives that away, in which case the delivery is not used.
+ */
+void onSegmentDelivered(struct LossDetector *detector, uint32_t xmitTs, int isResent, uint32_t now)
+{
+	int rtt = now - xmitTs;
+	if (rtt < 0 || (isResent && rtt < detector->minRTT)) {
+		return;
+	}
+	if (!detector->minRTT || rtt < detector->minRTT) {
+		detector->minRTT = rtt > 0 ? rtt : 1;
+	}
+	if (!detector->hasDelivery || (int32_t)(xmitTs - detector->rackXmitTs) >= 0) {
+		detector->rackXmitTs = xmitTs;
+		detector->rackRTT = rtt;
+		detector->hasDelivery = 1;
+	}
+}
+
+/*
+ * Check a segment last sent at xmitTs that has not been delivered. Return -1 if it is lost, 0 if it cannot be
+ * judged yet (nothing sent after it has been delivered), or else the microseconds until it will count as lost.
+ */
+int checkSegmentLoss(const struct LossDetector *detector, uint32_t xmitTs, uint32_t now)
+{
+	if (!detector->hasDelivery || (int32_t)(xmitTs - detector->rackXmitTs) > 0) {
+		return 0;
+	}
+	// The reordering window is a quarter of the lowest RTT, as RACK suggests
+	int deadline = detector->rackRTT + detector->minRTT / 4;
+	int elapsed = now - xmitTs;
+	return elapsed >= deadline ? -1 : deadline - elapsed;
+}
+
+/*
+ * Arm the probe timer for two smoothed RTTs from now, unless a probe has already been sent since the ACK last advanced
+ */
+void armProbe(struct LossDetector *detector, int srtt, uint32_t now)
+{
+	if (detector->isProbeSent || srtt <= 0) {
+		return;
+	}
+	int timeout = 2 * srtt > MIN_PROBE_TIMEOUT ? 2 * srtt : MIN_PROBE_TIMEOUT;
+	detector->probeDeadline = now + timeout;
+	detector->isProbeArmed = 1;
+}
+
+/*
+ * Get the microseconds until the probe is due (at least 1), or 0 if it is not armed
+ */
+int getProbeWait(const struct LossDetector *detector, uint32_t now)
+{
+	if (!detector->isProbeArmed) {
+		return 0;
+	}
+	int wait = (int32_t)(detector->probeDeadline - now);
+	return wait > 0 ? wait : 1;
+}
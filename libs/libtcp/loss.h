@@ -0,0 +1,40 @@
+#ifndef LOSS_H
+#define LOSS_H
+
+#include <stdint.h>
+
+#include "fec.h"
+
+#define SACK_BITMAP_LEN MSS  // The bitmap is the data of an ACK
+#define SACK_MAX_SEGMENTS (SACK_BITMAP_LEN * 8)  // Segments past the ACK that an ACK can report
+#define SACK_MAX_WINDOW (SACK_MAX_SEGMENTS * MSS)  // The largest window whose segments an ACK can report
+#define MIN_PROBE_TIMEOUT 1000  // Shortest wait for an ACK before a tail loss probe, in microseconds
+
+/*
+ * Time-based loss detection in the manner of RACK-TLP (RFC 8985). A segment is lost once a segment sent after it
+ * has been delivered and more than the RTT of that delivery plus a reordering window has passed since it was sent,
+ * so reordering within the window never causes a retransmission, and a lost retransmission is detected the same way.
+ * If no ACK comes for two smoothed RTTs, the newest segment is resent as a probe, so that a loss at the tail of the window
+ * (which no later segment would reveal) draws an ACK that reveals it, instead of waiting out the retransmission timer.
+ * Deliveries are learned from cumulative ACKs and from the server's SACK bitmaps.
+ */
+struct LossDetector {
+	uint32_t rackXmitTs;  // When the most recently sent segment that is known to be delivered was sent
+	int rackRTT;  // RTT of that segment, in microseconds
+	int hasDelivery;
+	int minRTT;  // Lowest RTT of a delivered segment, in microseconds (0 until there is one)
+	uint32_t probeDeadline;
+	int isProbeArmed;
+	int isProbeSent;  // Whether a probe has been sent since the ACK last advanced
+};
+
+int fillSackBitmap(const struct FECDecoder *, uint32_t, uint32_t, char *);
+int isSacked(const char *, int, uint32_t, uint32_t);
+
+void initLossDetector(struct LossDetector *);
+void onSegmentDelivered(struct LossDetector *, uint32_t, int, uint32_t);
+int checkSegmentLoss(const struct LossDetector *, uint32_t, uint32_t);
+void armProbe(struct LossDetector *, int, uint32_t);
+int getProbeWait(const struct LossDetector *, uint32_t);
+
+#endif
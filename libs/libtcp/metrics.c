@@ -0,0 +1,282 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define REPORT_INTERVAL 1000  // How often the reporter samples goodput, in milliseconds
+#define STOP_CHECK_INTERVAL 100  // How often the reporter checks whether it should stop, in milliseconds
+
+/*
+ * Get the histogram bucket for a value in microseconds
+ */
+static int getBucket(int micros)
+{
+	int bucket = 0;
+	while (micros > 1 && bucket < NUM_HIST_BUCKETS - 1) {
+		micros >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static long getElapsedMicros(const struct timeval *startTime)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - startTime->tv_sec) * 1000000L + (now.tv_usec - startTime->tv_usec);
+}
+
+/*
+ * Zero all metrics and start the clock used for goodput
+ */
+void initMetrics(struct Metrics *metrics)
+{
+	memset(metrics, 0, sizeof(struct Metrics));
+	gettimeofday(&metrics->startTime, NULL);
+}
+
+/*
+ * Record a sample RTT, in microseconds
+ */
+void recordRTT(struct Metrics *metrics, int rtt)
+{
+	atomic_store_explicit(&metrics->lastRTT, rtt, memory_order_relaxed);
+	addMetric(metrics->rttHistogram + getBucket(rtt), 1);
+}
+
+/*
+ * Record a new retransmission timeout, in microseconds
+ */
+void recordRTO(struct Metrics *metrics, int rto)
+{
+	atomic_store_explicit(&metrics->currentRTO, rto, memory_order_relaxed);
+	addMetric(metrics->rtoHistogram + getBucket(rto), 1);
+}
+
+static void writeHistogram(FILE *file, atomic_ulong *histogram)
+{
+	fprintf(file, "[");
+	for (int i = 0; i < NUM_HIST_BUCKETS; i++) {
+		fprintf(file, "%s%lu", i ? ", " : "", getMetric(histogram + i));
+	}
+	fprintf(file, "]");
+}
+
+/*
+ * Write a JSON snapshot of the metrics. Goodput history is oldest first.
+ */
+void writeMetricsJSON(struct Metrics *metrics, FILE *file)
+{
+	long elapsedMicros = getElapsedMicros(&metrics->startTime);
+	unsigned long bytesDelivered = getMetric(&metrics->bytesDelivered);
+
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"elapsedMicros\": %ld,\n", elapsedMicros);
+	fprintf(file, "\t\"bytesSent\": %lu,\n", getMetric(&metrics->bytesSent));
+	fprintf(file, "\t\"bytesReceived\": %lu,\n", getMetric(&metrics->bytesReceived));
+	fprintf(file, "\t\"bytesDelivered\": %lu,\n", bytesDelivered);
+	fprintf(file, "\t\"segmentsSent\": %lu,\n", getMetric(&metrics->segmentsSent));
+	fprintf(file, "\t\"segmentsReceived\": %lu,\n", getMetric(&metrics->segmentsReceived));
+	fprintf(file, "\t\"retransmissions\": %lu,\n", getMetric(&metrics->retransmissions));
+	fprintf(file, "\t\"timeouts\": %lu,\n", getMetric(&metrics->timeouts));
+	fprintf(file, "\t\"spuriousTimeouts\": %lu,\n", getMetric(&metrics->spuriousTimeouts));
+	fprintf(file, "\t\"lossDetections\": %lu,\n", getMetric(&metrics->lossDetections));
+	fprintf(file, "\t\"tailLossProbes\": %lu,\n", getMetric(&metrics->tailLossProbes));
+	fprintf(file, "\t\"duplicateACKs\": %lu,\n", getMetric(&metrics->duplicateACKs));
+	fprintf(file, "\t\"checksumFailures\": %lu,\n", getMetric(&metrics->checksumFailures));
+	fprintf(file, "\t\"paritySegments\": %lu,\n", getMetric(&metrics->paritySegments));
+	fprintf(file, "\t\"recoveredSegments\": %lu,\n", getMetric(&metrics->recoveredSegments));
+	fprintf(file, "\t\"kernelDrops\": %lu,\n", getMetric(&metrics->kernelDrops));
+	fprintf(file, "\t\"rtt\": { \"last\": %d, \"histogram\": ",
+		atomic_load_explicit(&metrics->lastRTT, memory_order_relaxed));
+	writeHistogram(file, metrics->rttHistogram);
+	fprintf(file, " },\n");
+	fprintf(file, "\t\"rto\": { \"current\": %d, \"histogram\": ",
+		atomic_load_explicit(&metrics->currentRTO, memory_order_relaxed));
+	writeHistogram(file, metrics->rtoHistogram);
+	fprintf(file, " },\n");
+	fprintf(file, "\t\"goodput\": { \"average\": %lu, \"history\": [",
+		elapsedMicros > 0 ? (unsigned long)(bytesDelivered * 1e6 / elapsedMicros) : 0);
+	for (int i = 0; i < GOODPUT_HISTORY; i++) {
+		fprintf(file, "%s%lu", i ? ", " : "",
+			metrics->goodputHistory[(metrics->goodputIndex + i) % GOODPUT_HISTORY]);
+	}
+	fprintf(file, "] }\n");
+	fprintf(file, "}\n");
+}
+
+/*
+ * Write the JSON to a temporary file and rename it so readers never see a partial dump
+ */
+static void dumpMetrics(struct MetricsReporter *reporter)
+{
+	char tmpPath[strlen(reporter->jsonPath) + 5];
+	sprintf(tmpPath, "%s.tmp", reporter->jsonPath);
+	FILE *file = fopen(tmpPath, "w");
+	if (!file) {
+		perror("fopen");
+		return;
+	}
+	writeMetricsJSON(reporter->metrics, file);
+	fclose(file);
+	if (rename(tmpPath, reporter->jsonPath) < 0) {
+		perror("rename");
+	}
+}
+
+/*
+ * Take a goodput sample and emit the periodic outputs
+ */
+static void report(struct MetricsReporter *reporter)
+{
+	struct Metrics *metrics = reporter->metrics;
+	unsigned long bytesDelivered = getMetric(&metrics->bytesDelivered);
+	unsigned long goodput = (bytesDelivered - metrics->lastBytesDelivered)
+		* 1000 / REPORT_INTERVAL;
+	metrics->lastBytesDelivered = bytesDelivered;
+	metrics->goodputHistory[metrics->goodputIndex] = goodput;
+	metrics->goodputIndex = (metrics->goodputIndex + 1) % GOODPUT_HISTORY;
+
+	if (reporter->jsonPath) {
+		dumpMetrics(reporter);
+	}
+	if (reporter->progressVerb) {
+		fprintf(stderr, "log: %s %lu bytes (%lu B/s, %lu retransmissions, %lu timeouts)\r",
+			reporter->progressVerb, bytesDelivered, goodput,
+			getMetric(&metrics->retransmissions), getMetric(&metrics->timeouts));
+		reporter->hasPrintedProgress = 1;
+	}
+}
+
+/*
+ * Answer one query on the Unix socket with a JSON snapshot
+ */
+static void serveQuery(struct MetricsReporter *reporter)
+{
+	int clientSocket = accept(reporter->listenSocket, NULL, NULL);
+	if (clientSocket < 0) {
+		perror("accept");
+		return;
+	}
+	FILE *file = fdopen(clientSocket, "w");
+	if (!file) {
+		perror("fdopen");
+		close(clientSocket);
+		return;
+	}
+	writeMetricsJSON(reporter->metrics, file);
+	fclose(file);
+}
+
+static void *runReporter(void *arg)
+{
+	struct MetricsReporter *reporter = arg;
+	struct pollfd pfd = { .fd = reporter->listenSocket, .events = POLLIN };
+	struct timeval lastReport;
+	gettimeofday(&lastReport, NULL);
+
+	while (!atomic_load(&reporter->isStopping)) {
+		int timeRemaining = REPORT_INTERVAL - getElapsedMicros(&lastReport) / 1000;
+		if (timeRemaining <= 0) {
+			report(reporter);
+			gettimeofday(&lastReport, NULL);
+			continue;
+		}
+		// A negative fd is ignored by poll, so this doubles as a sleep without a socket
+		int fdsReady = poll(&pfd, 1, timeRemaining < STOP_CHECK_INTERVAL
+			? timeRemaining : STOP_CHECK_INTERVAL);
+		if (fdsReady < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		} else if (fdsReady > 0) {
+			serveQuery(reporter);
+		}
+	}
+	return NULL;
+}
+
+static int openMetricsSocket(const char *socketPath)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "error: metrics socket path is too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, socketPath);
+
+	int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenSocket < 0) {
+		perror("socket");
+		return -1;
+	}
+	unlink(socketPath);
+	if (bind(listenSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0
+		|| listen(listenSocket, 8) < 0) {
+		perror("bind");
+		close(listenSocket);
+		return -1;
+	}
+	return listenSocket;
+}
+
+/*
+ * Start a thread that periodically dumps JSON to jsonPath, serves JSON queries on socketPath,
+ * and prints throttled progress messages if progressVerb is set. Any of them can be NULL.
+ * If all of them are NULL, no thread is started.
+ */
+int startMetricsReporter(struct MetricsReporter *reporter, struct Metrics *metrics,
+	const char *jsonPath, const char *socketPath, const char *progressVerb)
+{
+	memset(reporter, 0, sizeof(struct MetricsReporter));
+	reporter->metrics = metrics;
+	reporter->jsonPath = jsonPath;
+	reporter->socketPath = socketPath;
+	reporter->progressVerb = progressVerb;
+	reporter->listenSocket = -1;
+	if (!jsonPath && !socketPath && !progressVerb) {
+		return 0;
+	}
+
+	if (socketPath && (reporter->listenSocket = openMetricsSocket(socketPath)) < 0) {
+		return -1;
+	}
+	if ((errno = pthread_create(&reporter->thread, NULL, runReporter, reporter))) {
+		perror("pthread_create");
+		if (socketPath) {
+			close(reporter->listenSocket);
+			unlink(socketPath);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stop the reporter thread and write a final JSON dump
+ */
+void stopMetricsReporter(struct MetricsReporter *reporter)
+{
+	if (!reporter->jsonPath && !reporter->socketPath && !reporter->progressVerb) {
+		return;
+	}
+	atomic_store(&reporter->isStopping, 1);
+	pthread_join(reporter->thread, NULL);
+
+	if (reporter->jsonPath) {
+		dumpMetrics(reporter);
+	}
+	if (reporter->socketPath) {
+		close(reporter->listenSocket);
+		unlink(reporter->socketPath);
+	}
+	if (reporter->hasPrintedProgress) {
+		fprintf(stderr, "\n");
+	}
+}
@@ -0,0 +1,73 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#define NUM_HIST_BUCKETS 24  // Bucket i counts values in [2^i, 2^(i+1)) microseconds
+#define GOODPUT_HISTORY 60  // Number of per-second goodput samples kept
+
+/*
+ * Counters are updated by the transfer loop and read by the reporter thread,
+ * so they are atomic. Relaxed ordering is enough since they are independent.
+ */
+struct Metrics {
+	atomic_ulong bytesSent;
+	atomic_ulong bytesReceived;
+	atomic_ulong bytesDelivered;  // Bytes ACKed (client) or written (server)
+	atomic_ulong segmentsSent;
+	atomic_ulong segmentsReceived;
+	atomic_ulong retransmissions;
+	atomic_ulong timeouts;
+	atomic_ulong spuriousTimeouts;
+	atomic_ulong lossDetections;  // Segments resent because later segments were delivered (client)
+	atomic_ulong tailLossProbes;  // Probes sent because no ACK came for two RTTs (client)
+	atomic_ulong duplicateACKs;
+	atomic_ulong checksumFailures;
+	atomic_ulong paritySegments;  // Parity segments sent (client)
+	atomic_ulong recoveredSegments;  // Segments rebuilt from parity (server)
+	atomic_ulong kernelDrops;  // Datagrams the kernel dropped because the socket's receive buffer was full
+	atomic_int lastRTT;
+	atomic_int currentRTO;
+	atomic_ulong rttHistogram[NUM_HIST_BUCKETS];
+	atomic_ulong rtoHistogram[NUM_HIST_BUCKETS];
+
+	struct timeval startTime;
+	// Owned by the reporter thread
+	unsigned long goodputHistory[GOODPUT_HISTORY];
+	int goodputIndex;
+	unsigned long lastBytesDelivered;
+};
+
+struct MetricsReporter {
+	struct Metrics *metrics;
+	const char *jsonPath;  // File that is rewritten every second, or NULL
+	const char *socketPath;  // Unix socket that serves the JSON on connect, or NULL
+	const char *progressVerb;  // Verb for progress messages ("sent"), or NULL for no progress
+	int listenSocket;
+	int hasPrintedProgress;
+	atomic_int isStopping;
+	pthread_t thread;
+};
+
+static inline void addMetric(atomic_ulong *counter, unsigned long n)
+{
+	atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static inline unsigned long getMetric(atomic_ulong *counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+void initMetrics(struct Metrics *);
+void recordRTT(struct Metrics *, int);
+void recordRTO(struct Metrics *, int);
+void writeMetricsJSON(struct Metrics *, FILE *);
+int startMetricsReporter(struct MetricsReporter *, struct Metrics *,
+	const char *, const char *, const char *);
+void stopMetricsReporter(struct MetricsReporter *);
+
+#endif
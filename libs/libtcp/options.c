@@ -0,0 +1,187 @@
+#include <string.h>
+
+#include "options.h"
+#include "helpers.h"
+
+/*
+ * Append an option with a big-endian integer value. Return the new length, or -1 if it does not fit.
+ */
+static int writeIntOption(char *buffer, int len, int bufferLen, uint8_t type, uint64_t value, int valueLen)
+{
+	if (len + 2 + valueLen > bufferLen) {
+		return -1;
+	}
+	buffer[len++] = type;
+	buffer[len++] = valueLen;
+	writeUint(buffer + len, value, valueLen);
+	return len + valueLen;
+}
+
+/*
+ * Append an option with no value. Return the new length, or -1 if it does not fit.
+ */
+static int writeFlagOption(char *buffer, int len, int bufferLen, uint8_t type)
+{
+	if (len + 2 > bufferLen) {
+		return -1;
+	}
+	buffer[len++] = type;
+	buffer[len++] = 0;
+	return len;
+}
+
+/*
+ * Write the options that are set. Return the number of bytes written, or -1 if they do not fit.
+ */
+int writeHandshakeOptions(const struct HandshakeOptions *options, char *buffer, int bufferLen)
+{
+	int len = 0;
+	if (options->hasFileSize
+		&& (len = writeIntOption(buffer, len, bufferLen, OPTION_FILE_SIZE, options->fileSize, 8)) < 0) {
+		return -1;
+	}
+	if (options->isSession && (len = writeFlagOption(buffer, len, bufferLen, OPTION_SESSION)) < 0) {
+		return -1;
+	}
+	if (options->hasToken) {
+		if (len + 2 + TOKEN_LEN > bufferLen) {
+			return -1;
+		}
+		buffer[len++] = OPTION_TOKEN;
+		buffer[len++] = TOKEN_LEN;
+		memcpy(buffer + len, options->token, TOKEN_LEN);
+		len += TOKEN_LEN;
+	}
+	if (options->hasEarlyData && (len = writeFlagOption(buffer, len, bufferLen, OPTION_EARLY_DATA)) < 0) {
+		return -1;
+	}
+	if (options->hasWindowSize
+		&& (len = writeIntOption(buffer, len, bufferLen, OPTION_WINDOW_SIZE, options->windowSize, 4)) < 0) {
+		return -1;
+	}
+	if (options->codec && (len = writeIntOption(buffer, len, bufferLen, OPTION_CODEC, options->codec, 1)) < 0) {
+		return -1;
+	}
+	if (options->isDelta && (len = writeFlagOption(buffer, len, bufferLen, OPTION_DELTA)) < 0) {
+		return -1;
+	}
+	if (options->hasDigest && (len = writeFlagOption(buffer, len, bufferLen, OPTION_DIGEST)) < 0) {
+		return -1;
+	}
+	if (options->hasResumeId) {
+		if (len + 2 + RESUME_ID_OPTION_LEN > bufferLen) {
+			return -1;
+		}
+		buffer[len++] = OPTION_RESUME;
+		buffer[len++] = RESUME_ID_OPTION_LEN;
+		memcpy(buffer + len, options->resumeId, RESUME_ID_OPTION_LEN);
+		len += RESUME_ID_OPTION_LEN;
+	}
+	if (options->hasResumeOffset) {
+		if (len + 2 + RESUME_OFFSET_OPTION_LEN > bufferLen) {
+			return -1;
+		}
+		buffer[len++] = OPTION_RESUME;
+		buffer[len++] = RESUME_OFFSET_OPTION_LEN;
+		writeUint(buffer + len, options->resumeOffset, 8);
+		len += 8;
+		for (int i = 0; i < 8; i++) {
+			writeUint(buffer + len, options->resumeState[i], 4);
+			len += 4;
+		}
+	}
+	if (options->hasSignature) {
+		uint64_t value = (uint64_t)options->signatureBlockSize << 32 | options->signatureBlocks;
+		if ((len = writeIntOption(buffer, len, bufferLen, OPTION_SIGNATURE, value, 8)) < 0) {
+			return -1;
+		}
+	}
+	return len;
+}
+
+/*
+ * Read options from a SYN's (or SYNACK's) data. Return -1 if the options are malformed.
+ */
+int readHandshakeOptions(struct HandshakeOptions *options, const char *buffer, int len)
+{
+	memset(options, 0, sizeof(struct HandshakeOptions));
+	int i = 0;
+	while (i < len && buffer[i] != OPTION_END) {
+		if (i + 2 > len) {
+			return -1;
+		}
+		uint8_t type = buffer[i];
+		int valueLen = (uint8_t)buffer[i + 1];
+		const char *value = buffer + i + 2;
+		if (i + 2 + valueLen > len) {
+			return -1;
+		}
+
+		switch (type) {
+		case OPTION_FILE_SIZE:
+			if (valueLen != 8) {
+				return -1;
+			}
+			options->fileSize = readUint(value, valueLen);
+			options->hasFileSize = 1;
+			break;
+		case OPTION_SESSION:
+			options->isSession = 1;
+			break;
+		case OPTION_TOKEN:
+			if (valueLen != TOKEN_LEN) {
+				return -1;
+			}
+			memcpy(options->token, value, TOKEN_LEN);
+			options->hasToken = 1;
+			break;
+		case OPTION_EARLY_DATA:
+			options->hasEarlyData = 1;
+			break;
+		case OPTION_WINDOW_SIZE:
+			if (valueLen != 4) {
+				return -1;
+			}
+			options->windowSize = readUint(value, valueLen);
+			options->hasWindowSize = 1;
+			break;
+		case OPTION_CODEC:
+			if (valueLen != 1) {
+				return -1;
+			}
+			options->codec = (uint8_t)value[0];
+			break;
+		case OPTION_DELTA:
+			options->isDelta = 1;
+			break;
+		case OPTION_SIGNATURE:
+			if (valueLen != 8) {
+				return -1;
+			}
+			options->signatureBlockSize = readUint(value, 4);
+			options->signatureBlocks = readUint(value + 4, 4);
+			options->hasSignature = 1;
+			break;
+		case OPTION_DIGEST:
+			options->hasDigest = 1;
+			break;
+		case OPTION_RESUME:
+			// The length tells a client's id from a server's offset
+			if (valueLen == RESUME_ID_OPTION_LEN) {
+				memcpy(options->resumeId, value, RESUME_ID_OPTION_LEN);
+				options->hasResumeId = 1;
+			} else if (valueLen == RESUME_OFFSET_OPTION_LEN) {
+				options->resumeOffset = readUint(value, 8);
+				for (int j = 0; j < 8; j++) {
+					options->resumeState[j] = readUint(value + 8 + 4 * j, 4);
+				}
+				options->hasResumeOffset = 1;
+			} else {
+				return -1;
+			}
+			break;
+		}  // Unknown options are skipped
+		i += 2 + valueLen;
+	}
+	return 0;
+}
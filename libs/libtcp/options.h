@@ -0,0 +1,56 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdint.h>
+
+#include "token.h"
+
+#define MAX_OPTIONS_LEN 64  // Room reserved for options in a SYN's data
+
+// Option types
+#define OPTION_END 0  // No more options follow
+#define OPTION_FILE_SIZE 1  // Total number of bytes the client will send (8 bytes)
+#define OPTION_SESSION 2  // The data is a session of streams (no value)
+#define OPTION_TOKEN 3  // A token for sending data without waiting for the handshake (TOKEN_LEN bytes)
+#define OPTION_EARLY_DATA 4  // In a SYN, data follows without waiting for the SYNACK; in a SYNACK, that data is accepted (no value)
+#define OPTION_WINDOW_SIZE 5  // Most bytes the client has in flight, which the server sizes its receive buffer for (4 bytes)
+#define OPTION_CODEC 6  // In a SYN, the codec the client can compress data with; in a SYNACK, the codec the data will be compressed with (1 byte)
+#define OPTION_DELTA 7  // The client can send the file as a delta against the server's copy (no value)
+#define OPTION_SIGNATURE 8  // The server has a signature of its copy to fetch: the block size (4 bytes) and number of blocks (4 bytes)
+#define OPTION_DIGEST 9  // The client's FIN carries the SHA-256 of the file (no value)
+#define OPTION_RESUME 10  // In a SYN, the client's resume id; in a SYNACK, the offset to resume at (8 bytes) and the SHA-256 state there (8 words)
+
+#define RESUME_ID_OPTION_LEN 16  // Same as RESUME_ID_LEN in checkpoint.h
+#define RESUME_OFFSET_OPTION_LEN 40
+
+/*
+ * Options are carried in the data of a SYN (or SYNACK) as a list of type, length, value entries.
+ * Values are in network byte order and unknown types are skipped, so new options can be added
+ * without breaking older servers.
+ */
+struct HandshakeOptions {
+	uint64_t fileSize;
+	int hasFileSize;
+	int isSession;
+	char token[TOKEN_LEN];
+	int hasToken;
+	int hasEarlyData;
+	uint32_t windowSize;
+	int hasWindowSize;
+	int codec;  // One of the codecs in codec.h (CODEC_NONE, which is 0, is not sent)
+	int isDelta;
+	uint32_t signatureBlockSize;
+	uint32_t signatureBlocks;
+	int hasSignature;
+	int hasDigest;
+	uint8_t resumeId[RESUME_ID_OPTION_LEN];
+	int hasResumeId;
+	uint64_t resumeOffset;
+	uint32_t resumeState[8];
+	int hasResumeOffset;
+};
+
+int writeHandshakeOptions(const struct HandshakeOptions *, char *, int);
+int readHandshakeOptions(struct HandshakeOptions *, const char *, int);
+
+#endif
@@ -0,0 +1,137 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "path.h"
+
+/*
+ * Start a scheduler with no paths for a connection whose window holds maxWindow segments
+ */
+void initPathScheduler(struct PathScheduler *scheduler, int maxWindow)
+{
+	memset(scheduler, 0, sizeof(struct PathScheduler));
+	scheduler->maxWindow = maxWindow;
+}
+
+/*
+ * Add a path that sends from sock to addr. The connection's window is split evenly between the paths to start with.
+ * Return the path's index, or -1 if there are too many paths.
+ */
+int addPath(struct PathScheduler *scheduler, int sock, const struct sockaddr_in *addr)
+{
+	if (scheduler->numPaths == MAX_PATHS) {
+		return -1;
+	}
+	struct Path *path = scheduler->paths + scheduler->numPaths++;
+	memset(path, 0, sizeof(struct Path));
+	path->sock = sock;
+	path->addr = *addr;
+	initRTTEstimator(&path->rtt, 0, 0, 0);
+
+	int share = scheduler->maxWindow / scheduler->numPaths;
+	for (int i = 0; i < scheduler->numPaths; i++) {
+		scheduler->paths[i].window = share > 1 ? share : 1;
+	}
+	return scheduler->numPaths - 1;
+}
+
+/*
+ * Close the sockets of every path but the first, whose socket belongs to the connection
+ */
+void closePaths(struct PathScheduler *scheduler)
+{
+	for (int i = 1; i < scheduler->numPaths; i++) {
+		close(scheduler->paths[i].sock);
+	}
+	scheduler->numPaths = 0;
+}
+
+/*
+ * Get the RTT the scheduler ranks a path by. Paths without an RTT sample come first, so that every path gets measured,
+ * unless they have timed out.
+ */
+static long getPathCost(const struct Path *path)
+{
+	long rtt = path->rtt.hasSample ? getSmoothedRTT(&path->rtt) : path->numTimeouts ? PATH_DOWN_RTT : 0;
+	return rtt << (path->numTimeouts < 16 ? path->numTimeouts : 16);
+}
+
+/*
+ * Get the path with the lowest cost out of the ones that have room (or all of them if mustHaveRoom is not set)
+ */
+static int findBestPath(const struct PathScheduler *scheduler, int mustHaveRoom)
+{
+	int best = -1;
+	for (int i = 0; i < scheduler->numPaths; i++) {
+		const struct Path *path = scheduler->paths + i;
+		if (mustHaveRoom && path->inFlight >= path->window) {
+			continue;
+		}
+		if (best < 0 || getPathCost(path) < getPathCost(scheduler->paths + best)) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/*
+ * Get the path to send a new segment on, or -1 if every path's window is full
+ */
+int pickPath(const struct PathScheduler *scheduler)
+{
+	return findBestPath(scheduler, 1);
+}
+
+/*
+ * Get the path to resend a segment on, which is the best one whether or not it has room
+ */
+int pickResendPath(const struct PathScheduler *scheduler)
+{
+	return findBestPath(scheduler, 0);
+}
+
+void onPathSent(struct PathScheduler *scheduler, int index)
+{
+	scheduler->paths[index].inFlight++;
+	scheduler->paths[index].segmentsSent++;
+}
+
+/*
+ * Account for a segment sent on a path being ACKed. sampleRTT is the RTT measured from the ACK's echoed
+ * timestamp if it echoes this segment, or 0.
+ */
+void onPathAcked(struct PathScheduler *scheduler, int index, int sampleRTT)
+{
+	struct Path *path = scheduler->paths + index;
+	if (path->inFlight > 0) {
+		path->inFlight--;
+	}
+	if (path->window < scheduler->maxWindow) {
+		path->window++;
+	}
+	path->numTimeouts = 0;
+	updateRTTEstimator(&path->rtt, sampleRTT);
+}
+
+/*
+ * Account for a segment sent on a path timing out
+ */
+void onPathTimeout(struct PathScheduler *scheduler, int index)
+{
+	struct Path *path = scheduler->paths + index;
+	path->window = path->window / 2 > 1 ? path->window / 2 : 1;
+	path->numTimeouts++;
+}
+
+/*
+ * Account for a segment in flight on one path being resent on another
+ */
+void movePathSegment(struct PathScheduler *scheduler, int from, int to)
+{
+	if (from == to) {
+		return;
+	}
+	if (scheduler->paths[from].inFlight > 0) {
+		scheduler->paths[from].inFlight--;
+	}
+	scheduler->paths[to].inFlight++;
+}
@@ -0,0 +1,47 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <netinet/in.h>
+
+#include "rtt.h"
+
+#define MAX_PATHS 8
+#define PATH_DOWN_RTT (1L << 30)  // RTT assumed for a path that has timed out without ever being ACKed, in microseconds
+
+/*
+ * A path (subflow) from one of the client's addresses to one of the server's (or to the relay in front of it).
+ * Every path shares the connection's sequence space, window, and ACKs; only where segments are sent differs.
+ */
+struct Path {
+	int sock;  // Socket segments on this path are sent from
+	struct sockaddr_in addr;  // Where segments on this path are sent
+	struct RTTEstimator rtt;  // Estimated from ACKs that echo a segment sent on this path
+	int inFlight;  // Segments sent on this path that have not been ACKed
+	int window;  // Most segments this path may have in flight
+	int numTimeouts;  // Timeouts of segments sent on this path since it was last ACKed
+	unsigned long segmentsSent;
+};
+
+/*
+ * Spreads segments over paths. A segment goes on the path with the lowest smoothed RTT that has room in its window.
+ * A path's window grows by one for every segment ACKed on it and halves when a segment sent on it times out,
+ * and every timeout since its last ACK doubles its RTT as far as the scheduler is concerned. So a path that
+ * degrades is given less data, and retransmissions go on the best path.
+ */
+struct PathScheduler {
+	struct Path paths[MAX_PATHS];
+	int numPaths;
+	int maxWindow;  // The connection's window, in segments
+};
+
+void initPathScheduler(struct PathScheduler *, int);
+int addPath(struct PathScheduler *, int, const struct sockaddr_in *);
+void closePaths(struct PathScheduler *);
+int pickPath(const struct PathScheduler *);
+int pickResendPath(const struct PathScheduler *);
+void onPathSent(struct PathScheduler *, int);
+void onPathAcked(struct PathScheduler *, int, int);
+void onPathTimeout(struct PathScheduler *, int);
+void movePathSegment(struct PathScheduler *, int, int);
+
+#endif
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+static struct PoolBuffer *getHeader(void *buffer)
+{
+	return (struct PoolBuffer *)((char *)buffer - POOL_ALIGN);
+}
+
+/*
+ * Construct a pool of up to maxBuffers buffers of bufferSize bytes each. No memory is mapped until a buffer is allocated.
+ */
+struct BufferPool *newBufferPool(size_t bufferSize, int maxBuffers, int flags)
+{
+	struct BufferPool *pool = calloc(1, sizeof(struct BufferPool));
+	if (!pool) {
+		return NULL;
+	}
+	pool->stride = POOL_ALIGN + (bufferSize + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+	pool->maxBuffers = maxBuffers;
+	pool->flags = flags;
+	atomic_init(&pool->freeList, NULL);
+	return pool;
+}
+
+/*
+ * Unmap every slab and free the pool. Buffers still held are freed as well.
+ */
+void freeBufferPool(struct BufferPool *pool)
+{
+	for (int i = 0; i < pool->numSlabs; i++) {
+		munmap(pool->slabs[i], pool->slabSizes[i]);
+	}
+	free(pool);
+}
+
+/*
+ * Map a slab with room for the buffers the pool may still carve out. Return -1 if it cannot be mapped.
+ */
+static int addSlab(struct BufferPool *pool)
+{
+	size_t size = (size_t)(pool->maxBuffers - pool->numBuffers) * pool->stride;
+	if (size > POOL_SLAB_SIZE) {
+		size = POOL_SLAB_SIZE;
+	}
+	if (size < pool->stride || pool->numSlabs == POOL_MAX_SLABS) {
+		return -1;
+	}
+
+	void *slab = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (pool->flags & POOL_HUGE_PAGES && size == POOL_SLAB_SIZE) {
+		slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+#endif
+	if (slab == MAP_FAILED) {
+		// No huge pages are reserved, so fall back to normal pages (which may still be merged in the background)
+		slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab == MAP_FAILED) {
+			return -1;
+		}
+#ifdef MADV_HUGEPAGE
+		if (pool->flags & POOL_HUGE_PAGES && size == POOL_SLAB_SIZE) {
+			madvise(slab, size, MADV_HUGEPAGE);
+		}
+#endif
+	}
+
+	pool->slabs[pool->numSlabs] = slab;
+	pool->slabSizes[pool->numSlabs++] = size;
+	pool->slabPos = slab;
+	pool->slabEnd = (char *)slab + size;
+	return 0;
+}
+
+/*
+ * Get a buffer with one reference, reusing a released one if there is one.
+ * Return NULL if the pool is at its limit or memory cannot be mapped.
+ */
+void *allocBuffer(struct BufferPool *pool)
+{
+	// Only this thread removes buffers, so the head cannot be removed and pushed back while it is being popped
+	struct PoolBuffer *header = atomic_load_explicit(&pool->freeList, memory_order_acquire);
+	if (header && pool->flags & POOL_ONE_THREAD) {
+		atomic_store_explicit(&pool->freeList, header->next, memory_order_relaxed);
+	} else {
+		while (header && !atomic_compare_exchange_weak_explicit(&pool->freeList, &header, header->next,
+			memory_order_acquire, memory_order_acquire));
+	}
+
+	if (!header) {
+		if (pool->numBuffers == pool->maxBuffers
+			|| ((size_t)(pool->slabEnd - pool->slabPos) < pool->stride && addSlab(pool) < 0)) {
+			return NULL;
+		}
+		// Buffers are carved out as they are needed so that untouched memory is never committed
+		header = (struct PoolBuffer *)pool->slabPos;
+		pool->slabPos += pool->stride;
+		pool->numBuffers++;
+		header->pool = pool;
+	}
+	atomic_store_explicit(&header->refs, 1, memory_order_relaxed);
+	return (char *)header + POOL_ALIGN;
+}
+
+/*
+ * Add a reference to a buffer, e.g., before handing it to another stage
+ */
+void holdBuffer(void *buffer)
+{
+	atomic_fetch_add_explicit(&getHeader(buffer)->refs, 1, memory_order_relaxed);
+}
+
+/*
+ * Drop a reference to a buffer. The buffer goes back to its pool once the last one is dropped.
+ */
+void releaseBuffer(void *buffer)
+{
+	struct PoolBuffer *header = getHeader(buffer);
+	// The last reference cannot be shared, so it can be dropped without a read-modify-write
+	if (atomic_load_explicit(&header->refs, memory_order_acquire) != 1
+		&& atomic_fetch_sub_explicit(&header->refs, 1, memory_order_acq_rel) != 1) {
+		return;
+	}
+	struct BufferPool *pool = header->pool;
+	header->next = atomic_load_explicit(&pool->freeList, memory_order_relaxed);
+	if (pool->flags & POOL_ONE_THREAD) {
+		atomic_store_explicit(&pool->freeList, header, memory_order_relaxed);
+		return;
+	}
+	while (!atomic_compare_exchange_weak_explicit(&pool->freeList, &header->next, header,
+		memory_order_release, memory_order_relaxed));
+}
@@ -0,0 +1,48 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define POOL_ALIGN 64  // Buffers start on a cache line
+#define POOL_SLAB_SIZE (2 * 1024 * 1024)  // Memory mapped at a time (one huge page)
+#define POOL_MAX_SLABS 1024
+
+// Pool flags
+#define POOL_HUGE_PAGES 1  // Back full slabs with huge pages where possible
+#define POOL_ONE_THREAD 2  // Buffers are only held and released by the owning thread, so no atomic read-modify-writes are needed
+
+/*
+ * Sits in front of every buffer. The data starts POOL_ALIGN bytes after it.
+ */
+struct PoolBuffer {
+	struct BufferPool *pool;
+	struct PoolBuffer *next;  // Next free buffer
+	atomic_int refs;
+};
+
+/*
+ * A pool of fixed-size buffers carved out of slabs that are mapped as they are needed, up to maxBuffers in total.
+ * Buffers are reference counted so that one stage can hand a buffer to another without copying it.
+ * Only the thread that owns the pool may allocate, but any thread may hold and release (unless POOL_ONE_THREAD is set).
+ */
+struct BufferPool {
+	size_t stride;  // Distance between buffers, including the header
+	int maxBuffers;
+	int numBuffers;  // Buffers carved out so far
+	int flags;
+	void *slabs[POOL_MAX_SLABS];
+	size_t slabSizes[POOL_MAX_SLABS];
+	int numSlabs;
+	char *slabPos;  // Next buffer to carve out of the last slab
+	char *slabEnd;
+	_Atomic(struct PoolBuffer *) freeList;
+};
+
+struct BufferPool *newBufferPool(size_t, int, int);
+void freeBufferPool(struct BufferPool *);
+void *allocBuffer(struct BufferPool *);
+void holdBuffer(void *);
+void releaseBuffer(void *);
+
+#endif
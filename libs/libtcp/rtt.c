@@ -0,0 +1,72 @@
+#include "rtt.h"
+
+/*
+ * Initialize an estimator that has no samples yet. Timeouts are kept within [minRTO, maxRTO].
+ */
+void initRTTEstimator(struct RTTEstimator *estimator, int initialRTO, int minRTO, int maxRTO)
+{
+	estimator->srtt = 0;
+	estimator->rttvar = 0;
+	estimator->rto = initialRTO;
+	estimator->minRTO = minRTO;
+	estimator->maxRTO = maxRTO;
+	estimator->backoff = 0;
+	estimator->hasSample = 0;
+}
+
+/*
+ * Update the smoothed RTT, RTT variation, and timeout using a sample RTT in microseconds.
+ * A new sample also clears any backoff.
+ */
+void updateRTTEstimator(struct RTTEstimator *estimator, int sampleRTT)
+{
+	if (sampleRTT <= 0) {
+		return;
+	}
+	if (!estimator->hasSample) {
+		// SRTT = R, RTTVAR = R/2
+		estimator->srtt = sampleRTT << 3;
+		estimator->rttvar = sampleRTT << 1;
+		estimator->hasSample = 1;
+	} else {
+		// SRTT = 7/8 SRTT + 1/8 R
+		int delta = sampleRTT - (estimator->srtt >> 3);
+		estimator->srtt += delta;
+		// RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|
+		if (delta < 0) {
+			delta = -delta;
+		}
+		estimator->rttvar += delta - (estimator->rttvar >> 2);
+	}
+	// RTO = SRTT + 4 RTTVAR (rttvar is already scaled by 4)
+	estimator->rto = (estimator->srtt >> 3) + estimator->rttvar;
+	estimator->backoff = 0;
+}
+
+/*
+ * Double the timeout after it goes off, up to the maximum
+ */
+void backOffRTO(struct RTTEstimator *estimator)
+{
+	if (getRTO(estimator) < estimator->maxRTO) {
+		estimator->backoff++;
+	}
+}
+
+/*
+ * Get the current timeout in microseconds, including backoff
+ */
+int getRTO(const struct RTTEstimator *estimator)
+{
+	long rto = estimator->rto < estimator->minRTO ? estimator->minRTO : estimator->rto;
+	rto <<= estimator->backoff;
+	return rto > estimator->maxRTO ? estimator->maxRTO : (int)rto;
+}
+
+/*
+ * Get the smoothed RTT in microseconds
+ */
+int getSmoothedRTT(const struct RTTEstimator *estimator)
+{
+	return estimator->srtt >> 3;
+}
@@ -0,0 +1,24 @@
+#ifndef RTT_H
+#define RTT_H
+
+/*
+ * RTT estimator from RFC 6298 using integer fixed-point arithmetic.
+ * srtt is scaled by 8 and rttvar by 4, so alpha = 1/8 and beta = 1/4 become shifts.
+ */
+struct RTTEstimator {
+	int srtt;  // Smoothed RTT << 3, in microseconds
+	int rttvar;  // RTT variation << 2, in microseconds
+	int rto;  // Retransmission timeout before backoff, in microseconds
+	int minRTO;
+	int maxRTO;
+	int backoff;  // Number of times the timeout has doubled since the last sample
+	int hasSample;
+};
+
+void initRTTEstimator(struct RTTEstimator *, int, int, int);
+void updateRTTEstimator(struct RTTEstimator *, int);
+void backOffRTO(struct RTTEstimator *);
+int getRTO(const struct RTTEstimator *);
+int getSmoothedRTT(const struct RTTEstimator *);
+
+#endif
@@ -0,0 +1,158 @@
+#include <string.h>
+
+#include "scheduler.h"
+#include "helpers.h"
+
+/*
+ * Start a full bucket that allows rate bytes per second (or anything, if rate is 0)
+ */
+void initTokenBucket(struct TokenBucket *bucket, uint64_t rate, uint32_t now)
+{
+	bucket->rate = rate;
+	uint64_t burst = rate * BUCKET_BURST_MICROS;
+	bucket->burst = burst > (uint64_t)MIN_BUCKET_BURST * SI_MICRO ? burst : (uint64_t)MIN_BUCKET_BURST * SI_MICRO;
+	bucket->tokens = bucket->burst;
+	bucket->lastRefill = now;
+}
+
+static void refillBucket(struct TokenBucket *bucket, uint32_t now)
+{
+	int32_t elapsed = now - bucket->lastRefill;
+	if (elapsed <= 0) {
+		return;
+	}
+	bucket->lastRefill = now;
+	bucket->tokens += (int64_t)bucket->rate * (elapsed < MAX_REFILL_MICROS ? elapsed : MAX_REFILL_MICROS);
+	if (bucket->tokens > bucket->burst) {
+		bucket->tokens = bucket->burst;
+	}
+}
+
+/*
+ * Check whether anything may be sent now (whether the bucket is out of debt)
+ */
+int hasTokens(struct TokenBucket *bucket, uint32_t now)
+{
+	if (!bucket->rate) {
+		return 1;
+	}
+	refillBucket(bucket, now);
+	return bucket->tokens > 0;
+}
+
+/*
+ * Spend len bytes of tokens, going into debt if there are not enough
+ */
+void takeTokens(struct TokenBucket *bucket, int len)
+{
+	if (bucket->rate) {
+		bucket->tokens -= (int64_t)len * SI_MICRO;
+	}
+}
+
+/*
+ * Get how many microseconds it takes for the bucket to get out of debt, as of its last refill
+ */
+int getTokenWait(const struct TokenBucket *bucket)
+{
+	if (!bucket->rate || bucket->tokens > 0) {
+		return 0;
+	}
+	int64_t wait = -bucket->tokens / (int64_t)bucket->rate + 1;
+	return wait < MAX_REFILL_MICROS ? (int)wait : MAX_REFILL_MICROS;
+}
+
+/*
+ * Start a scheduler for up to numFlows flows, none of which are active
+ */
+void initFlowScheduler(struct FlowScheduler *scheduler, int numFlows)
+{
+	memset(scheduler, 0, sizeof(struct FlowScheduler));
+	scheduler->numFlows = numFlows < MAX_FLOWS ? numFlows : MAX_FLOWS;
+}
+
+/*
+ * Make a flow active with the given weight and rate limit (0 for none). It joins the current round.
+ */
+void startFlow(struct FlowScheduler *scheduler, int index, int weight, uint64_t rate, uint32_t now)
+{
+	struct Flow *flow = scheduler->flows + index;
+	flow->isActive = 1;
+	flow->weight = weight;
+	flow->deficit = DRR_QUANTUM * weight;
+	initTokenBucket(&flow->bucket, rate, now);
+}
+
+void stopFlow(struct FlowScheduler *scheduler, int index)
+{
+	scheduler->flows[index].isActive = 0;
+}
+
+/*
+ * Pass the turn to the next flow and give it its quantum for the round. A flow that did not use up
+ * its last quantum (because it had nothing to send or was over its rate) does not save it up.
+ */
+static void advanceFlow(struct FlowScheduler *scheduler)
+{
+	scheduler->current = (scheduler->current + 1) % scheduler->numFlows;
+	struct Flow *flow = scheduler->flows + scheduler->current;
+	if (flow->isActive) {
+		int quantum = DRR_QUANTUM * flow->weight;
+		flow->deficit = flow->deficit + quantum < quantum ? flow->deficit + quantum : quantum;
+	}
+}
+
+/*
+ * Get the flow that should send next. Return its index, or -1 if every active flow is over its rate
+ * (or there are none).
+ */
+int pickFlow(struct FlowScheduler *scheduler, uint32_t now)
+{
+	// A flow's debt is at most a frame, which its next quantum covers, so one round reaches every flow that can send
+	for (int i = 0; i <= scheduler->numFlows; i++) {
+		struct Flow *flow = scheduler->flows + scheduler->current;
+		if (flow->isActive && flow->deficit > 0 && hasTokens(&flow->bucket, now)) {
+			return scheduler->current;
+		}
+		advanceFlow(scheduler);
+	}
+	return -1;
+}
+
+/*
+ * Charge a flow for sending len bytes. Its turn ends once it has used up its quantum.
+ */
+void chargeFlow(struct FlowScheduler *scheduler, int index, int len)
+{
+	struct Flow *flow = scheduler->flows + index;
+	flow->deficit -= len;
+	takeTokens(&flow->bucket, len);
+	if (index == scheduler->current && flow->deficit <= 0) {
+		advanceFlow(scheduler);
+	}
+}
+
+/*
+ * End the current flow's turn early, since it has nothing ready to send
+ */
+void skipFlow(struct FlowScheduler *scheduler)
+{
+	advanceFlow(scheduler);
+}
+
+/*
+ * Get how many microseconds it takes for the first flow that is over its rate to be allowed to send again,
+ * or 0 if no flow is waiting for its rate
+ */
+int getFlowWait(const struct FlowScheduler *scheduler)
+{
+	int minWait = 0;
+	for (int i = 0; i < scheduler->numFlows; i++) {
+		const struct Flow *flow = scheduler->flows + i;
+		int wait = flow->isActive ? getTokenWait(&flow->bucket) : 0;
+		if (wait && (!minWait || wait < minWait)) {
+			minWait = wait;
+		}
+	}
+	return minWait;
+}
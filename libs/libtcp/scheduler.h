@@ -0,0 +1,63 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#include "tcp.h"
+
+#define MAX_FLOWS 64
+#define DEFAULT_FLOW_WEIGHT 1
+#define MAX_FLOW_WEIGHT 1000
+#define DRR_QUANTUM MSS  // Bytes a flow of weight 1 may send in each round
+#define BUCKET_BURST_MICROS 10000  // A bucket holds up to 10 ms worth of its rate...
+#define MIN_BUCKET_BURST (4 * (HEADER_LEN + MSS))  // ...but at least a few segments, so that slow rates still send whole segments
+#define MAX_REFILL_MICROS 1000000  // Longest gap a refill accounts for (so a bucket idle for an hour is not miscounted)
+
+/*
+ * Limits a rate of bytes. Tokens build up at the rate, up to the burst, and are spent on what is sent.
+ * Sending may overdraw the bucket, so a flow is never cut off in the middle of a frame or segment;
+ * nothing more is sent until the debt is repaid.
+ */
+struct TokenBucket {
+	uint64_t rate;  // Bytes per second, or 0 if unlimited
+	int64_t burst;  // Most tokens that can build up, in byte-microseconds
+	int64_t tokens;  // In byte-microseconds, so that fractions of a byte are not lost between refills
+	uint32_t lastRefill;  // Microsecond timestamp
+};
+
+/*
+ * A flow that shares the sender with others
+ */
+struct Flow {
+	int isActive;
+	int weight;  // Share of the sender relative to the other flows
+	int deficit;  // Bytes the flow may still send in its current round (negative if it overran it)
+	struct TokenBucket bucket;
+};
+
+/*
+ * Shares a sender between flows with weighted deficit round robin: each round, a flow may send DRR_QUANTUM bytes
+ * for every unit of weight, so flows get bandwidth in proportion to their weights whatever the size of what they send,
+ * and a bulk flow cannot starve a small one. A flow may also have its own rate limit, and a flow that is over its rate
+ * or has nothing to send passes its turn to the next one.
+ */
+struct FlowScheduler {
+	struct Flow flows[MAX_FLOWS];
+	int numFlows;
+	int current;  // Flow whose turn it is
+};
+
+void initTokenBucket(struct TokenBucket *, uint64_t, uint32_t);
+int hasTokens(struct TokenBucket *, uint32_t);
+void takeTokens(struct TokenBucket *, int);
+int getTokenWait(const struct TokenBucket *);
+
+void initFlowScheduler(struct FlowScheduler *, int);
+void startFlow(struct FlowScheduler *, int, int, uint64_t, uint32_t);
+void stopFlow(struct FlowScheduler *, int);
+int pickFlow(struct FlowScheduler *, uint32_t);
+void chargeFlow(struct FlowScheduler *, int, int);
+void skipFlow(struct FlowScheduler *);
+int getFlowWait(const struct FlowScheduler *);
+
+#endif
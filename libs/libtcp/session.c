@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "session.h"
+#include "helpers.h"
+
+/*
+ * Write an open frame into room bytes. Return its length, 0 if it does not fit, or -1 if the name is too long.
+ */
+int writeOpenFrame(char *buffer, int room, uint32_t streamId, const char *name, uint64_t fileSize)
+{
+	int nameLen = strlen(name);
+	if (nameLen > MAX_FRAME_NAME_LEN) {
+		return -1;
+	} else if (OPEN_FRAME_HEADER_LEN + nameLen > room) {
+		return 0;
+	}
+	buffer[0] = FRAME_OPEN;
+	writeUint(buffer + 1, streamId, 4);
+	writeUint(buffer + 5, fileSize, 8);
+	buffer[13] = nameLen;
+	memcpy(buffer + OPEN_FRAME_HEADER_LEN, name, nameLen);
+	return OPEN_FRAME_HEADER_LEN + nameLen;
+}
+
+/*
+ * Write the header of a data frame. The data goes right after it.
+ */
+void writeDataFrameHeader(char *buffer, uint32_t streamId, uint64_t offset, int len)
+{
+	buffer[0] = FRAME_DATA;
+	writeUint(buffer + 1, streamId, 4);
+	writeUint(buffer + 5, offset, 8);
+	writeUint(buffer + 13, len, 2);
+}
+
+/*
+ * Read the first frame in a segment's data.
+ * Return its length, 0 if only padding is left, or -1 if the frame is malformed.
+ */
+int readFrame(const char *data, int len, struct Frame *frame)
+{
+	memset(frame, 0, sizeof(struct Frame));
+	if (len <= 0 || data[0] == FRAME_PADDING) {
+		return 0;
+	}
+
+	frame->type = data[0];
+	if (frame->type == FRAME_OPEN && len >= OPEN_FRAME_HEADER_LEN) {
+		frame->len = (uint8_t)data[13];
+	} else if (frame->type == FRAME_DATA && len >= DATA_FRAME_HEADER_LEN) {
+		frame->len = readUint(data + 13, 2);
+	} else {
+		return -1;
+	}
+	int headerLen = frame->type == FRAME_OPEN ? OPEN_FRAME_HEADER_LEN : DATA_FRAME_HEADER_LEN;
+	if (headerLen + frame->len > len) {
+		return -1;
+	}
+	frame->streamId = readUint(data + 1, 4);
+	frame->value = readUint(data + 5, 8);
+	frame->data = data + headerLen;
+	return headerLen + frame->len;
+}
+
+/*
+ * Start an empty table
+ */
+void initStreamTable(struct StreamTable *table)
+{
+	memset(table, 0, sizeof(struct StreamTable));
+}
+
+/*
+ * Get the stream with the given ID, adding it if it is not in the table. Return NULL if it cannot be added.
+ */
+struct Stream *getStream(struct StreamTable *table, uint32_t streamId)
+{
+	struct Stream **bucket = table->buckets + streamId % STREAM_TABLE_SIZE;
+	for (struct Stream *stream = *bucket; stream; stream = stream->next) {
+		if (stream->id == streamId) {
+			return stream;
+		}
+	}
+
+	struct Stream *stream = calloc(1, sizeof(struct Stream));
+	if (!stream) {
+		return NULL;
+	}
+	stream->id = streamId;
+	stream->fd = -1;
+	stream->next = *bucket;
+	*bucket = stream;
+	table->count++;
+	return stream;
+}
+
+/*
+ * Get any stream in the table, or NULL if it is empty
+ */
+struct Stream *firstStream(const struct StreamTable *table)
+{
+	for (int i = 0; i < STREAM_TABLE_SIZE; i++) {
+		if (table->buckets[i]) {
+			return table->buckets[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Remove a stream from the table and free it
+ */
+void removeStream(struct StreamTable *table, struct Stream *stream)
+{
+	struct Stream **link = table->buckets + stream->id % STREAM_TABLE_SIZE;
+	while (*link != stream) {
+		link = &(*link)->next;
+	}
+	*link = stream->next;
+	table->count--;
+	free(stream);
+}
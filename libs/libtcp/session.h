@@ -0,0 +1,61 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+
+// Frame types
+#define FRAME_PADDING 0  // Fills the rest of a segment
+#define FRAME_OPEN 1  // A stream starts (its file's size and name follow)
+#define FRAME_DATA 2  // Part of a stream's file (its offset, length, and data follow)
+
+#define OPEN_FRAME_HEADER_LEN 14  // Type (1 byte), stream ID (4 bytes), file size (8 bytes), and name length (1 byte)
+#define DATA_FRAME_HEADER_LEN 15  // Type (1 byte), stream ID (4 bytes), offset (8 bytes), and length (2 bytes)
+#define MAX_FRAME_NAME_LEN 255
+#define DEFAULT_STREAMS 4  // Number of files the client sends at once
+#define MAX_STREAMS 64
+#define STREAM_TABLE_SIZE 256  // Number of buckets in a stream table
+
+/*
+ * In a session, each file is a stream and the data of every segment is a list of frames (in network byte order).
+ * A frame never spans segments, so a segment can be handled as soon as it arrives, whatever was lost before it.
+ * Stream IDs are never reused within a session.
+ */
+struct Frame {
+	int type;
+	uint32_t streamId;
+	uint64_t value;  // File size of an open frame, or offset of a data frame
+	const char *data;  // Name of an open frame (not null-terminated), or data of a data frame
+	int len;
+};
+
+/*
+ * A stream the receiver has seen part of
+ */
+struct Stream {
+	uint32_t id;
+	int fd;  // -1 until the file is created
+	uint64_t size;
+	uint64_t received;  // Bytes of the file received so far
+	uint64_t end;  // End of the furthest data received so far
+	int isOpen;  // Whether the open frame has been received
+	struct Stream *next;  // Next stream in the same bucket
+};
+
+/*
+ * A hash table of streams that have not been completely received
+ */
+struct StreamTable {
+	struct Stream *buckets[STREAM_TABLE_SIZE];
+	int count;
+};
+
+int writeOpenFrame(char *, int, uint32_t, const char *, uint64_t);
+void writeDataFrameHeader(char *, uint32_t, uint64_t, int);
+int readFrame(const char *, int, struct Frame *);
+
+void initStreamTable(struct StreamTable *);
+struct Stream *getStream(struct StreamTable *, uint32_t);
+struct Stream *firstStream(const struct StreamTable *);
+void removeStream(struct StreamTable *, struct Stream *);
+
+#endif
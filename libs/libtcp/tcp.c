@@ -4,70 +4,44 @@
 
 #include "tcp.h"
 
-/*
- * Check if the nth bit is set in num
- */
-static int getNthBit(int num, int n)
-{
-	return num >> n & 1;
-}
+#define LENGTH_FLAGS_WORD 6  // Index of the header word that holds the length and flags bytes
+#define HEADER_LENGTH 0x70  // 01110000 (the timestamps make the header 7 words)
 
 /*
- * Set the nth bit in num to 1
+ * Fold the carries of a sum of 16-bit words back into the low 16 bits (one's complement addition)
  */
-static int setNthBit(int num, int n)
+static uint16_t foldSum(uint32_t sum)
 {
-	return num | (1 << n);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (sum & 0xffff) + (sum >> 16);
 }
 
 /*
- * Perform a bitwise sum between a and b. Result and carryover are stored.
+ * Calculate the sum of all the words in a header in host byte order
  */
-static void doBitwiseSum(uint16_t a, uint16_t b, uint16_t *resPtr, uint16_t *carryoverPtr)
+uint16_t calculateSumOfHeaderWords(const struct TCPSegment *segment)
 {
-	uint16_t res = 0;
-	int carryover = 0;
-	for (int i = 0; i < 16; i++) {
-		int currA = getNthBit(a, i);
-		int currB = getNthBit(b, i);
-
-		int sum = currA + currB + carryover;
-		if (sum == 1) {
-			res = setNthBit(res, i);
-			carryover = 0;
-		} else if (sum == 2) {
-			carryover = 1;
-		} else if (sum == 3) {
-			res = setNthBit(res, i);
-			carryover = 1;
-		}
+	const uint16_t *words = (const uint16_t *)segment;
+	uint32_t sum = 0;
+	for (int i = 0; i < HEADER_LEN / 2; i++) {
+		sum += words[i];
 	}
-	*resPtr = res;
-	*carryoverPtr = carryover;
+	return foldSum(sum);
 }
 
 /*
- * Calculate the sum between a and b. Carryovers are wrapped around.
+ * Calculate the sum that the checksum covers from a header in network byte order. A one's complement sum
+ * of byte-swapped words is the byte-swapped sum (RFC 1071), so the header does not have to be converted first.
+ * The length and flags are single bytes that are never swapped, so only their word is swapped to match.
  */
-static uint16_t calculateSumWithOverflow(uint16_t a, uint16_t b)
+static uint16_t sumNetworkHeader(const struct TCPSegment *segment)
 {
-	do {
-		doBitwiseSum(a, b, &a, &b);
-	} while (b);
-	return a;
-}
-
-/*
- * Calculate the sum of all the words in the header
- */
-uint16_t calculateSumOfHeaderWords(const struct TCPSegment *segment)
-{
-	uint16_t *rawSegmentPtr = (uint16_t *)segment;
-	uint16_t sum = 0;
+	const uint16_t *words = (const uint16_t *)segment;
+	uint32_t sum = 0;
 	for (int i = 0; i < HEADER_LEN / 2; i++) {
-		sum = calculateSumWithOverflow(sum, *(rawSegmentPtr + i));
+		sum += words[i];
 	}
-	return sum;
+	return foldSum(sum - words[LENGTH_FLAGS_WORD] + htons(words[LENGTH_FLAGS_WORD]));
 }
 
 /*
@@ -79,65 +53,109 @@ int isFlagSet(const struct TCPSegment *segment, uint8_t flag)
 }
 
 /*
- * Fill a TCP segment
+ * Write a header in network byte order. The checksum is summed from the host-order values as they are written,
+ * so nothing is converted twice. Every caller passes constant flags, so each kind of segment gets its own copy.
  */
-void fillTCPSegment(struct TCPSegment *segment, uint16_t sourcePort, uint16_t destPort,
-	uint32_t seqNum, uint32_t ackNum, uint8_t flags, const char *data, int dataLen)
+static inline void encodeHeader(struct TCPSegment *segment, uint16_t sourcePort, uint16_t destPort,
+	uint32_t seqNum, uint32_t ackNum, uint8_t flags, uint32_t tsVal, uint32_t tsEcr)
 {
-	segment->sourcePort = sourcePort;
-	segment->destPort = destPort;
-	segment->seqNum = seqNum;
-	segment->ackNum = ackNum;
-	segment->length = 0x50;  // 01010000
+	segment->sourcePort = htons(sourcePort);
+	segment->destPort = htons(destPort);
+	segment->seqNum = htonl(seqNum);
+	segment->ackNum = htonl(ackNum);
+	segment->length = HEADER_LENGTH;
 	segment->flags = flags;
 	segment->recvWindow = 0;
-	segment->checksum = 0;
 	segment->urgentPtr = 0;
+	segment->tsVal = htonl(tsVal);
+	segment->tsEcr = htonl(tsEcr);
 
-	uint16_t checksum = calculateSumOfHeaderWords(segment);
-	segment->checksum = ~checksum;
+	// The checksum is defined over the header in host byte order, where the length and flags word is read as it lies in memory
+	uint16_t lengthFlags;
+	memcpy(&lengthFlags, &segment->length, sizeof(lengthFlags));
+	uint32_t sum = sourcePort + destPort + (seqNum >> 16) + (seqNum & 0xffff) + (ackNum >> 16) + (ackNum & 0xffff)
+		+ lengthFlags + (tsVal >> 16) + (tsVal & 0xffff) + (tsEcr >> 16) + (tsEcr & 0xffff);
+	segment->checksum = htons((uint16_t)~foldSum(sum));
+}
 
+/*
+ * Fill a segment in network byte order, ready to be sent
+ */
+void encodeTCPSegment(struct TCPSegment *segment, uint16_t sourcePort, uint16_t destPort,
+	uint32_t seqNum, uint32_t ackNum, uint8_t flags, uint32_t tsVal, uint32_t tsEcr,
+	const char *data, int dataLen)
+{
+	encodeHeader(segment, sourcePort, destPort, seqNum, ackNum, flags, tsVal, tsEcr);
 	memcpy(segment->data, data, dataLen);
 }
 
 /*
- * Convert a TCP segment to network or host byte order
+ * Fill a data segment (which has no flags) in network byte order
  */
-void convertTCPSegment(struct TCPSegment *segment, int toNetwork)
+void encodeDataSegment(struct TCPSegment *segment, uint16_t sourcePort, uint16_t destPort,
+	uint32_t seqNum, uint32_t ackNum, uint32_t tsVal, uint32_t tsEcr, const char *data, int dataLen)
 {
-	if (toNetwork) {
-		segment->sourcePort = htons(segment->sourcePort);
-		segment->destPort = htons(segment->destPort);
-		segment->seqNum = htonl(segment->seqNum);
-		segment->ackNum = htonl(segment->ackNum);
-		// length and flags not endian-specific
-		segment->recvWindow = htons(segment->recvWindow);
-		segment->checksum = htons(segment->checksum);
-		segment->urgentPtr = htons(segment->urgentPtr);
-	} else {
-		segment->sourcePort = ntohs(segment->sourcePort);
-		segment->destPort = ntohs(segment->destPort);
-		segment->seqNum = ntohl(segment->seqNum);
-		segment->ackNum = ntohl(segment->ackNum);
-		// length and flags not endian-specific
-		segment->recvWindow = ntohs(segment->recvWindow);
-		segment->checksum = ntohs(segment->checksum);
-		segment->urgentPtr = ntohs(segment->urgentPtr);
-	}
+	encodeHeader(segment, sourcePort, destPort, seqNum, ackNum, 0, tsVal, tsEcr);
+	memcpy(segment->data, data, dataLen);
+}
+
+/*
+ * Fill an ACK in network byte order. Its data (if any) is information about the received segments.
+ */
+void encodeACKSegment(struct TCPSegment *segment, uint16_t sourcePort, uint16_t destPort,
+	uint32_t seqNum, uint32_t ackNum, uint32_t tsVal, uint32_t tsEcr, const char *data, int dataLen)
+{
+	encodeHeader(segment, sourcePort, destPort, seqNum, ackNum, ACK_FLAG, tsVal, tsEcr);
+	memcpy(segment->data, data, dataLen);
 }
 
 /*
- * Determine whether a segment is corrupt using its checksum
+ * Recompute the checksum of a segment in network byte order after changing its header
+ */
+void checksumTCPSegment(struct TCPSegment *segment)
+{
+	segment->checksum = 0;
+	segment->checksum = ~sumNetworkHeader(segment);
+}
+
+/*
+ * Convert a received segment to host byte order. Return whether its checksum is valid.
+ */
+int decodeTCPSegment(struct TCPSegment *segment)
+{
+	int isValid = sumNetworkHeader(segment) == 0xffff;
+	segment->sourcePort = ntohs(segment->sourcePort);
+	segment->destPort = ntohs(segment->destPort);
+	segment->seqNum = ntohl(segment->seqNum);
+	segment->ackNum = ntohl(segment->ackNum);
+	// length and flags not endian-specific
+	segment->recvWindow = ntohs(segment->recvWindow);
+	segment->checksum = ntohs(segment->checksum);
+	segment->urgentPtr = ntohs(segment->urgentPtr);
+	segment->tsVal = ntohl(segment->tsVal);
+	segment->tsEcr = ntohl(segment->tsEcr);
+	return isValid;
+}
+
+/*
+ * Give a segment that is already in network byte order a new timestamp (used when resending it).
+ * The checksum is updated for the changed words (RFC 1624) instead of being recomputed.
+ */
+void stampTCPSegment(struct TCPSegment *segment, uint32_t tsVal)
+{
+	uint32_t oldTs = segment->tsVal, newTs = htonl(tsVal);
+	uint32_t sum = (uint16_t)~segment->checksum + (uint16_t)~oldTs + (uint16_t)~(oldTs >> 16)
+		+ (newTs & 0xffff) + (newTs >> 16);
+	segment->tsVal = newTs;
+	segment->checksum = ~foldSum(sum);
+}
+
+/*
+ * Determine whether a segment in host byte order is corrupt using its checksum
  */
 int isChecksumValid(const struct TCPSegment *segment)
 {
-	uint16_t totalSum = calculateSumOfHeaderWords(segment);
-	for (int i = 0; i < 16; i++) {
-		if (!getNthBit(totalSum, i)) {
-			return 0;
-		}
-	}
-	return 1;
+	return calculateSumOfHeaderWords(segment) == 0xffff;
 }
 
 /*
@@ -155,5 +173,7 @@ void printTCPHeader(const struct TCPSegment *segment)
 	fprintf(stderr, "\trecvWindow: %d\n", segment->recvWindow);
 	fprintf(stderr, "\tchecksum: %x\n", segment->checksum);
 	fprintf(stderr, "\turgentPtr: %d\n", segment->urgentPtr);
+	fprintf(stderr, "\ttsVal: %u\n", segment->tsVal);
+	fprintf(stderr, "\ttsEcr: %u\n", segment->tsEcr);
 	fprintf(stderr, "}\n");
 }
@@ -4,7 +4,7 @@
 #include <assert.h>
 #include <stdint.h>
 
-#define HEADER_LEN 20
+#define HEADER_LEN 28
 #define MSS 576
 
 #define ACK_FLAG 0x10
@@ -21,6 +21,8 @@ struct TCPSegment {
 	uint16_t recvWindow;
 	uint16_t checksum;
 	uint16_t urgentPtr;
+	uint32_t tsVal;  // Sender's timestamp, in microseconds
+	uint32_t tsEcr;  // Most recent timestamp received from the other side (echoed back)
 
 	char data[MSS];
 };
@@ -29,9 +31,15 @@ static_assert(sizeof(struct TCPSegment) == HEADER_LEN + MSS,
 
 uint16_t calculateSumOfHeaderWords(const struct TCPSegment *);
 int isFlagSet(const struct TCPSegment *, uint8_t);
-void fillTCPSegment(struct TCPSegment *, uint16_t, uint16_t,
-	uint32_t, uint32_t, uint8_t, const char *, int);
-void convertTCPSegment(struct TCPSegment *, int);
+void encodeTCPSegment(struct TCPSegment *, uint16_t, uint16_t,
+	uint32_t, uint32_t, uint8_t, uint32_t, uint32_t, const char *, int);
+void encodeDataSegment(struct TCPSegment *, uint16_t, uint16_t,
+	uint32_t, uint32_t, uint32_t, uint32_t, const char *, int);
+void encodeACKSegment(struct TCPSegment *, uint16_t, uint16_t,
+	uint32_t, uint32_t, uint32_t, uint32_t, const char *, int);
+void checksumTCPSegment(struct TCPSegment *);
+int decodeTCPSegment(struct TCPSegment *);
+void stampTCPSegment(struct TCPSegment *, uint32_t);
 int isChecksumValid(const struct TCPSegment *);
 void printTCPHeader(const struct TCPSegment *);
 
@@ -0,0 +1,119 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "token.h"
+#include "hash.h"
+#include "helpers.h"
+
+static uint64_t getMAC(const uint8_t *secret, uint32_t address, uint32_t issueTime)
+{
+	uint8_t message[8];
+	writeUint((char *)message, address, 4);
+	writeUint((char *)message + 4, issueTime, 4);
+	return sipHash(secret, message, sizeof(message));
+}
+
+/*
+ * Make a token for a client at address (in network byte order) at the given time, in seconds
+ */
+void makeToken(char *token, const uint8_t *secret, uint32_t address, uint32_t issueTime)
+{
+	writeUint(token, issueTime, 4);
+	writeUint(token + 4, getMAC(secret, address, issueTime), 8);
+}
+
+/*
+ * Check that a token was made with this secret for a client at address and has not expired
+ */
+int isTokenValid(const char *token, const uint8_t *secret, uint32_t address, uint32_t now)
+{
+	uint32_t issueTime = readUint(token, 4);
+	uint64_t mac = readUint(token + 4, 8);
+	// Compare every bit regardless of where they differ
+	uint64_t diff = mac ^ getMAC(secret, address, issueTime);
+	return !diff && now - issueTime <= TOKEN_LIFETIME;
+}
+
+/*
+ * Read the server's secret from path, or create it from /dev/urandom if the file does not exist
+ */
+int loadTokenSecret(const char *path, uint8_t *secret)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		int status = readFully(fd, secret, TOKEN_SECRET_LEN, 0);
+		close(fd);
+		if (status < 0) {
+			fprintf(stderr, "error: token secret file is too short\n");
+		}
+		return status;
+	} else if (errno != ENOENT) {
+		perror("open");
+		return -1;
+	}
+
+	int randomFd = open("/dev/urandom", O_RDONLY);
+	if (randomFd < 0) {
+		perror("open");
+		return -1;
+	}
+	int status = readFully(randomFd, secret, TOKEN_SECRET_LEN, 0);
+	close(randomFd);
+	if (status < 0) {
+		fprintf(stderr, "error: failed to read /dev/urandom\n");
+		return -1;
+	}
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR)) < 0) {
+		perror("open");
+		return -1;
+	}
+	if (write(fd, secret, TOKEN_SECRET_LEN) != TOKEN_SECRET_LEN) {
+		perror("write");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * Read a token saved by the client. Return 1 if there is one, 0 if there is none, or -1 on failure.
+ */
+int loadToken(const char *path, char *token)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+		perror("open");
+		return -1;
+	}
+	int status = readFully(fd, token, TOKEN_LEN, 0);
+	close(fd);
+	// A truncated token is as good as none
+	return status < 0 ? 0 : 1;
+}
+
+/*
+ * Save a token for the next connection
+ */
+int saveToken(const char *path, const char *token)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	if (write(fd, token, TOKEN_LEN) != TOKEN_LEN) {
+		perror("write");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
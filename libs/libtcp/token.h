@@ -0,0 +1,21 @@
+#ifndef TOKEN_H
+#define TOKEN_H
+
+#include <stdint.h>
+
+#define TOKEN_LEN 12  // Issue time (4 bytes) and MAC (8 bytes)
+#define TOKEN_SECRET_LEN 16
+#define TOKEN_LIFETIME (24 * 60 * 60)  // How long a token is accepted after it is issued, in seconds
+
+/*
+ * A token lets a client that connected before send data without waiting for the handshake.
+ * It is a SipHash-2-4 MAC of the client's address and the issue time, keyed with a secret only the server knows,
+ * so a sender that never received a SYNACK at that address cannot make one up.
+ */
+void makeToken(char *, const uint8_t *, uint32_t, uint32_t);
+int isTokenValid(const char *, const uint8_t *, uint32_t, uint32_t);
+int loadTokenSecret(const char *, uint8_t *);
+int loadToken(const char *, char *);
+int saveToken(const char *, const char *);
+
+#endif
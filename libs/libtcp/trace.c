@@ -0,0 +1,135 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define FLUSH_BATCH 256  // Maximum number of records written at once
+#define FLUSH_INTERVAL 1000  // How long the flusher sleeps when there is nothing to write, in microseconds
+
+static uint64_t getMonotonicMicros(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Write out everything currently in the ring
+ */
+static void flushTrace(struct Trace *trace)
+{
+	struct TraceRecord batch[FLUSH_BATCH];
+	int batchLen;
+	do {
+		for (batchLen = 0; batchLen < FLUSH_BATCH && ringPop(&trace->ring, batch + batchLen);
+			batchLen++);
+		if (batchLen && fwrite(batch, sizeof(struct TraceRecord), batchLen, trace->file)
+			!= batchLen) {
+			perror("fwrite");
+		}
+	} while (batchLen == FLUSH_BATCH);
+}
+
+static void *runFlusher(void *arg)
+{
+	struct Trace *trace = arg;
+	while (!atomic_load(&trace->isStopping)) {
+		if (!ringSize(&trace->ring)) {
+			usleep(FLUSH_INTERVAL);
+			continue;
+		}
+		flushTrace(trace);
+	}
+	flushTrace(trace);
+	return NULL;
+}
+
+/*
+ * Open a trace file and start the thread that writes records to it
+ */
+int startTrace(struct Trace *trace, const char *path, int capacity)
+{
+	memset(trace, 0, sizeof(struct Trace));
+	if (!(trace->file = fopen(path, "wb"))) {
+		perror("fopen");
+		return -1;
+	}
+	if (initRing(&trace->ring, capacity, sizeof(struct TraceRecord)) < 0) {
+		perror("malloc");
+		fclose(trace->file);
+		return -1;
+	}
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	struct TraceFileHeader header;
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.recordSize = sizeof(struct TraceRecord);
+	header.startTime = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+	trace->startTime = getMonotonicMicros();
+	if (fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+		perror("fwrite");
+		goto fail;
+	}
+
+	if ((errno = pthread_create(&trace->thread, NULL, runFlusher, trace))) {
+		perror("pthread_create");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	freeRing(&trace->ring);
+	fclose(trace->file);
+	return -1;
+}
+
+/*
+ * Timestamp a record and queue it for writing. This never blocks: if the flusher
+ * has fallen behind, the record is dropped and counted. A NULL trace is ignored.
+ */
+void traceEvent(struct Trace *trace, struct TraceRecord *record)
+{
+	if (!trace) {
+		return;
+	}
+	record->timestamp = getMonotonicMicros() - trace->startTime;
+	if (!ringPush(&trace->ring, record)) {
+		atomic_fetch_add_explicit(&trace->dropped, 1, memory_order_relaxed);
+	}
+}
+
+/*
+ * Write the remaining records and close the trace file
+ */
+void stopTrace(struct Trace *trace)
+{
+	atomic_store(&trace->isStopping, 1);
+	pthread_join(trace->thread, NULL);
+	unsigned long dropped = atomic_load(&trace->dropped);
+	if (dropped) {
+		fprintf(stderr, "warning: dropped %lu trace records\n", dropped);
+	}
+	freeRing(&trace->ring);
+	fclose(trace->file);
+}
+
+/*
+ * Read and validate the header at the start of a trace file
+ */
+int readTraceHeader(FILE *file, struct TraceFileHeader *header)
+{
+	if (fread(header, sizeof(struct TraceFileHeader), 1, file) != 1) {
+		return -1;
+	}
+	if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0
+		|| header->version != TRACE_VERSION
+		|| header->recordSize != sizeof(struct TraceRecord)) {
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ring.h"
+
+#define TRACE_MAGIC "TCPTRACE"
+#define TRACE_VERSION 1
+#define DEFAULT_TRACE_CAPACITY 65536  // Number of records buffered before events are dropped
+
+// Trace events
+#define TRACE_SEND 1  // A segment was sent for the first time
+#define TRACE_RECV 2  // A valid segment was received
+#define TRACE_RETRANSMIT 3  // A segment was resent
+#define TRACE_TIMEOUT 4  // The retransmission timer went off
+#define TRACE_RTT 5  // An RTT sample was taken (sample holds the RTT)
+#define TRACE_CORRUPT 6  // A segment with a bad checksum was received
+#define TRACE_SPURIOUS 7  // A timeout turned out to be spurious and was undone
+#define TRACE_RECOVER 8  // Segments were rebuilt from parity (sample holds how many)
+
+/*
+ * Trace files start with a TraceFileHeader followed by TraceRecords,
+ * all in the byte order of the machine that recorded them
+ */
+struct TraceFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint64_t startTime;  // Wall clock time when tracing started, in microseconds
+};
+
+struct TraceRecord {
+	uint64_t timestamp;  // Microseconds since tracing started
+	uint32_t seqNum;
+	uint32_t ackNum;
+	uint16_t length;  // Amount of data in the segment
+	uint8_t event;
+	uint8_t flags;
+	uint32_t windowLength;  // Number of segments in the sender's window
+	uint32_t rto;  // Retransmission timeout, in microseconds
+	uint32_t sample;
+};
+static_assert(sizeof(struct TraceRecord) == 32, "TraceRecord struct not packed");
+
+struct Trace {
+	struct Ring ring;
+	FILE *file;
+	uint64_t startTime;  // Monotonic time when tracing started, in microseconds
+	atomic_ulong dropped;  // Records lost because the ring was full
+	atomic_int isStopping;
+	pthread_t thread;
+};
+
+int startTrace(struct Trace *, const char *, int);
+void traceEvent(struct Trace *, struct TraceRecord *);
+void stopTrace(struct Trace *);
+int readTraceHeader(FILE *, struct TraceFileHeader *);
+
+#endif
@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "tuning.h"
+
+static long getMonotonicMicros(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * Set a socket buffer, going past the system limit where allowed. Return the size the kernel settled on
+ * (halved, since the kernel doubles what it is asked for).
+ */
+static int setBufferSize(int sock, int optName, int forceOptName, int size)
+{
+	if (forceOptName < 0 || setsockopt(sock, SOL_SOCKET, forceOptName, &size, sizeof(size)) < 0) {
+		// Only privileged processes can force the size, so the kernel caps this at its limit instead
+		setsockopt(sock, SOL_SOCKET, optName, &size, sizeof(size));
+	}
+	int actual = 0;
+	socklen_t actualLen = sizeof(actual);
+	getsockopt(sock, SOL_SOCKET, optName, &actual, &actualLen);
+	return actual / 2;
+}
+
+static int capBufferSize(long size)
+{
+	return size > MAX_SOCKET_BUFFER ? MAX_SOCKET_BUFFER : size;
+}
+
+static void setSendBufferSize(struct SocketTuner *tuner, int size)
+{
+#ifdef SO_SNDBUFFORCE
+	setBufferSize(tuner->sock, SO_SNDBUF, SO_SNDBUFFORCE, size);
+#else
+	setBufferSize(tuner->sock, SO_SNDBUF, -1, size);
+#endif
+}
+
+static void setReceiveBufferSize(struct SocketTuner *tuner, int size)
+{
+#ifdef SO_RCVBUFFORCE
+	int actual = setBufferSize(tuner->sock, SO_RCVBUF, SO_RCVBUFFORCE, size);
+#else
+	int actual = setBufferSize(tuner->sock, SO_RCVBUF, -1, size);
+#endif
+	if (actual < size && !tuner->hasWarned) {
+		fprintf(stderr, "warning: socket receive buffer is capped at %d bytes (raise net.core.rmem_max)\n", actual);
+		tuner->hasWarned = 1;
+	}
+	tuner->recvBufferSize = actual;
+}
+
+/*
+ * Start tuning sock. The kernel is asked to report drops, and to busy-poll if isBusyPolling is set.
+ */
+int initSocketTuner(struct SocketTuner *tuner, int sock, int isBusyPolling)
+{
+	memset(tuner, 0, sizeof(struct SocketTuner));
+	tuner->sock = sock;
+	tuner->isBusyPolling = isBusyPolling;
+	int size = 0;
+	socklen_t sizeLen = sizeof(size);
+	if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, &sizeLen) < 0) {
+		perror("getsockopt");
+		return -1;
+	}
+	tuner->recvBufferSize = size / 2;
+#ifdef SO_RXQ_OVFL
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#endif
+#ifdef SO_BUSY_POLL
+	// Lets the kernel poll the device instead of waiting for an interrupt where the driver supports it.
+	// This may need privileges (and does nothing on loopback), so the spinning below does not rely on it.
+	int busyPollMicros = BUSY_POLL_MICROS;
+	if (isBusyPolling) {
+		setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &busyPollMicros, sizeof(busyPollMicros));
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Make room for numDatagrams datagrams of sendLen bytes to be sent and of recvLen bytes to be received
+ * (either of which may be 0 to leave that buffer alone). Buffers are never shrunk.
+ */
+void sizeSocketBuffers(struct SocketTuner *tuner, int numDatagrams, int sendLen, int recvLen)
+{
+	int sendSize = capBufferSize((long)numDatagrams * (sendLen + DATAGRAM_OVERHEAD));
+	int recvSize = capBufferSize((long)numDatagrams * (recvLen + DATAGRAM_OVERHEAD));
+	int size = 0;
+	socklen_t sizeLen = sizeof(size);
+	getsockopt(tuner->sock, SOL_SOCKET, SO_SNDBUF, &size, &sizeLen);
+	if (sendLen && sendSize > size / 2) {
+		setSendBufferSize(tuner, sendSize);
+	}
+	if (recvLen && recvSize > tuner->recvBufferSize) {
+		setReceiveBufferSize(tuner, recvSize);
+	}
+}
+
+/*
+ * Wait up to timeoutMicros for a datagram. Return 1 if one is ready, 0 on timeout, or -1 on error.
+ */
+int waitForDatagram(struct SocketTuner *tuner, int timeoutMicros)
+{
+	if (!tuner->isBusyPolling) {
+		fd_set readFds;
+		FD_ZERO(&readFds);
+		FD_SET(tuner->sock, &readFds);
+		struct timeval timeout = { timeoutMicros / 1000000, timeoutMicros % 1000000 };
+		int fdsReady = select(tuner->sock + 1, &readFds, NULL, NULL, &timeout);
+		if (fdsReady < 0) {
+			perror("select");
+		}
+		return fdsReady;
+	}
+
+	long deadline = getMonotonicMicros() + timeoutMicros;
+	char byte;
+	for (;;) {
+		if (recv(tuner->sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT) >= 0) {
+			return 1;
+		} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("recv");
+			return -1;
+		} else if (getMonotonicMicros() >= deadline) {
+			return 0;
+		}
+	}
+}
+
+/*
+ * Receive a datagram, waiting (or spinning, with busy polling) until one arrives. numDropped is set to the number
+ * of datagrams the kernel dropped since the last call, in which case the receive buffer is doubled.
+ */
+ssize_t receiveDatagram(struct SocketTuner *tuner, void *buffer, size_t len, int *numDropped)
+{
+	struct iovec iov = { .iov_base = buffer, .iov_len = len };
+	union {
+		char buffer[CMSG_SPACE(sizeof(uint32_t))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	ssize_t received;
+	do {
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+		received = recvmsg(tuner->sock, &msg, tuner->isBusyPolling ? MSG_DONTWAIT : 0);
+	} while (received < 0 && tuner->isBusyPolling && (errno == EAGAIN || errno == EWOULDBLOCK));
+	if (received < 0) {
+		perror("recvmsg");
+		return -1;
+	}
+
+	*numDropped = 0;
+#ifdef SO_RXQ_OVFL
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+			uint32_t drops;
+			memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+			*numDropped = drops - tuner->drops;
+			tuner->drops = drops;
+		}
+	}
+#endif
+	if (*numDropped > 0 && tuner->recvBufferSize < MAX_SOCKET_BUFFER) {
+		setReceiveBufferSize(tuner, capBufferSize(2L * tuner->recvBufferSize));
+	}
+	return received;
+}
@@ -0,0 +1,29 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DATAGRAM_OVERHEAD 384  // Roughly how much kernel memory a datagram takes beyond its data
+#define MAX_SOCKET_BUFFER (64 * 1024 * 1024)
+#define BUSY_POLL_MICROS 50  // How long the kernel may busy-poll the device for a datagram
+
+/*
+ * Sizes a UDP socket's buffers, counts the datagrams the kernel dropped because the receive buffer was full,
+ * and grows the receive buffer whenever that happens. With busy polling, waiting for a datagram spins
+ * instead of sleeping in select.
+ */
+struct SocketTuner {
+	int sock;
+	int recvBufferSize;  // Size asked for (the kernel doubles it for its bookkeeping)
+	uint32_t drops;  // Last value of the kernel's drop counter
+	int isBusyPolling;
+	int hasWarned;  // Whether the user has been told that the receive buffer was capped
+};
+
+int initSocketTuner(struct SocketTuner *, int, int);
+void sizeSocketBuffers(struct SocketTuner *, int, int, int);
+int waitForDatagram(struct SocketTuner *, int);
+ssize_t receiveDatagram(struct SocketTuner *, void *, size_t, int *);
+
+#endif
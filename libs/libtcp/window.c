@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -8,17 +9,25 @@
  */
 struct Window *newWindow(int capacity)
 {
-	struct TCPSegmentEntry *arr = malloc(capacity * sizeof(struct TCPSegmentEntry));
+	struct TCPSegmentEntry **arr = malloc(capacity * sizeof(struct TCPSegmentEntry *));
 	if (!arr) {
 		return NULL;
 	}
+	struct BufferPool *pool = newBufferPool(sizeof(struct TCPSegmentEntry), capacity,
+		POOL_HUGE_PAGES | POOL_ONE_THREAD);
+	if (!pool) {
+		free(arr);
+		return NULL;
+	}
 	struct Window *window = malloc(sizeof(struct Window));
 	if (!window) {
+		freeBufferPool(pool);
 		free(arr);
 		return NULL;
 	}
 
 	window->arr = arr;
+	window->pool = pool;
 	window->length = 0;
 	window->capacity = capacity;
 	window->startIndex = 0;
@@ -31,6 +40,7 @@ struct Window *newWindow(int capacity)
  */
 void freeWindow(struct Window *window)
 {
+	freeBufferPool(window->pool);
 	free(window->arr);
 	free(window);
 }
@@ -57,16 +67,26 @@ int next(const struct Window *window, int index)
 }
 
 /*
- * Offer a TCP segment entry to the window
+ * Copy a TCP segment entry (only as much of its data as dataLen says) to the end of the window.
+ * Return the copy, or NULL if the window is full or has no memory for it.
  */
-void offer(struct Window *window, const struct TCPSegmentEntry *entry)
+struct TCPSegmentEntry *offer(struct Window *window, const struct TCPSegmentEntry *entry)
 {
-	if (isFull(window)) {
-		return;
+	struct TCPSegmentEntry *copy;
+	if (isFull(window) || !(copy = allocBuffer(window->pool))) {
+		return NULL;
 	}
-	memcpy(window->arr + window->endIndex, entry, sizeof(struct TCPSegmentEntry));
+	memcpy(copy, entry, offsetof(struct TCPSegmentEntry, segment.data) + entry->dataLen);
+	copy->dataLen = entry->dataLen;
+	copy->path = entry->path;
+	copy->isResent = entry->isResent;
+	copy->isSacked = entry->isSacked;
+	copy->seqNum = entry->seqNum;
+	copy->tsVal = entry->tsVal;
+	window->arr[window->endIndex] = copy;
 	window->endIndex = next(window, window->endIndex);
 	window->length++;
+	return copy;
 }
 
 /*
@@ -77,6 +97,7 @@ void deleteHead(struct Window *window)
 	if (isEmpty(window)) {
 		return;
 	}
+	releaseBuffer(window->arr[window->startIndex]);
 	window->startIndex = next(window, window->startIndex);
 	window->length--;
 }
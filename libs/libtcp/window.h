@@ -2,14 +2,25 @@
 #define WINDOW_H
 
 #include "tcp.h"
+#include "pool.h"
 
 struct TCPSegmentEntry {
 	struct TCPSegment segment;
 	int dataLen;
+	int path;  // Index of the path the segment was last sent on
+	int isResent;
+	int isSacked;  // Whether the server has reported that the segment arrived
+	uint32_t seqNum;  // Host-order copies of the segment's sequence number and timestamp, which are read on every ACK
+	uint32_t tsVal;
 };
 
+/*
+ * A queue of segments in transit. Entries come from a pool as the window fills up,
+ * so a large window only uses as much memory as it has ever held.
+ */
 struct Window {
-	struct TCPSegmentEntry *arr;
+	struct TCPSegmentEntry **arr;
+	struct BufferPool *pool;
 	int length;
 	int capacity;
 	int startIndex;
@@ -21,7 +32,7 @@ void freeWindow(struct Window *);
 int isEmpty(const struct Window *);
 int isFull(const struct Window *);
 int next(const struct Window *, int);
-void offer(struct Window *, const struct TCPSegmentEntry *);
+struct TCPSegmentEntry *offer(struct Window *, const struct TCPSegmentEntry *);
 void deleteHead(struct Window *);
 
 #endif
@@ -1,53 +1,660 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/types.h>
 #include <unistd.h>
 
 #include "window.h"
 #include "tcp.h"
+#include "metrics.h"
+#include "trace.h"
+#include "rtt.h"
+#include "fec.h"
+#include "loss.h"
+#include "reader.h"
+#include "codec.h"
+#include "delta.h"
+#include "checkpoint.h"
+#include "options.h"
+#include "session.h"
+#include "token.h"
+#include "tuning.h"
+#include "path.h"
+#include "scheduler.h"
 #include "helpers.h"
 
 #define ISN 0
 #define INITIAL_TIMEOUT 1  // The initial timeout, in seconds
-#define TIMEOUT_MULTIPLIER 1.1  // The timeout multiplier when a timeout occurs
-#define ALPHA 0.125
-#define BETA 0.25
+#define MIN_TIMEOUT 1  // The default lower bound on the timeout, in milliseconds
+#define MAX_TIMEOUT 10000  // The default upper bound on the timeout, in milliseconds
+#define MAX_TIMEOUT_BOUND (INT_MAX / 1000)  // The highest upper bound that still fits in microseconds
 #define FINAL_WAIT 3  // How long the client waits after receiving an ACK for its FIN, in seconds
+#define LINGER_RTOS 4  // With quick teardown, how many RTOs the background process answers FINs for (at most FINAL_WAIT)
+#define BIND_INTERVAL 10000  // How long to wait before retrying a bind to a port that is still in use, in microseconds
+#define STREAM_READER_BLOCKS 2  // Number of pooled buffers each stream reads its file into
+
+static struct Metrics metrics;
+static struct Trace *trace;  // NULL unless tracing is enabled
+
+/*
+ * Take an RTT sample from the timestamp echoed by the server and update the timeout
+ */
+static void takeRTTSample(struct RTTEstimator *estimator, const struct TCPSegment *serverSegment,
+	int *timeoutPtr, int windowLength)
+{
+	int sampleRTT = (int)(getMicroTimestamp() - serverSegment->tsEcr);
+	updateRTTEstimator(estimator, sampleRTT);
+	*timeoutPtr = getRTO(estimator);
+	recordRTT(&metrics, sampleRTT);
+	recordRTO(&metrics, *timeoutPtr);
+	traceEvent(trace, &(struct TraceRecord){ .event = TRACE_RTT,
+		.seqNum = serverSegment->ackNum, .windowLength = windowLength,
+		.rto = *timeoutPtr, .sample = sampleRTT });
+}
+
+/*
+ * A path given with -P
+ */
+struct Subflow {
+	struct sockaddr_in source;  // Address segments on the path are sent from
+	struct sockaddr_in addr;  // Address segments on the path are sent to
+};
+
+/*
+ * How the client sends, as given by its options
+ */
+struct ClientOptions {
+	int numStreams;  // Files sent at once in a session, or 0 to send a single file
+	const char *tokenPath;  // Where tokens from the server are kept (with early data sent once there is one), or NULL
+	int isCompressing;  // Whether a single file is compressed if the server accepts it
+	int isDelta;  // Whether a single file is sent as a delta against the server's copy (and never as early data)
+	int isResumable;  // Whether a single file picks up where an interrupted transfer of it left off
+	int isQuickTeardown;  // Whether to return once the FIN is acknowledged, leaving the rest to a background process
+	int isBusyPolling;  // Whether waiting for ACKs spins instead of sleeping
+	uint64_t egressRate;  // Most bytes per second of new data, or 0 if unlimited
+	struct Subflow subflows[MAX_PATHS - 1];  // Paths in addition to the one to the udpl address
+	int numSubflows;
+	int minTimeout;  // Bounds on the retransmission timer, in milliseconds
+	int maxTimeout;
+	int fecGroupSize;  // Data segments per parity segment, or 0 for no FEC
+};
+
+/*
+ * Get the seq of the oldest segment in the window, or nextSeq (the seq of the next new segment) if it is empty
+ */
+static uint32_t getOldestSeq(const struct Window *window, uint32_t nextSeq)
+{
+	return isEmpty(window) ? nextSeq : window->arr[window->startIndex]->seqNum;
+}
+
+/*
+ * Parse a subflow given as source address:address:port. Return -1 if it is invalid.
+ */
+static int parseSubflow(const char *str, struct Subflow *subflow)
+{
+	char source[INET_ADDRSTRLEN], address[INET_ADDRSTRLEN], port[6];
+	if (sscanf(str, "%15[^:]:%15[^:]:%5s", source, address, port) != 3
+		|| !isValidIP(source) || !isValidIP(address) || !getPort(port)) {
+		return -1;
+	}
+	memset(subflow, 0, sizeof(struct Subflow));
+	subflow->source.sin_family = AF_INET;
+	subflow->source.sin_addr.s_addr = inet_addr(source);
+	subflow->addr.sin_family = AF_INET;
+	subflow->addr.sin_addr.s_addr = inet_addr(address);
+	subflow->addr.sin_port = htons(getPort(port));
+	return 0;
+}
+
+/*
+ * Send a segment that is not part of the data (e.g., a SYN or FIN) on every path,
+ * so that it gets through as long as one path works
+ */
+static int sendOnEveryPath(const struct PathScheduler *paths, const struct TCPSegment *segment, int len)
+{
+	for (int i = 0; i < paths->numPaths; i++) {
+		const struct Path *path = paths->paths + i;
+		if (sendto(path->sock, segment, len, 0, (struct sockaddr *)&path->addr, sizeof(path->addr)) != len) {
+			perror("sendto");
+			return -1;
+		}
+		addMetric(&metrics.segmentsSent, 1);
+	}
+	return 0;
+}
+
+/*
+ * Resend a segment in the window on the best path, giving it a new timestamp
+ */
+static int resendSegment(struct PathScheduler *paths, const struct Window *window,
+	struct TCPSegmentEntry *segmentInWindow, uint32_t ackNum, int timeoutMicros)
+{
+	int segmentInWindowLen = HEADER_LEN + segmentInWindow->dataLen;
+	int pathIndex = pickResendPath(paths);
+	movePathSegment(paths, segmentInWindow->path, pathIndex);
+	segmentInWindow->path = pathIndex;
+	segmentInWindow->isResent = 1;
+	const struct Path *path = paths->paths + pathIndex;
+	segmentInWindow->tsVal = getMicroTimestamp();
+	stampTCPSegment((struct TCPSegment *)segmentInWindow, segmentInWindow->tsVal);
+	if (sendto(path->sock, segmentInWindow, segmentInWindowLen, 0,
+		(struct sockaddr *)&path->addr, sizeof(path->addr)) != segmentInWindowLen) {
+		perror("sendto");
+		return -1;
+	}
+	addMetric(&metrics.segmentsSent, 1);
+	addMetric(&metrics.retransmissions, 1);
+	addMetric(&metrics.bytesSent, segmentInWindow->dataLen);
+	traceEvent(trace, &(struct TraceRecord){ .event = TRACE_RETRANSMIT,
+		.seqNum = segmentInWindow->seqNum, .ackNum = ackNum,
+		.length = segmentInWindow->dataLen, .windowLength = window->length,
+		.rto = timeoutMicros });
+	return 0;
+}
+
+/*
+ * Resend count segments from the start of the window, skipping those the server has reported as arrived
+ */
+static int resendSegments(struct PathScheduler *paths, struct Window *window, int count,
+	uint32_t ackNum, int timeoutMicros)
+{
+	int currIndex = window->startIndex;
+	for (int i = 0; i < count; i++, currIndex = next(window, currIndex)) {
+		if (!window->arr[currIndex]->isSacked
+			&& resendSegment(paths, window, window->arr[currIndex], ackNum, timeoutMicros) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Mark the segments that a SACK bitmap for the start of the window reports as arrived, as deliveries
+ */
+static void markSackedSegments(struct Window *window, struct LossDetector *detector, const char *bitmap, int len)
+{
+	uint32_t now = getMicroTimestamp();
+	uint32_t ackNum = window->arr[window->startIndex]->seqNum;
+	int currIndex = next(window, window->startIndex);
+	for (int i = 1; i < window->length; i++, currIndex = next(window, currIndex)) {
+		struct TCPSegmentEntry *entry = window->arr[currIndex];
+		if (!entry->isSacked && isSacked(bitmap, len, ackNum, entry->seqNum)) {
+			entry->isSacked = 1;
+			onSegmentDelivered(detector, entry->tsVal, entry->isResent, now);
+		}
+	}
+}
+
+/*
+ * Resend every segment in the window that the loss detector finds lost. Return the microseconds until the next
+ * segment will count as lost (0 if none will without another delivery), or -1 on failure.
+ */
+static int resendLostSegments(struct PathScheduler *paths, struct Window *window, const struct LossDetector *detector,
+	uint32_t ackNum, int timeoutMicros)
+{
+	uint32_t now = getMicroTimestamp();
+	int reorderWait = 0;
+	int currIndex = window->startIndex;
+	for (int i = 0; i < window->length; i++, currIndex = next(window, currIndex)) {
+		struct TCPSegmentEntry *entry = window->arr[currIndex];
+		if (entry->isSacked) {
+			continue;
+		}
+		int wait = checkSegmentLoss(detector, entry->tsVal, now);
+		if (wait < 0) {
+			if (resendSegment(paths, window, entry, ackNum, timeoutMicros) < 0) {
+				return -1;
+			}
+			addMetric(&metrics.lossDetections, 1);
+		} else if (wait > 0) {
+			reorderWait = reorderWait && reorderWait < wait ? reorderWait : wait;
+		} else if (!entry->isResent) {
+			// Every later segment was sent after this one, so none of them can be judged yet either
+			break;
+		}
+	}
+	return reorderWait;
+}
+
+/*
+ * Send a parity segment for the encoder's current group, if it has any segments
+ */
+static int sendParity(const struct Path *path, struct FECEncoder *encoder,
+	uint16_t sourcePort, uint16_t destPort, uint32_t ackNum, uint32_t tsEcr, int timeoutMicros)
+{
+	struct TCPSegment paritySegment;
+	int groupSize = encoder->count;
+	uint32_t startSeq = encoder->startSeq;
+	int parityLen = fillParitySegment(encoder, &paritySegment, sourcePort, destPort,
+		ackNum, getMicroTimestamp(), tsEcr);
+	if (!parityLen) {
+		return 0;
+	}
+	if (sendto(path->sock, &paritySegment, HEADER_LEN + parityLen, 0,
+		(struct sockaddr *)&path->addr, sizeof(path->addr)) != HEADER_LEN + parityLen) {
+		perror("sendto");
+		return -1;
+	}
+	addMetric(&metrics.segmentsSent, 1);
+	addMetric(&metrics.paritySegments, 1);
+	addMetric(&metrics.bytesSent, parityLen);
+	traceEvent(trace, &(struct TraceRecord){ .event = TRACE_SEND,
+		.seqNum = startSeq, .ackNum = ackNum, .length = parityLen, .flags = FEC_FLAG,
+		.windowLength = groupSize, .rto = timeoutMicros });
+	return 0;
+}
+
+/*
+ * Read the options in a SYNACK and save its token for the next connection.
+ * Return whether the server accepted early data.
+ */
+static int readSynAck(const struct TCPSegment *synAck, int dataLen, const char *tokenPath,
+	struct HandshakeOptions *options)
+{
+	if (readHandshakeOptions(options, synAck->data, dataLen) < 0) {
+		fprintf(stderr, "warning: ignoring malformed SYNACK options\n");
+		memset(options, 0, sizeof(struct HandshakeOptions));
+		return 0;
+	}
+	if (tokenPath && options->hasToken) {
+		saveToken(tokenPath, options->token);
+	}
+	return options->hasEarlyData;
+}
 
 /*
- * Using the sample RTT, update the estimated RTT, dev RTT, and timeout
+ * Fetch the len bytes of the server's signature into signature, an MSS-sized chunk per request.
+ * Requests for up to a window of the lowest missing chunks are sent at a time, and those still unanswered
+ * after the timeout are sent again. If the SYNACK arrives again, the ACK for it (handshakeAck) was lost,
+ * so it is resent.
  */
-void updateRTTAndTimeout(int sampleRTT, int *estimatedRTTPtr, int *devRTTPtr,
-	int *timeoutPtr, float alpha, float beta)
+static int fetchSignature(struct SocketTuner *tuner, const struct PathScheduler *paths,
+	struct RTTEstimator *estimator, int *timeoutPtr, const struct TCPSegment *handshakeAck,
+	uint16_t sourcePort, uint16_t destPort, char *signature, uint32_t len, int windowSize)
 {
-	if (sampleRTT <= 0) {
-		return;
+	uint32_t numChunks = (len + MSS - 1) / MSS;
+	char *isReceived = calloc(numChunks, 1);
+	if (!isReceived) {
+		perror("malloc");
+		return -1;
 	}
-	if (*estimatedRTTPtr < 0) {
-		// Estimated RTT has not been set yet (first sample RTT)
-		*estimatedRTTPtr = sampleRTT;
-		*devRTTPtr = sampleRTT / 2;
-		*timeoutPtr = *estimatedRTTPtr + 4*(*devRTTPtr);
-		return;
+	const struct Path *path = paths->paths;  // Answers come back to the first path's socket
+	struct TCPSegment request, reply;
+	uint32_t numReceived = 0, firstMissing = 0;
+	struct timeval startTime, endTime;
+
+	while (numReceived < numChunks) {
+		int numRequested = 0;
+		for (uint32_t i = firstMissing; i < numChunks && numRequested < windowSize / MSS; i++) {
+			if (isReceived[i]) {
+				continue;
+			}
+			encodeTCPSegment(&request, sourcePort, destPort, i * MSS, ISN + 1, SIGNATURE_FLAG,
+				getMicroTimestamp(), 0, NULL, 0);
+			if (sendto(path->sock, &request, HEADER_LEN, 0,
+				(struct sockaddr *)&path->addr, sizeof(path->addr)) != HEADER_LEN) {
+				perror("sendto");
+				goto fail;
+			}
+			addMetric(&metrics.segmentsSent, 1);
+			numRequested++;
+		}
+
+		int timeRemaining = *timeoutPtr;
+		while (numRequested > 0) {
+			gettimeofday(&startTime, NULL);
+			int fdsReady = waitForDatagram(tuner, timeRemaining);
+			gettimeofday(&endTime, NULL);
+			if (fdsReady < 0) {
+				goto fail;
+			} else if (fdsReady == 0) {
+				fprintf(stderr, "warning: failed to receive part of the signature\n");
+				backOffRTO(estimator);
+				*timeoutPtr = getRTO(estimator);
+				addMetric(&metrics.timeouts, 1);
+				addMetric(&metrics.retransmissions, numRequested);
+				recordRTO(&metrics, *timeoutPtr);
+				break;
+			}
+
+			int numDropped;
+			ssize_t replyLen = receiveDatagram(tuner, &reply, sizeof(struct TCPSegment), &numDropped);
+			if (replyLen < 0) {
+				goto fail;
+			}
+			addMetric(&metrics.segmentsReceived, 1);
+			addMetric(&metrics.kernelDrops, numDropped);
+
+			int isValid = decodeTCPSegment(&reply);
+			uint32_t chunk = reply.seqNum / MSS;
+			if (!isValid) {
+				addMetric(&metrics.checksumFailures, 1);
+			} else if (isFlagSet(&reply, SIGNATURE_FLAG) && reply.seqNum % MSS == 0 && chunk < numChunks
+				&& replyLen - HEADER_LEN == (chunk == numChunks - 1 ? len - reply.seqNum : MSS)) {
+				if (!isReceived[chunk]) {
+					memcpy(signature + reply.seqNum, reply.data, replyLen - HEADER_LEN);
+					isReceived[chunk] = 1;
+					numReceived++;
+					numRequested--;
+				}
+				if (reply.tsEcr) {
+					takeRTTSample(estimator, &reply, timeoutPtr, 0);
+				}
+			} else if (reply.ackNum == ISN + 1 && isFlagSet(&reply, SYN_FLAG | ACK_FLAG)
+				&& sendOnEveryPath(paths, handshakeAck, HEADER_LEN) < 0) {
+				goto fail;
+			}
+			timeRemaining = MAX(timeRemaining - getMicroDiff(&startTime, &endTime), 0);
+		}
+		while (firstMissing < numChunks && isReceived[firstMissing]) {
+			firstMissing++;
+		}
+	}
+	free(isReceived);
+	return 0;
+
+fail:
+	free(isReceived);
+	return -1;
+}
+
+/*
+ * A file being sent as a stream in a session
+ */
+struct StreamSender {
+	int isActive;
+	uint32_t id;
+	int fd;
+	char name[MAX_FRAME_NAME_LEN + 1];
+	uint64_t size;
+	uint64_t offset;  // Bytes of the file sent so far
+	int isOpenSent;  // Whether the open frame has been sent
+	char *data;  // The whole file, if it is small enough to be read when the stream opens
+	int isReadAhead;  // Whether the file is read by reader instead
+	struct FileReader reader;
+};
+
+/*
+ * Sends the files listed in a manifest as streams, with up to numStreams of them open at once.
+ * Streams share segments by weighted deficit round robin, and each may have its own rate limit.
+ */
+struct Session {
+	FILE *manifest;
+	int isManifestDone;
+	struct StreamSender streams[MAX_STREAMS];
+	int numStreams;
+	int numActive;
+	struct FlowScheduler scheduler;  // Picks the stream that gets the next frame
+	uint32_t nextId;
+};
+
+/*
+ * Open the next file listed in the manifest as a stream. Each line is a path, optionally followed by a tab and the stream's
+ * weight, and then by a tab and its rate limit (blank lines are skipped).
+ * Return 1 if a file was opened, 0 if there are no more, or -1 on failure.
+ */
+static int openStream(struct Session *session, struct StreamSender *stream)
+{
+	char path[PATH_MAX + 1];
+	do {
+		if (!fgets(path, sizeof(path), session->manifest)) {
+			if (ferror(session->manifest)) {
+				perror("fgets");
+				return -1;
+			}
+			return 0;
+		}
+		path[strcspn(path, "\n")] = '\0';
+	} while (!*path);
+
+	int weight = DEFAULT_FLOW_WEIGHT;
+	uint64_t rate = 0;  // Unlimited
+	char *weightStr = strchr(path, '\t');
+	if (weightStr) {
+		*weightStr++ = '\0';
+		char *rateStr = strchr(weightStr, '\t');
+		if (rateStr) {
+			*rateStr++ = '\0';
+		}
+		weight = isNumber(weightStr) && strlen(weightStr) < 5 ? (int)strtol(weightStr, NULL, 10) : 0;
+		if (weight < 1 || weight > MAX_FLOW_WEIGHT || (rateStr && !(rate = parseRate(rateStr)))) {
+			fprintf(stderr, "error: invalid weight or rate for %s\n", path);
+			return -1;
+		}
+	}
+
+	// Only the name is sent since the server puts every file in one directory
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	if (strlen(name) > MAX_FRAME_NAME_LEN) {
+		fprintf(stderr, "error: file name is too long: %s\n", name);
+		return -1;
+	}
+	if ((stream->fd = open(path, O_RDONLY)) < 0) {
+		perror("open");
+		return -1;
+	}
+	struct stat fileStat;
+	if (fstat(stream->fd, &fileStat) < 0) {
+		perror("fstat");
+		close(stream->fd);
+		return -1;
+	}
+	// A file that fits in a reader block is read whole now, which costs less than a reader thread and its buffers.
+	// A larger file is read ahead separately so that streams do not wait on each other.
+	stream->data = NULL;
+	stream->isReadAhead = fileStat.st_size > READER_BLOCK_SIZE;
+	if (stream->isReadAhead) {
+		if (startFileReader(&stream->reader, stream->fd, STREAM_READER_BLOCKS, NULL, CODEC_NONE, NULL) < 0) {
+			close(stream->fd);
+			return -1;
+		}
+	} else if (fileStat.st_size && (!(stream->data = malloc(fileStat.st_size))
+		|| readFully(stream->fd, stream->data, fileStat.st_size, 0) < 0)) {
+		fprintf(stderr, "error: failed to read %s\n", path);
+		free(stream->data);
+		close(stream->fd);
+		return -1;
+	}
+	strcpy(stream->name, name);
+	stream->size = fileStat.st_size;
+	stream->offset = 0;
+	stream->isOpenSent = 0;
+	stream->id = session->nextId++;
+	stream->isActive = 1;
+	session->numActive++;
+	startFlow(&session->scheduler, stream - session->streams, weight, rate, getMicroTimestamp());
+	return 1;
+}
+
+static void closeStream(struct Session *session, struct StreamSender *stream)
+{
+	if (stream->isReadAhead) {
+		stopFileReader(&stream->reader);
+	}
+	free(stream->data);
+	close(stream->fd);
+	stream->isActive = 0;
+	session->numActive--;
+	stopFlow(&session->scheduler, stream - session->streams);
+}
+
+static void startSession(struct Session *session, FILE *manifest, int numStreams)
+{
+	memset(session, 0, sizeof(struct Session));
+	session->manifest = manifest;
+	session->numStreams = numStreams;
+	initFlowScheduler(&session->scheduler, numStreams);
+}
+
+/*
+ * Close every stream that is still open
+ */
+static void stopSession(struct Session *session)
+{
+	for (int i = 0; i < session->numStreams; i++) {
+		if (session->streams[i].isActive) {
+			closeStream(session, session->streams + i);
+		}
+	}
+}
+
+/*
+ * Fill a segment's data with frames from the streams the scheduler picks. The data is padded to MSS
+ * unless the session is ending, so every segment but the last is MSS long (which FEC relies on).
+ * Return the length of the data, 0 once every file has been sent, or -1 on failure (with errno set to EAGAIN
+ * if every stream is over its rate, or if shouldWait is not set and no file data is ready).
+ */
+static ssize_t fillStreamSegment(struct Session *session, char *data, int shouldWait)
+{
+	int len = 0;
+	int numSkipped = 0;  // Streams in a row that had no data ready
+	for (;;) {
+		// Keep numStreams files open
+		for (int i = 0; !session->isManifestDone && session->numActive < session->numStreams; i++) {
+			if (session->streams[i].isActive) {
+				continue;
+			}
+			int status = openStream(session, session->streams + i);
+			if (status < 0) {
+				return -1;
+			}
+			session->isManifestDone = !status;
+		}
+		if (!session->numActive) {
+			return len;
+		} else if (MSS - len <= DATA_FRAME_HEADER_LEN) {
+			break;
+		}
+
+		int turn = pickFlow(&session->scheduler, getMicroTimestamp());
+		if (turn < 0 && len > 0) {
+			break;
+		} else if (turn < 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		struct StreamSender *stream = session->streams + turn;
+		if (!stream->isOpenSent) {
+			int frameLen = writeOpenFrame(data + len, MSS - len, stream->id, stream->name, stream->size);
+			if (!frameLen) {
+				break;
+			}
+			len += frameLen;
+			stream->isOpenSent = 1;
+			chargeFlow(&session->scheduler, turn, frameLen);
+			if (stream->size == 0) {
+				closeStream(session, stream);
+			}
+			continue;
+		}
+
+		uint64_t remaining = stream->size - stream->offset;
+		int dataLen = MSS - len - DATA_FRAME_HEADER_LEN;
+		dataLen = remaining < (uint64_t)dataLen ? (int)remaining : dataLen;
+		ssize_t readLen = dataLen;
+		if (stream->isReadAhead) {
+			readLen = readFileAhead(&stream->reader, data + len + DATA_FRAME_HEADER_LEN, dataLen, shouldWait || len > 0);
+		} else {
+			memcpy(data + len + DATA_FRAME_HEADER_LEN, stream->data + stream->offset, dataLen);
+		}
+		if (readLen < 0 && errno == EAGAIN) {
+			skipFlow(&session->scheduler);
+			if (++numSkipped >= session->numActive) {
+				return -1;
+			}
+			continue;
+		} else if (readLen < 0) {
+			perror("read");
+			return -1;
+		} else if (readLen < dataLen) {
+			fprintf(stderr, "error: %s shrank while it was being sent\n", stream->name);
+			errno = EIO;
+			return -1;
+		}
+		writeDataFrameHeader(data + len, stream->id, stream->offset, dataLen);
+		len += DATA_FRAME_HEADER_LEN + dataLen;
+		stream->offset += dataLen;
+		numSkipped = 0;
+		chargeFlow(&session->scheduler, turn, DATA_FRAME_HEADER_LEN + dataLen);
+		if (stream->offset == stream->size) {
+			closeStream(session, stream);
+		}
+	}
+
+	memset(data + len, FRAME_PADDING, MSS - len);
+	return MSS;
+}
+
+/*
+ * Bind a socket to port, retrying for up to FINAL_WAIT seconds while the port is still held
+ * (e.g., by an earlier client that is finishing its teardown in the background)
+ */
+static int bindPort(int sock, int port)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	for (int waited = 0; bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0; waited += BIND_INTERVAL) {
+		if (errno != EADDRINUSE || waited >= FINAL_WAIT * SI_MICRO) {
+			perror("bind");
+			return -1;
+		}
+		usleep(BIND_INTERVAL);
 	}
+	return 0;
+}
 
-	float newEstimatedRTT = (1 - alpha)*(*estimatedRTTPtr) + alpha*sampleRTT;
-	float newDevRTT = (1 - beta)*(*devRTTPtr) + beta*abs(sampleRTT - *estimatedRTTPtr);
-	float newTimeout = newEstimatedRTT + 4*newDevRTT;
+/*
+ * Hand the rest of the teardown to a background process, so that the caller can return as soon as the server
+ * has acknowledged everything. Return 1 in the background process (whose output goes to /dev/null),
+ * 0 in the caller, or -1 if the process cannot be started.
+ */
+static int startLingering(void)
+{
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	} else if (pid > 0) {
+		return 0;
+	}
 
-	*estimatedRTTPtr = (int)newEstimatedRTT;
-	*devRTTPtr = (int)newDevRTT;
-	*timeoutPtr = (int)newTimeout;
+	// Detach from the caller's terminal and pipes, so that nothing waits for this process
+	setsid();
+	int nullFd = open("/dev/null", O_RDWR);
+	if (nullFd >= 0) {
+		dup2(nullFd, STDIN_FILENO);
+		dup2(nullFd, STDOUT_FILENO);
+		dup2(nullFd, STDERR_FILENO);
+		if (nullFd > STDERR_FILENO) {
+			close(nullFd);
+		}
+	}
+	return 1;
 }
 
-int runClient(const char *fileStr, const char *udplAddress, int udplPort, int windowSize, int ackPort)
+/*
+ * Send a file, or the files listed in the manifest fileStr as a session, over the path to udplAddress
+ * and the subflows in clientOptions
+ */
+int runClient(const char *fileStr, const struct ClientOptions *clientOptions, const char *udplAddress, int udplPort,
+	int windowSize, int ackPort)
 {
+	int isLingering = 0;  // Whether this is the background process finishing the teardown
+	struct PathScheduler paths;
+	initPathScheduler(&paths, windowSize / MSS);
 	// Create socket
 	int clientSocket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	if (clientSocket < 0) {
@@ -56,38 +663,100 @@ int runClient(const char *fileStr, const char *udplAddress, int udplPort, int wi
 	}
 
 	// Bind socket to ackPort
-	struct sockaddr_in clientAddr;
-	memset(&clientAddr, 0, sizeof(clientAddr));
-	clientAddr.sin_family = AF_INET;
-	clientAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	clientAddr.sin_port = htons(ackPort);
-	if (bind(clientSocket, (struct sockaddr *)&clientAddr, sizeof(clientAddr)) < 0) {
-		perror("bind");
+	if (bindPort(clientSocket, ackPort) < 0) {
 		goto fail;
 	}
 
+	// Make room for a whole window (and its parity segments) to be sent at once and for an ACK for each of them.
+	// The window is the most the transfer can have in flight, so it bounds the bandwidth-delay product it can use.
+	struct SocketTuner tuner;
+	if (initSocketTuner(&tuner, clientSocket, clientOptions->isBusyPolling) < 0) {
+		goto fail;
+	}
+	int maxInFlight = windowSize / MSS + (clientOptions->fecGroupSize ? windowSize / MSS / MIN_FEC_GROUP + 1 : 0);
+	sizeSocketBuffers(&tuner, maxInFlight, HEADER_LEN + MSS, HEADER_LEN + SACK_BITMAP_LEN);
+
 	struct sockaddr_in udplAddr;  // Address of newudpl
 	memset(&udplAddr, 0, sizeof(udplAddr));
 	udplAddr.sin_family = AF_INET;
 	udplAddr.sin_addr.s_addr = inet_addr(udplAddress);
 	udplAddr.sin_port = htons(udplPort);
 
-	// clientSegment holds segments created by the client
+	// The first path sends from the socket ACKs arrive on, and each subflow from its own source address
+	addPath(&paths, clientSocket, &udplAddr);
+	for (int i = 0; i < clientOptions->numSubflows; i++) {
+		int subflowSocket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (subflowSocket < 0) {
+			perror("socket");
+			goto fail;
+		}
+		const struct Subflow *subflow = clientOptions->subflows + i;
+		if (bind(subflowSocket, (struct sockaddr *)&subflow->source, sizeof(subflow->source)) < 0) {
+			perror("bind");
+			close(subflowSocket);
+			goto fail;
+		}
+		struct SocketTuner subflowTuner;
+		if (initSocketTuner(&subflowTuner, subflowSocket, 0) == 0) {
+			sizeSocketBuffers(&subflowTuner, maxInFlight, HEADER_LEN + MSS, 0);
+		}
+		addPath(&paths, subflowSocket, &subflow->addr);
+	}
+
+	// synSegment holds the SYN, which may be resent along with data
+	// clientSegment holds other segments created by the client
 	// serverSegment holds segments received from the server
-	struct TCPSegment clientSegment, serverSegment;
+	struct TCPSegment synSegment, clientSegment, serverSegment;
 	ssize_t serverSegmentLen;  // Amount of data in serverSegment
-	int timeoutMicros = INITIAL_TIMEOUT * SI_MICRO;  // Transmission timeout
+	struct RTTEstimator rttEstimator;
+	initRTTEstimator(&rttEstimator, INITIAL_TIMEOUT * SI_MICRO,
+		clientOptions->minTimeout * 1000, clientOptions->maxTimeout * 1000);
+	int timeoutMicros = getRTO(&rttEstimator);  // Transmission timeout
 	int timeRemaining = timeoutMicros;
 	int timeElapsed;
-	int isSampleRTTBeingMeasured;  // Whether a segment's sample RTT is being measured
-	struct timeval absoluteStartTime, startTime, endTime;
-	int estimatedRTT = -1;
-	int devRTT;
+	struct timeval startTime, endTime;
+
+	// Advertise the file size so that the server can allocate the output file up front.
+	// In a session, each file's size is sent in its frame header instead.
+	int isSession = clientOptions->numStreams > 0;
+	struct HandshakeOptions options = { .isSession = isSession, .windowSize = windowSize, .hasWindowSize = 1 };
+	struct stat fileStat;
+	if (!isSession) {
+		if (stat(fileStr, &fileStat) < 0) {
+			perror("stat");
+			goto fail;
+		}
+		options.fileSize = fileStat.st_size;
+		options.hasFileSize = 1;
+	}
+	// The server only resumes a checkpoint left by a transfer of this same version of the file
+	if (clientOptions->isResumable) {
+		makeResumeId(&fileStat, options.resumeId);
+		options.hasResumeId = 1;
+	}
+	// A token from an earlier connection lets data go out without waiting for the SYNACK
+	int hasToken = clientOptions->tokenPath ? loadToken(clientOptions->tokenPath, options.token) : 0;
+	if (hasToken < 0) {
+		goto fail;
+	}
+	// A delta has to wait for the signature of the server's copy, and a resumed file for the offset to resume at,
+	// so neither is sent early
+	const int isEarlyData = hasToken && !clientOptions->isDelta && !clientOptions->isResumable;
+	options.hasToken = hasToken;
+	options.hasEarlyData = isEarlyData;
+	options.isDelta = clientOptions->isDelta;
+	// The file's SHA-256 is sent with the FIN so the server can check what it wrote without reading it again
+	options.hasDigest = !isSession;
+	// Only servers that understand the codec option hand out tokens, so early data is compressed
+	// without waiting for the SYNACK to accept the codec
+	options.codec = clientOptions->isCompressing ? CODEC_LZ : CODEC_NONE;
+	int codec = isEarlyData ? options.codec : CODEC_NONE;  // Codec the data is sent with
+	char optionsBuffer[MAX_OPTIONS_LEN];
+	int synLen = HEADER_LEN + writeHandshakeOptions(&options, optionsBuffer, MAX_OPTIONS_LEN);
 
-	// Create SYN segment
-	fillTCPSegment(&clientSegment, ackPort, udplPort, ISN, 0, SYN_FLAG, NULL, 0);
-	convertTCPSegment(&clientSegment, 1);
-	isSampleRTTBeingMeasured = 1;  // SYN segment's sample RTT will be measured
+	// Create SYN segment (it is timestamped each time it is sent)
+	encodeTCPSegment(&synSegment, ackPort, udplPort, ISN, 0, SYN_FLAG, 0, 0,
+		optionsBuffer, synLen - HEADER_LEN);
 
 	struct timeval timeout;
 	fd_set readFds;
@@ -95,22 +764,23 @@ int runClient(const char *fileStr, const char *udplAddress, int udplPort, int wi
 
 	/*
 	 * Send SYN:
-	 *  - Send SYN
-	 *  - Call recvfrom. If nothing is received within the timeout, increase it
-	 *    and mark the segment's sample RTT as not being measured.
+	 *  - Send SYN with the current timestamp
+	 *  - Call recvfrom. If nothing is received within the timeout, increase it.
 	 *  - If a segment is received, check that is it not corrupted, the ACK is ISN + 1,
-	 *    and the SYNACK flags are set. If so, update the RTT if the sample RTT was measured
+	 *    and the SYNACK flags are set. If so, update the RTT using the echoed timestamp
 	 *    and break from loop.
 	 *  - Else, ignore and repeat
+	 *  - With early data, break right after sending the SYN. The SYNACK is handled while sending the file.
 	 */
-	fprintf(stderr, "log: sending SYN\n");
-	gettimeofday(&absoluteStartTime, NULL);
+	fprintf(stderr, isEarlyData ? "log: sending SYN with early data\n" : "log: sending SYN\n");
 	for (;;) {
-		if (sendto(clientSocket, &clientSegment, HEADER_LEN, 0,
-			(struct sockaddr *)&udplAddr, sizeof(udplAddr)) != HEADER_LEN) {
-			perror("sendto");
+		stampTCPSegment(&synSegment, getMicroTimestamp());
+		if (sendOnEveryPath(&paths, &synSegment, synLen) < 0) {
 			goto fail;
 		}
+		if (isEarlyData) {
+			break;
+		}
 
 		FD_ZERO(&readFds);
 		FD_SET(clientSocket, &readFds);
@@ -125,8 +795,12 @@ int runClient(const char *fileStr, const char *udplAddress, int udplPort, int wi
 		} else if (fdsReady == 0) {
 			// Timed out
 			fprintf(stderr, "warning: failed to receive SYNACK\n");
-			isSampleRTTBeingMeasured = 0;
-			timeRemaining = timeoutMicros = (int)(timeoutMicros * TIMEOUT_MULTIPLIER);
+			backOffRTO(&rttEstimator);
+			timeRemaining = timeoutMicros = getRTO(&rttEstimator);
+			addMetric(&metrics.timeouts, 1);
+			recordRTO(&metrics, timeoutMicros);
+			traceEvent(trace, &(struct TraceRecord){ .event = TRACE_TIMEOUT,
+				.seqNum = ISN, .flags = SYN_FLAG, .rto = timeoutMicros });
 			continue;
 		}
 
@@ -137,194 +811,487 @@ int runClient(const char *fileStr, const char *udplAddress, int udplPort, int wi
 			perror("recvfrom");
 			goto fail;
 		}
+		addMetric(&metrics.segmentsReceived, 1);
 
-		convertTCPSegment(&serverSegment, 0);
-		if (isChecksumValid(&serverSegment) && serverSegment.ackNum == ISN + 1
+		int isValid = decodeTCPSegment(&serverSegment);
+		if (isValid && serverSegment.ackNum == ISN + 1
 			&& isFlagSet(&serverSegment, SYN_FLAG | ACK_FLAG)) {
-			if (isSampleRTTBeingMeasured) {
-				updateRTTAndTimeout(getMicroDiff(&absoluteStartTime, &endTime),
-					&estimatedRTT, &devRTT, &timeoutMicros, ALPHA, BETA);
+			if (serverSegment.tsEcr) {
+				takeRTTSample(&rttEstimator, &serverSegment, &timeoutMicros, 0);
 			}
 			break;
+		} else if (!isValid) {
+			addMetric(&metrics.checksumFailures, 1);
 		}
 
 		timeElapsed = getMicroDiff(&startTime, &endTime);
 		timeRemaining = MAX(timeRemaining - timeElapsed, 0);
 	}
 
-	uint32_t nextExpectedServerSeq = serverSegment.seqNum + 1;
+	// The server's ISN is fixed, so the ACK for its SYNACK is known even before the SYNACK arrives
+	uint32_t nextExpectedServerSeq = isEarlyData ? ISN + 1 : serverSegment.seqNum + 1;
+	// Latest timestamp from the server, echoed back in tsEcr
+	uint32_t tsRecent = isEarlyData ? 0 : serverSegment.tsVal;
 
 	// Create and send ACK for server's SYNACK
-	fillTCPSegment(&clientSegment, ackPort, udplPort, ISN + 1,
-		nextExpectedServerSeq, ACK_FLAG, NULL, 0);
-	convertTCPSegment(&clientSegment, 1);
-	fprintf(stderr, "log: received SYNACK, sending ACK\n");
-	if (sendto(clientSocket, &clientSegment, HEADER_LEN, 0,
-		(struct sockaddr *)&udplAddr, sizeof(udplAddr)) != HEADER_LEN) {
-		perror("sendto");
-		goto fail;
+	encodeACKSegment(&clientSegment, ackPort, udplPort, ISN + 1,
+		nextExpectedServerSeq, getMicroTimestamp(), tsRecent, NULL, 0);
+	struct HandshakeOptions synAckOptions = { 0 };
+	if (!isEarlyData) {
+		readSynAck(&serverSegment, serverSegmentLen - HEADER_LEN, clientOptions->tokenPath, &synAckOptions);
+		codec = synAckOptions.codec;
+		if (codec != CODEC_NONE && codec != options.codec) {
+			fprintf(stderr, "error: the server chose a codec that was not offered\n");
+			goto fail;
+		}
+		fprintf(stderr, "log: received SYNACK, sending ACK\n");
+		if (sendOnEveryPath(&paths, &clientSegment, HEADER_LEN) < 0) {
+			goto fail;
+		}
 	}
 
-	uint32_t seqNum = ISN + 2;
-	uint32_t seqNumBeingTimed;  // Seq of the segment whose sample RTT is being timed
-	isSampleRTTBeingMeasured = 0;
+	// With a delta, fetch the signature of the server's copy so that only what it lacks is sent
+	struct DeltaEncoder deltaEncoder;
+	struct DeltaEncoder *delta = NULL;
+	if (clientOptions->isDelta && !synAckOptions.hasSignature) {
+		fprintf(stderr, "log: the server has no copy of the file, sending all of it\n");
+	} else if (clientOptions->isDelta) {
+		uint32_t blockSize = synAckOptions.signatureBlockSize, numBlocks = synAckOptions.signatureBlocks;
+		if (blockSize < MIN_DELTA_BLOCK || blockSize > MAX_DELTA_BLOCK || numBlocks > MAX_SIGNATURE_BLOCKS) {
+			fprintf(stderr, "error: invalid signature\n");
+			goto fail;
+		}
+		uint32_t signatureLen = SIPHASH_KEY_LEN + numBlocks * SIGNATURE_ENTRY_LEN;
+		char *signature = malloc(signatureLen);
+		if (!signature) {
+			perror("malloc");
+			goto fail;
+		}
+		fprintf(stderr, "log: fetching the signature of %u blocks of %u bytes\n", numBlocks, blockSize);
+		int status = fetchSignature(&tuner, &paths, &rttEstimator, &timeoutMicros, &clientSegment,
+			ackPort, udplPort, signature, signatureLen, windowSize);
+		if (status == 0 && (status = initDeltaEncoder(&deltaEncoder, signature, blockSize, numBlocks,
+			READER_BLOCK_SIZE)) < 0) {
+			perror("malloc");
+		}
+		free(signature);
+		if (status < 0) {
+			goto fail;
+		}
+		delta = &deltaEncoder;
+	}
 
-	uint32_t bytesSent = 0;  // The number of bytes received, used for logging
+	uint64_t resumeOffset = 0;
+	if (synAckOptions.hasResumeOffset) {
+		resumeOffset = synAckOptions.resumeOffset;
+		if (!clientOptions->isResumable || resumeOffset > options.fileSize || resumeOffset % SHA256_BLOCK_LEN) {
+			fprintf(stderr, "error: invalid resume offset\n");
+			goto failDelta;
+		}
+		fprintf(stderr, "log: resuming at byte %llu\n", (unsigned long long)resumeOffset);
+	}
+
+	uint32_t seqNum = ISN + 2;
 
-	// Open file for reading
-	int fd = open(fileStr, O_RDONLY);
-	if (fd < 0) {
+	// Open file (or manifest) for reading
+	int fd = -1;
+	FILE *manifest = NULL;  // Only set in a session
+	if (isSession ? !(manifest = fopen(fileStr, "r")) : (fd = open(fileStr, O_RDONLY)) < 0) {
 		perror("open");
-		goto fail;
+		goto failDelta;
+	}
+	// The file is read ahead in the background so that a slow disk does not stall sending.
+	// In a session, each stream reads its own file ahead.
+	struct FileReader reader;
+	struct Session session;
+	struct Sha256 digest;
+	initSha256(&digest);
+	if (resumeOffset) {
+		// The server has the start of the file and what it hashed to, so only the rest is read and hashed
+		if (lseek(fd, resumeOffset, SEEK_SET) < 0) {
+			perror("lseek");
+			goto failOpen;
+		}
+		resumeSha256(&digest, synAckOptions.resumeState, resumeOffset);
+	}
+	if (isSession) {
+		startSession(&session, manifest, clientOptions->numStreams);
+	} else if (startFileReader(&reader, fd, DEFAULT_READER_BLOCKS, delta, codec, &digest) < 0) {
+		goto failOpen;
 	}
 
 	// fileSegment contains TCP segments with data from the file
 	struct TCPSegmentEntry fileSegment;
 	int fileSegmentLen;  // Amount of data in fileSegment
 	char fileBuffer[MSS];
-	size_t fileBufferLen;
+	ssize_t fileBufferLen = 0;
 	struct Window *window = newWindow(windowSize / MSS);  // Window of segments that are in transit
 	if (!window) {
 		perror("malloc");
-		close(fd);
-		goto fail;
+		goto failReading;
 	}
 
 	timeRemaining = timeoutMicros;
+	int isRecovering = 0;  // Whether only the oldest segment has been resent since a timeout
+	int isGoingBackN = 0;  // Whether the whole window has been resent since a timeout
+	uint32_t retransmitTs = 0;  // When the oldest segment was resent
+	struct RTTEstimator undoEstimator;  // Estimator from before the timeout, restored if it was spurious
+	struct FECEncoder encoder;
+	initFECEncoder(&encoder, clientOptions->fecGroupSize);
+	int groupsSinceTimeout = 0;  // Parity groups sent since the last timeout
+	int isEstablished = !isEarlyData;  // Whether anything has come back from the server
+	struct TokenBucket egress;  // Caps the rate of everything sent, across every stream and path
+	initTokenBucket(&egress, clientOptions->egressRate, getMicroTimestamp());
+	struct LossDetector lossDetector;
+	initLossDetector(&lossDetector);
 
 	/*
 	 * Send file:
-	 *  - Fill window with segments and send all segments.
-	 *    Choose a segment and start a timer to measure its RTT.
-	 *  - Call recvfrom. If nothing is received within the timeout,
-	 *    increase the timeout and resend all segments in window.
-	 *    Mark the timed segment's RTT as invalid.
+	 *  - Fill window with segments and send all segments. Each segment carries the time it was sent.
+	 *    If FEC is on, also send a parity segment after every group of segments and at the end of the file.
+	 *  - Call recvfrom. Once a segment sent after another has been delivered (by the ACK or the SACK bitmap
+	 *    that comes with it) and the other has gone unacknowledged for longer than the RTT plus a reordering window,
+	 *    resend it. If no ACK comes for two smoothed RTTs, resend the newest segment as a tail loss probe.
+	 *  - If nothing is received within the timeout, double the timeout
+	 *    and resend the oldest segment with a new timestamp. If this already happened
+	 *    since the last ACK, resend all segments in the window instead.
 	 *  - If a segment is received, check if it is corrupted. If it is, then ignore it.
-	 *  - Else, check the segment's ACK. If it is in the window, shift the window up to the ACK.
-	 *    - If the segment being timed is ACKed, then stop its timer
-	 *      and adjust the timeout based on the segment's RTT
+	 *  - Else, check the segment's ACK. If it is in the window, shift the window up to the ACK
+	 *    and adjust the timeout using the RTT given by the echoed timestamp.
+	 *    Since resent segments are timestamped again, every such ACK gives a valid sample.
+	 *    - If this is the first ACK after a timeout and it echoes a timestamp from before
+	 *      the timeout, then the original segments were only delayed. The timeout was spurious,
+	 *      so undo its backoff and do not resend anything else.
+	 *    - Otherwise, the resent segment got through but the rest of the window may have been lost too,
+	 *      so resend every segment that the server has not reported in the ACK's SACK bitmap.
+	 *      The server keeps segments that arrive out of order, so the ACK may already cover most of the window.
+	 *  - With early data, also resend the SYN on a timeout until the server answers.
+	 *    If the SYNACK says the early data was rejected, send the ACK for it and resend the whole window.
 	 */
 	fprintf(stderr, "log: sending file\n");
-	do {
-		while (!isFull(window) && (fileBufferLen = read(fd, fileBuffer, MSS)) > 0) {
-			fillTCPSegment((struct TCPSegment *)&fileSegment, ackPort, udplPort, seqNum,
-				nextExpectedServerSeq, 0, fileBuffer, fileBufferLen);
-			// Store segments in network byte order
-			convertTCPSegment((struct TCPSegment *)&fileSegment, 1);
+	for (;;) {
+		// Only wait for the disk if there is nothing else to do
+		int pathIndex;
+		while (!isFull(window) && hasTokens(&egress, getMicroTimestamp()) && (pathIndex = pickPath(&paths)) >= 0
+			&& (fileBufferLen = isSession
+			? fillStreamSegment(&session, fileBuffer, isEmpty(window))
+			: readFileAhead(&reader, fileBuffer, MSS, isEmpty(window))) > 0) {
+			// Store segments in network byte order, with host-order copies of the fields read on every ACK
+			fileSegment.seqNum = seqNum;
+			fileSegment.tsVal = getMicroTimestamp();
+			encodeDataSegment((struct TCPSegment *)&fileSegment, ackPort, udplPort, seqNum,
+				nextExpectedServerSeq, fileSegment.tsVal, tsRecent, fileBuffer, fileBufferLen);
 			fileSegment.dataLen = fileBufferLen;
+			fileSegment.path = pathIndex;
+			fileSegment.isResent = 0;
+			fileSegment.isSacked = 0;
 			fileSegmentLen = HEADER_LEN + fileBufferLen;
-			offer(window, &fileSegment);
-			if (!isSampleRTTBeingMeasured) {
-				isSampleRTTBeingMeasured = 1;
-				seqNumBeingTimed = seqNum;
-				gettimeofday(&absoluteStartTime, NULL);
+			if (!offer(window, &fileSegment)) {
+				perror("mmap");
+				freeWindow(window);
+				goto failReading;
 			}
 
 			seqNum += fileSegment.dataLen;
 
-			if (sendto(clientSocket, &fileSegment, fileSegmentLen, 0,
-				(struct sockaddr *)&udplAddr, sizeof(udplAddr)) != fileSegmentLen) {
+			const struct Path *path = paths.paths + pathIndex;
+			if (sendto(path->sock, &fileSegment, fileSegmentLen, 0,
+				(struct sockaddr *)&path->addr, sizeof(path->addr)) != fileSegmentLen) {
 				perror("sendto");
 				freeWindow(window);
-				close(fd);
-				goto fail;
+				goto failReading;
+			}
+			onPathSent(&paths, pathIndex);
+			takeTokens(&egress, fileSegmentLen);
+			addMetric(&metrics.segmentsSent, 1);
+			addMetric(&metrics.bytesSent, fileSegment.dataLen);
+			traceEvent(trace, &(struct TraceRecord){ .event = TRACE_SEND,
+				.seqNum = seqNum - fileSegment.dataLen, .ackNum = nextExpectedServerSeq,
+				.length = fileSegment.dataLen, .windowLength = window->length,
+				.rto = timeoutMicros });
+
+			if (clientOptions->fecGroupSize
+				&& addToFECGroup(&encoder, seqNum - fileBufferLen, fileBuffer, fileBufferLen)) {
+				if (sendParity(paths.paths + pickResendPath(&paths), &encoder, ackPort, udplPort,
+					nextExpectedServerSeq, tsRecent, timeoutMicros) < 0) {
+					freeWindow(window);
+					goto failReading;
+				}
+				// Use fewer parity segments for as long as loss keeps being recovered without timeouts
+				if (++groupsSinceTimeout >= encoder.groupSize && encoder.groupSize < MAX_FEC_GROUP) {
+					encoder.groupSize++;
+					groupsSinceTimeout = 0;
+				}
 			}
-			fprintf(stderr, "log: sent %d bytes\r", (bytesSent += fileSegment.dataLen));
 		}
-		if (fileBufferLen < 0) {
-			perror("read");
+		if (fileBufferLen < 0 && errno != EAGAIN) {
+			if (!isSession) {
+				perror("read");
+			}
 			freeWindow(window);
-			close(fd);
-			goto fail;
+			goto failReading;
+		} else if (fileBufferLen == 0 && clientOptions->fecGroupSize
+			&& sendParity(paths.paths + pickResendPath(&paths), &encoder, ackPort, udplPort,
+			nextExpectedServerSeq, tsRecent, timeoutMicros) < 0) {
+			freeWindow(window);
+			goto failReading;
+		}
+		// If the egress cap or the streams' rates are holding data back, wake up when they let more through
+		// (unless an ACK comes first). The timer keeps running meanwhile.
+		int paceWait = isFull(window) || fileBufferLen == 0 ? 0 : getTokenWait(&egress);
+		if (!paceWait && isSession && fileBufferLen < 0) {
+			paceWait = getFlowWait(&session.scheduler);
+		}
+		// An ACK may cover the whole window (once the server fills a gap), so only stop when the file is done.
+		// An empty file sent as early data still needs the server to answer the SYN.
+		if (isEmpty(window) && isEstablished && !paceWait) {
+			break;
 		}
 
-		FD_ZERO(&readFds);
-		FD_SET(clientSocket, &readFds);
-		timeout = (struct timeval){ 0 };
-		setMicroTime(&timeout, timeRemaining);
+		// Loss detection and the tail loss probe also wake up before the timer goes off
+		int reorderWait = 0, probeWait = 0;
+		if (!isEmpty(window) && isEstablished) {
+			if ((reorderWait = resendLostSegments(&paths, window, &lossDetector,
+				nextExpectedServerSeq, timeoutMicros)) < 0) {
+				freeWindow(window);
+				goto failReading;
+			}
+			if (!lossDetector.isProbeArmed && rttEstimator.hasSample) {
+				armProbe(&lossDetector, getSmoothedRTT(&rttEstimator), getMicroTimestamp());
+			}
+			probeWait = getProbeWait(&lossDetector, getMicroTimestamp());
+		}
+		int wakeWait = paceWait;
+		wakeWait = reorderWait && (!wakeWait || reorderWait < wakeWait) ? reorderWait : wakeWait;
+		wakeWait = probeWait && (!wakeWait || probeWait < wakeWait) ? probeWait : wakeWait;
+		const int isWakingEarly = wakeWait && (isEmpty(window) || wakeWait < timeRemaining);
+
 		gettimeofday(&startTime, NULL);
-		fdsReady = select(clientSocket + 1, &readFds, NULL, NULL, &timeout);
+		fdsReady = waitForDatagram(&tuner, isWakingEarly ? wakeWait : timeRemaining);
 		gettimeofday(&endTime, NULL);
-		if (fdsReady < 0 ) {
-			perror("select");
+		if (fdsReady < 0) {
 			freeWindow(window);
-			close(fd);
-			goto fail;
+			goto failReading;
+		} else if (fdsReady == 0 && isWakingEarly) {
+			timeElapsed = getMicroDiff(&startTime, &endTime);
+			timeRemaining = MAX(timeRemaining - timeElapsed, 0);
+			if (probeWait && getProbeWait(&lossDetector, getMicroTimestamp()) <= 1) {
+				// Resend the newest segment the server has not reported, so that its ACK shows what is missing
+				int probeIndex = window->startIndex;
+				for (int i = 0, currIndex = window->startIndex; i < window->length;
+					i++, currIndex = next(window, currIndex)) {
+					probeIndex = window->arr[currIndex]->isSacked ? probeIndex : currIndex;
+				}
+				if (resendSegment(&paths, window, window->arr[probeIndex],
+					nextExpectedServerSeq, timeoutMicros) < 0) {
+					freeWindow(window);
+					goto failReading;
+				}
+				lossDetector.isProbeArmed = 0;
+				lossDetector.isProbeSent = 1;
+				addMetric(&metrics.tailLossProbes, 1);
+			}
+			continue;
 		} else if (fdsReady == 0) {
-			timeRemaining = timeoutMicros = (int)(timeoutMicros * TIMEOUT_MULTIPLIER);
-
-			int currIndex = window->startIndex;
-			struct TCPSegmentEntry *segmentInWindow;
-			int segmentInWindowLen;
-			do {
-				segmentInWindow = window->arr + currIndex;
-				segmentInWindowLen = HEADER_LEN + segmentInWindow->dataLen;
-				if (sendto(clientSocket, segmentInWindow, segmentInWindowLen, 0,
-					(struct sockaddr *)&udplAddr, sizeof(udplAddr)) != segmentInWindowLen) {
-					perror("sendto");
+			// After the first timeout, only the oldest segment is resent (as in F-RTO).
+			// If the timer goes off again, the resent segment was lost too, so go back N.
+			int numToResend = isRecovering || isGoingBackN || isEmpty(window) ? window->length : 1;
+			if (!isEmpty(window)) {
+				onPathTimeout(&paths, window->arr[window->startIndex]->path);
+			}
+			// The server may have dropped what it reported (its bitmap is not covered by the checksum either),
+			// so anything still unacknowledged may need to be resent
+			for (int i = 0, currIndex = window->startIndex; i < window->length;
+				i++, currIndex = next(window, currIndex)) {
+				window->arr[currIndex]->isSacked = 0;
+			}
+			lossDetector.isProbeArmed = 0;
+			lossDetector.isProbeSent = 1;
+			if (isRecovering) {
+				// Everything is resent now, so the next ACK has nothing left to resend
+				isRecovering = 0;
+				isGoingBackN = 1;
+			} else if (!isGoingBackN) {
+				isRecovering = 1;
+				undoEstimator = rttEstimator;
+				retransmitTs = getMicroTimestamp();
+			}
+			backOffRTO(&rttEstimator);
+			timeRemaining = timeoutMicros = getRTO(&rttEstimator);
+			addMetric(&metrics.timeouts, 1);
+			recordRTO(&metrics, timeoutMicros);
+			// Loss that parity could not recover, so send parity more often
+			encoder.groupSize = MAX(encoder.groupSize / 2, MIN_FEC_GROUP);
+			groupsSinceTimeout = 0;
+			traceEvent(trace, &(struct TraceRecord){ .event = TRACE_TIMEOUT,
+				.seqNum = getOldestSeq(window, seqNum),
+				.windowLength = window->length, .rto = timeoutMicros });
+
+			if (!isEstablished) {
+				stampTCPSegment(&synSegment, getMicroTimestamp());
+				if (sendOnEveryPath(&paths, &synSegment, synLen) < 0) {
 					freeWindow(window);
-					close(fd);
-					goto fail;
+					goto failReading;
 				}
-			} while ((currIndex = next(window, currIndex)) != window->endIndex);
-			isSampleRTTBeingMeasured = 0;
+				addMetric(&metrics.retransmissions, 1);
+			}
+			if (resendSegments(&paths, window, numToResend,
+				nextExpectedServerSeq, timeoutMicros) < 0) {
+				freeWindow(window);
+				goto failReading;
+			}
 			continue;
 		}
 
 		// Nonblocking
-		serverSegmentLen = recvfrom(clientSocket, &serverSegment,
-			sizeof(struct TCPSegment), 0, NULL, NULL);
+		int numDropped;
+		serverSegmentLen = receiveDatagram(&tuner, &serverSegment, sizeof(struct TCPSegment), &numDropped);
 		if (serverSegmentLen < 0) {
-			perror("recvfrom");
 			freeWindow(window);
-			close(fd);
-			goto fail;
+			goto failReading;
 		}
+		addMetric(&metrics.segmentsReceived, 1);
+		addMetric(&metrics.kernelDrops, numDropped);
 
-		convertTCPSegment(&serverSegment, 0);
+		int isValid = decodeTCPSegment(&serverSegment);
 		int resumeTimer = 1;
-		if (isChecksumValid(&serverSegment)) {
+		if (isValid) {
 			const uint32_t serverACKNum = serverSegment.ackNum;
-			if (serverACKNum > ntohl(window->arr[window->startIndex].segment.seqNum)
+			traceEvent(trace, &(struct TraceRecord){ .event = TRACE_RECV,
+				.seqNum = serverSegment.seqNum, .ackNum = serverACKNum,
+				.flags = serverSegment.flags, .windowLength = window->length,
+				.rto = timeoutMicros });
+			tsRecent = serverSegment.tsVal;
+			// Sequence numbers wrap around, so they are compared by their distance
+			if ((int32_t)(serverACKNum - getOldestSeq(window, seqNum)) > 0
 				&& isFlagSet(&serverSegment, ACK_FLAG)) {
-				// isEmpty(window) || window->arr[window->startIndex].seqNum == serverACKNum
+				isEstablished = 1;
+				// isEmpty(window) || window->arr[window->startIndex]->seqNum == serverACKNum
 				for ( ; !isEmpty(window)
-					&& ntohl(window->arr[window->startIndex].segment.seqNum) != serverACKNum;
-					deleteHead(window));
-
-				if (isSampleRTTBeingMeasured && !isEmpty(window)
-					&& seqNumBeingTimed < ntohl(window->arr[window->startIndex].segment.seqNum)) {
-					updateRTTAndTimeout(getMicroDiff(&absoluteStartTime, &endTime),
-						&estimatedRTT, &devRTT, &timeoutMicros, ALPHA, BETA);
-					isSampleRTTBeingMeasured = 0;
+					&& window->arr[window->startIndex]->seqNum != serverACKNum;
+					deleteHead(window)) {
+					const struct TCPSegmentEntry *ackedSegment = window->arr[window->startIndex];
+					addMetric(&metrics.bytesDelivered, ackedSegment->dataLen);
+					// Only the segment whose timestamp is echoed gives its path an RTT sample
+					onPathAcked(&paths, ackedSegment->path, serverSegment.tsEcr
+						&& ackedSegment->tsVal == serverSegment.tsEcr
+						? (int)(getMicroTimestamp() - serverSegment.tsEcr) : 0);
+					if (!ackedSegment->isSacked) {
+						onSegmentDelivered(&lossDetector, ackedSegment->tsVal,
+							ackedSegment->isResent, getMicroTimestamp());
+					}
+				}
+				lossDetector.isProbeArmed = 0;
+				lossDetector.isProbeSent = 0;
+				if (!isEmpty(window) && serverSegmentLen > HEADER_LEN) {
+					markSackedSegments(window, &lossDetector, serverSegment.data, serverSegmentLen - HEADER_LEN);
+				}
+
+				if (isRecovering) {
+					isRecovering = 0;
+					if (serverSegment.tsEcr && (int32_t)(serverSegment.tsEcr - retransmitTs) < 0) {
+						rttEstimator = undoEstimator;
+						addMetric(&metrics.spuriousTimeouts, 1);
+						traceEvent(trace, &(struct TraceRecord){ .event = TRACE_SPURIOUS,
+							.seqNum = serverACKNum, .windowLength = window->length,
+							.rto = getRTO(&rttEstimator) });
+					} else if (resendSegments(&paths, window, window->length,
+						nextExpectedServerSeq, timeoutMicros) < 0) {
+						freeWindow(window);
+						goto failReading;
+					}
+				}
+				isGoingBackN = 0;
+				if (serverSegment.tsEcr) {
+					takeRTTSample(&rttEstimator, &serverSegment, &timeoutMicros, window->length);
+				} else {
+					timeoutMicros = getRTO(&rttEstimator);
 				}
 
 				timeRemaining = timeoutMicros;
 				resumeTimer = 0;
 			} else if (serverACKNum == ISN + 1 && isFlagSet(&serverSegment, SYN_FLAG | ACK_FLAG)) {
-				if (sendto(clientSocket, &clientSegment, HEADER_LEN, 0,
-					(struct sockaddr *)&udplAddr, sizeof(udplAddr)) != HEADER_LEN) {
-					perror("sendto");
+				// Either the answer to a SYN sent with early data, or a SYNACK resent because the ACK for it was lost
+				int isAccepted = readSynAck(&serverSegment, serverSegmentLen - HEADER_LEN, clientOptions->tokenPath,
+					&synAckOptions);
+				if (isEarlyData && synAckOptions.codec != codec) {
+					fprintf(stderr, "error: the server did not accept the codec the early data was sent with\n");
 					freeWindow(window);
-					close(fd);
-					goto fail;
+					goto failReading;
+				}
+				if (!isEarlyData || !isAccepted) {
+					if (sendOnEveryPath(&paths, &clientSegment, HEADER_LEN) < 0) {
+						freeWindow(window);
+						goto failReading;
+					}
+				}
+				if (isEarlyData && !isAccepted && !isEstablished) {
+					// The server dropped everything sent so far
+					fprintf(stderr, "log: early data was rejected, resending it\n");
+					if (resendSegments(&paths, window, window->length,
+						nextExpectedServerSeq, timeoutMicros) < 0) {
+						freeWindow(window);
+						goto failReading;
+					}
+				}
+				isEstablished = 1;
+			} else if (serverACKNum == getOldestSeq(window, seqNum)
+				&& isFlagSet(&serverSegment, ACK_FLAG)) {
+				addMetric(&metrics.duplicateACKs, 1);
+				if (!isEmpty(window) && serverSegmentLen > HEADER_LEN) {
+					markSackedSegments(window, &lossDetector, serverSegment.data, serverSegmentLen - HEADER_LEN);
 				}
 			} // else ACK out of range
+		} else {
+			addMetric(&metrics.checksumFailures, 1);
+			traceEvent(trace, &(struct TraceRecord){ .event = TRACE_CORRUPT,
+				.windowLength = window->length, .rto = timeoutMicros });
 		}
 		if (resumeTimer) {
 			timeElapsed = getMicroDiff(&startTime, &endTime);
 			timeRemaining = MAX(timeRemaining - timeElapsed, 0);
 		}
-	} while (!isEmpty(window));
+	}
 
-	fprintf(stderr, "\n");
+	fprintf(stderr, "log: sent %lu bytes\n", getMetric(&metrics.bytesDelivered));
+	for (int i = 0; paths.numPaths > 1 && i < paths.numPaths; i++) {
+		fprintf(stderr, "log: path %d sent %lu segments (smoothed RTT %d us)\n", i,
+			paths.paths[i].segmentsSent, getSmoothedRTT(&paths.paths[i].rtt));
+	}
 	freeWindow(window);
-	close(fd);
+	if (isSession) {
+		stopSession(&session);
+	} else {
+		if (codec) {
+			fprintf(stderr, "log: compressed %lu bytes into %lu\n",
+				reader.compressor->rawBytes, reader.compressor->compressedBytes);
+		}
+		stopFileReader(&reader);
+		if (delta) {
+			fprintf(stderr, "log: sent %lu bytes as copies of the server's blocks and %lu as data\n",
+				delta->copiedBytes, delta->literalBytes);
+			freeDeltaEncoder(delta);
+		}
+	}
+	if (manifest) {
+		fclose(manifest);
+	} else {
+		close(fd);
+	}
+	uint8_t digestBytes[SHA256_LEN];
+	if (options.hasDigest) {
+		finishSha256(&digest, digestBytes);
+		fprintf(stderr, "log: SHA-256 of the file is ");
+		for (int i = 0; i < SHA256_LEN; i++) {
+			fprintf(stderr, "%02x", digestBytes[i]);
+		}
+		fprintf(stderr, "\n");
+	}
 
-	// Create FIN segment
-	fillTCPSegment(&clientSegment, ackPort, udplPort, seqNum++,
-		nextExpectedServerSeq, FIN_FLAG, NULL, 0);
-	convertTCPSegment(&clientSegment, 1);
+	// Create FIN segment, which carries the digest
+	int finLen = HEADER_LEN + (options.hasDigest ? SHA256_LEN : 0);
+	encodeTCPSegment(&clientSegment, ackPort, udplPort, seqNum++,
+		nextExpectedServerSeq, FIN_FLAG, 0, tsRecent, (char *)digestBytes, finLen - HEADER_LEN);
 
 	timeRemaining = timeoutMicros;
 
@@ -337,9 +1304,8 @@ int runClient(const char *fileStr, const char *udplAddress, int udplPort, int wi
 	 */
 	fprintf(stderr, "log: finished sending file, sending FIN\n");
 	for (;;) {
-		if (sendto(clientSocket, &clientSegment, HEADER_LEN, 0,
-			(struct sockaddr *)&udplAddr, sizeof(udplAddr)) != HEADER_LEN) {
-			perror("sendto");
+		stampTCPSegment(&clientSegment, getMicroTimestamp());
+		if (sendOnEveryPath(&paths, &clientSegment, finLen) < 0) {
 			goto fail;
 		}
 
@@ -355,7 +1321,12 @@ int runClient(const char *fileStr, const char *udplAddress, int udplPort, int wi
 			goto fail;
 		} else if (fdsReady == 0) {
 			fprintf(stderr, "warning: failed to receive ACK for FIN\n");
-			timeRemaining = timeoutMicros = (int)(timeoutMicros * TIMEOUT_MULTIPLIER);
+			backOffRTO(&rttEstimator);
+			timeRemaining = timeoutMicros = getRTO(&rttEstimator);
+			addMetric(&metrics.timeouts, 1);
+			recordRTO(&metrics, timeoutMicros);
+			traceEvent(trace, &(struct TraceRecord){ .event = TRACE_TIMEOUT,
+				.seqNum = seqNum - 1, .flags = FIN_FLAG, .rto = timeoutMicros });
 			continue;
 		}
 
@@ -366,17 +1337,39 @@ int runClient(const char *fileStr, const char *udplAddress, int udplPort, int wi
 			perror("recvfrom");
 			goto fail;
 		}
+		addMetric(&metrics.segmentsReceived, 1);
 
-		convertTCPSegment(&serverSegment, 0);
-		if (isChecksumValid(&serverSegment) && serverSegment.ackNum == seqNum
+		int isValid = decodeTCPSegment(&serverSegment);
+		if (isValid && serverSegment.ackNum == seqNum
 			&& isFlagSet(&serverSegment, ACK_FLAG)) {
 			break;
+		} else if (!isValid) {
+			addMetric(&metrics.checksumFailures, 1);
 		}
 
 		timeElapsed = getMicroDiff(&startTime, &endTime);
 		timeRemaining = MAX(timeRemaining - timeElapsed, 0);
 	}
 
+	/*
+	 * With quick teardown, the server has everything once it acknowledges the FIN, so return now
+	 * and leave the server's FIN to a background process. It gives up on the FIN after FINAL_WAIT seconds,
+	 * since the server stops resending it by then.
+	 */
+	int finalWait = (int)(FINAL_WAIT * SI_MICRO);
+	if (clientOptions->isQuickTeardown && (isLingering = startLingering()) == 0) {
+		fprintf(stderr, "log: received ACK for FIN, answering FIN in the background\n");
+		closePaths(&paths);
+		close(clientSocket);
+		return 0;
+	} else if (isLingering == 1) {
+		struct timeval finWait = { .tv_sec = FINAL_WAIT };
+		setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &finWait, sizeof(finWait));
+		if (LINGER_RTOS * timeoutMicros < finalWait) {
+			finalWait = LINGER_RTOS * timeoutMicros;
+		}
+	}
+
 	/*
 	* Listen for FIN:
 	*  - Call recvfrom. If the received segment is not corrupt, has a seq that is the next expected one,
@@ -386,24 +1379,26 @@ int runClient(const char *fileStr, const char *udplAddress, int udplPort, int wi
 	for (;;) {
 		serverSegmentLen = recvfrom(clientSocket, &serverSegment,
 			sizeof(struct TCPSegment), 0, NULL, NULL);
-		if (serverSegmentLen < 0) {
+		if (serverSegmentLen < 0 && isLingering && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			_exit(0);
+		} else if (serverSegmentLen < 0) {
 			perror("recvfrom");
 			goto fail;
 		}
+		addMetric(&metrics.segmentsReceived, 1);
 
-		convertTCPSegment(&serverSegment, 0);
-		if (isChecksumValid(&serverSegment) && serverSegment.seqNum == nextExpectedServerSeq
+		int isValid = decodeTCPSegment(&serverSegment);
+		if (isValid && serverSegment.seqNum == nextExpectedServerSeq
 			&& isFlagSet(&serverSegment, FIN_FLAG)) {
 			break;
 		}
 	}
 
 	// Create ACK for server's FIN
-	fillTCPSegment(&clientSegment, ackPort, udplPort, seqNum,
-		nextExpectedServerSeq + 1, ACK_FLAG, NULL, 0);
-	convertTCPSegment(&clientSegment, 1);
+	encodeACKSegment(&clientSegment, ackPort, udplPort, seqNum,
+		nextExpectedServerSeq + 1, getMicroTimestamp(), serverSegment.tsVal, NULL, 0);
 	int hasSeenFIN = 1;  // Whether a FIN from the server has just been received
-	timeRemaining = (int)(FINAL_WAIT * SI_MICRO);
+	timeRemaining = finalWait;
 
 	/*
 	 * Send ACK:
@@ -413,12 +1408,10 @@ int runClient(const char *fileStr, const char *udplAddress, int udplPort, int wi
 	 *  - If a segment is received, check that it is not corrupt, the seq is the next expected one,
 	 *    and the FIN flag is set. If so, resend the ACK. Else, ignore.
 	 */
-	fprintf(stderr, "log: received FIN, sending ACK and waiting %.1f seconds\n", (float)FINAL_WAIT);
+	fprintf(stderr, "log: received FIN, sending ACK and waiting %.1f seconds\n", (float)finalWait / SI_MICRO);
 	for (;;) {
 		if (hasSeenFIN) {
-			if (sendto(clientSocket, &clientSegment, HEADER_LEN, 0,
-				(struct sockaddr *)&udplAddr, sizeof(udplAddr)) != HEADER_LEN) {
-				perror("sendto");
+			if (sendOnEveryPath(&paths, &clientSegment, HEADER_LEN) < 0) {
 				goto fail;
 			}
 		}
@@ -444,9 +1437,10 @@ int runClient(const char *fileStr, const char *udplAddress, int udplPort, int wi
 			perror("recvfrom");
 			goto fail;
 		}
+		addMetric(&metrics.segmentsReceived, 1);
 
-		convertTCPSegment(&serverSegment, 0);
-		if (isChecksumValid(&serverSegment) && serverSegment.seqNum == nextExpectedServerSeq
+		int isValid = decodeTCPSegment(&serverSegment);
+		if (isValid && serverSegment.seqNum == nextExpectedServerSeq
 			&& isFlagSet(&serverSegment, FIN_FLAG)) {
 			hasSeenFIN = 1;
 		}
@@ -455,21 +1449,146 @@ int runClient(const char *fileStr, const char *udplAddress, int udplPort, int wi
 		timeRemaining = MAX(timeRemaining - timeElapsed, 0);
 	}
 
+	closePaths(&paths);
 	close(clientSocket);
+	if (isLingering) {
+		// The caller has already returned, so skip its cleanup
+		_exit(0);
+	}
 	fprintf(stderr, "log: goodbye\n");
 	return 0;
 
+failReading:
+	if (isSession) {
+		stopSession(&session);
+	} else {
+		stopFileReader(&reader);
+	}
+failOpen:
+	if (manifest) {
+		fclose(manifest);
+	} else {
+		close(fd);
+	}
+failDelta:
+	if (delta) {
+		freeDeltaEncoder(delta);
+	}
+
 fail:
+	closePaths(&paths);
 	close(clientSocket);
+	if (isLingering) {
+		_exit(1);
+	}
 	return 1;
 }
 
 int main(int argc, char **argv)
 {
-	if (argc != 6) {
-		fprintf(stderr, "usage: tcpclient <file> <udpl address> <udpl port> <window size> <ack port>\n");
+	const char *metricsPath = NULL;
+	const char *metricsSocketPath = NULL;
+	const char *tracePath = NULL;
+	int showProgress = 0;
+	struct ClientOptions clientOptions = { .numStreams = DEFAULT_STREAMS,
+		.minTimeout = MIN_TIMEOUT, .maxTimeout = MAX_TIMEOUT };
+	int isSession = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "bcDf:L:m:n:pP:qRr:st:u:z:")) != -1) {
+		switch (opt) {
+		case 'b':
+			clientOptions.isBusyPolling = 1;
+			break;
+		case 'c':
+			clientOptions.isCompressing = 1;
+			break;
+		case 'D':
+			clientOptions.isDelta = 1;
+			break;
+		case 'f':
+			clientOptions.fecGroupSize = isNumber(optarg) ? (int)strtol(optarg, NULL, 10) : 0;
+			if (clientOptions.fecGroupSize < MIN_FEC_GROUP || clientOptions.fecGroupSize > MAX_FEC_GROUP) {
+				fprintf(stderr, "error: FEC group size must be between %d and %d\n",
+					MIN_FEC_GROUP, MAX_FEC_GROUP);
+				return 1;
+			}
+			break;
+		case 'L':
+			if (!(clientOptions.egressRate = parseRate(optarg))) {
+				fprintf(stderr, "error: invalid rate (expected bytes per second, with an optional K, M, or G)\n");
+				return 1;
+			}
+			break;
+		case 'm':
+			metricsPath = optarg;
+			break;
+		case 'n':
+			clientOptions.numStreams = isNumber(optarg) ? (int)strtol(optarg, NULL, 10) : 0;
+			if (clientOptions.numStreams < 1 || clientOptions.numStreams > MAX_STREAMS) {
+				fprintf(stderr, "error: number of streams must be between 1 and %d\n", MAX_STREAMS);
+				return 1;
+			}
+			break;
+		case 'p':
+			showProgress = 1;
+			break;
+		case 'P':
+			if (clientOptions.numSubflows == MAX_PATHS - 1) {
+				fprintf(stderr, "error: at most %d subflows can be added\n", MAX_PATHS - 1);
+				return 1;
+			} else if (parseSubflow(optarg, clientOptions.subflows + clientOptions.numSubflows++) < 0) {
+				fprintf(stderr, "error: invalid subflow (expected source address:address:port)\n");
+				return 1;
+			}
+			break;
+		case 'q':
+			clientOptions.isQuickTeardown = 1;
+			break;
+		case 'R':
+			clientOptions.isResumable = 1;
+			break;
+		case 'r':
+			if (sscanf(optarg, "%d:%d", &clientOptions.minTimeout, &clientOptions.maxTimeout) != 2
+				|| clientOptions.minTimeout <= 0 || clientOptions.maxTimeout < clientOptions.minTimeout
+				|| clientOptions.maxTimeout > MAX_TIMEOUT_BOUND) {
+				fprintf(stderr, "error: invalid timeout bounds\n");
+				return 1;
+			}
+			break;
+		case 's':
+			isSession = 1;
+			break;
+		case 't':
+			tracePath = optarg;
+			break;
+		case 'u':
+			metricsSocketPath = optarg;
+			break;
+		case 'z':
+			clientOptions.tokenPath = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (argc - optind != 5) {
+		goto usage;
+	} else if (clientOptions.isCompressing && isSession) {
+		// Frames in a session are handled as soon as they arrive, but compressed data has to be read in order
+		fprintf(stderr, "error: sessions cannot be compressed\n");
+		return 1;
+	} else if (clientOptions.isDelta && isSession) {
+		fprintf(stderr, "error: sessions cannot be sent as deltas\n");
+		return 1;
+	} else if (clientOptions.isResumable && isSession) {
+		fprintf(stderr, "error: sessions cannot be resumed\n");
+		return 1;
+	} else if (clientOptions.isResumable && (clientOptions.isCompressing || clientOptions.isDelta)) {
+		// The server checkpoints the file it writes, which only lines up with the data sent when it is sent as it is
+		fprintf(stderr, "error: compressed and delta transfers cannot be resumed\n");
 		return 1;
 	}
+	argv += optind - 1;
 
 	const char *fileStr = argv[1];
 	if (access(fileStr, F_OK) != 0) {
@@ -495,6 +1614,10 @@ int main(int argc, char **argv)
 	if (windowSize < MSS) {
 		fprintf(stderr, "error: window size must be at least %d\n", MSS);
 		return 1;
+	} else if (windowSize > SACK_MAX_WINDOW) {
+		// The server keeps no more out-of-order segments than its ACKs can report
+		fprintf(stderr, "warning: clamping the window size to %d, the most the server keeps\n", SACK_MAX_WINDOW);
+		windowSize = SACK_MAX_WINDOW;
 	}
 	int ackPort = getPort(argv[5]);
 	if (!ackPort) {
@@ -502,5 +1625,33 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	return runClient(fileStr, udplAddress, udplPort, windowSize, ackPort);
+	struct MetricsReporter reporter;
+	initMetrics(&metrics);
+	if (startMetricsReporter(&reporter, &metrics, metricsPath, metricsSocketPath,
+		showProgress ? "sent" : NULL) < 0) {
+		return 1;
+	}
+	struct Trace traceStorage;
+	if (tracePath) {
+		if (startTrace(&traceStorage, tracePath, DEFAULT_TRACE_CAPACITY) < 0) {
+			stopMetricsReporter(&reporter);
+			return 1;
+		}
+		trace = &traceStorage;
+	}
+	if (!isSession) {
+		clientOptions.numStreams = 0;
+	}
+	int status = runClient(fileStr, &clientOptions, udplAddress, udplPort, windowSize, ackPort);
+	if (trace) {
+		stopTrace(trace);
+	}
+	stopMetricsReporter(&reporter);
+	return status;
+
+usage:
+	fprintf(stderr, "usage: tcpclient [-bcDpqRs] [-m metrics file] [-u metrics socket] [-t trace file] "
+		"[-r min ms:max ms] [-f FEC group size] [-L rate] [-n streams] [-z token file] [-P source:address:port ...] "
+		"<file or manifest> <udpl address> <udpl port> <window size> <ack port>\n");
+	return 1;
 }
@@ -1,25 +1,347 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "tcp.h"
+#include "metrics.h"
+#include "trace.h"
+#include "rtt.h"
+#include "fec.h"
+#include "loss.h"
+#include "writer.h"
+#include "codec.h"
+#include "delta.h"
+#include "checkpoint.h"
+#include "options.h"
+#include "session.h"
+#include "token.h"
+#include "pool.h"
+#include "tuning.h"
 #include "helpers.h"
 
 #define ISN 0
 #define INITIAL_TIMEOUT 1  // The initial timeout, in seconds
-#define TIMEOUT_MULTIPLIER 1.1  // The timeout multiplier when a timeout occurs
-#define ALPHA 0.125
-#define BETA 0.25
+#define MIN_TIMEOUT 1  // The lower bound on the timeout, in milliseconds
+#define MAX_TIMEOUT 10000  // The upper bound on the timeout, in milliseconds
+#define MAX_FIN_RETRIES 6  // How many times the FIN is resent before the server stops waiting for its ACK
 
-int runServer(const char *fileStr, int listenPort, const char *ackAddress, int ackPort)
+static struct Metrics metrics;
+static struct Trace *trace;  // NULL unless tracing is enabled
+
+/*
+ * Reserve the whole file up front so that it is not extended (and fragmented) write by write
+ */
+static void allocateFile(int fd, uint64_t fileSize)
+{
+	if (fileSize == 0) {
+		return;
+	}
+#ifdef __linux__
+	if ((errno = posix_fallocate(fd, 0, fileSize))) {
+		perror("posix_fallocate");
+	}
+#else
+	if (ftruncate(fd, fileSize) < 0) {
+		perror("ftruncate");
+	}
+#endif
+}
+
+/*
+ * Create a file in dirStr
+ */
+static int openSessionFile(const char *dirStr, const char *name)
+{
+	char path[strlen(dirStr) + strlen(name) + 2];
+	sprintf(path, "%s/%s", dirStr, name);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+	if (fd < 0) {
+		perror("open");
+	}
+	return fd;
+}
+
+/*
+ * Get the name a stream's file has until its open frame arrives
+ */
+static void getTempName(char *name, uint32_t streamId)
+{
+	sprintf(name, ".stream-%u.part", streamId);
+}
+
+/*
+ * Name a stream's file. If data for the stream arrived before its open frame, the file was created
+ * under a temporary name, so it is renamed.
+ */
+static int openStreamFile(struct Stream *stream, const char *dirStr, const struct Frame *frame)
+{
+	char name[MAX_FRAME_NAME_LEN + 1];
+	memcpy(name, frame->data, frame->len);
+	name[frame->len] = '\0';
+	// Data that arrived before the open frame could not be checked against the size until now
+	if (stream->isOpen || stream->received > frame->value || stream->end > frame->value) {
+		fprintf(stderr, "error: malformed session\n");
+		return -1;
+	} else if (!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+		// The name would escape the directory
+		fprintf(stderr, "error: invalid file name in session: %s\n", name);
+		return -1;
+	}
+
+	if (stream->fd < 0) {
+		if ((stream->fd = openSessionFile(dirStr, name)) < 0) {
+			return -1;
+		}
+	} else {
+		char tempName[MAX_FRAME_NAME_LEN + 1];
+		getTempName(tempName, stream->id);
+		char tempPath[strlen(dirStr) + strlen(tempName) + 2], path[strlen(dirStr) + strlen(name) + 2];
+		sprintf(tempPath, "%s/%s", dirStr, tempName);
+		sprintf(path, "%s/%s", dirStr, name);
+		if (rename(tempPath, path) < 0) {
+			perror("rename");
+			return -1;
+		}
+	}
+	allocateFile(stream->fd, frame->value);
+	stream->size = frame->value;
+	stream->isOpen = 1;
+	return 0;
+}
+
+/*
+ * Queue a data frame to be written at its offset, creating the stream's file if this is its first frame
+ */
+static int writeStreamData(struct Stream *stream, struct FileWriter *writer, const char *dirStr,
+	const struct Frame *frame)
+{
+	// The checks subtract rather than add, so that a huge offset cannot overflow past them
+	uint64_t size = stream->isOpen ? stream->size : UINT64_MAX;
+	if (frame->value > size || frame->len > size - frame->value) {
+		fprintf(stderr, "error: malformed session\n");
+		return -1;
+	}
+	if (stream->fd < 0) {
+		char tempName[MAX_FRAME_NAME_LEN + 1];
+		getTempName(tempName, stream->id);
+		if ((stream->fd = openSessionFile(dirStr, tempName)) < 0) {
+			return -1;
+		}
+	}
+	if (queueFileWrite(writer, stream->fd, frame->value, frame->data, frame->len) < 0) {
+		return -1;
+	}
+	stream->received += frame->len;
+	stream->end = MAX(stream->end, frame->value + frame->len);
+	return 0;
+}
+
+/*
+ * Handle the frames in a segment's data, creating, writing, and closing files in dirStr.
+ * A file is closed once all of it has been received. Return -1 if the session is malformed or a file
+ * cannot be written.
+ */
+static int handleStreamFrames(struct StreamTable *streams, struct FileWriter *writer, const char *dirStr,
+	const char *data, int len)
 {
+	struct Frame frame;
+	int frameLen;
+	while ((frameLen = readFrame(data, len, &frame)) > 0) {
+		data += frameLen;
+		len -= frameLen;
+		struct Stream *stream = getStream(streams, frame.streamId);
+		if (!stream) {
+			perror("malloc");
+			return -1;
+		}
+		if (frame.type == FRAME_OPEN ? openStreamFile(stream, dirStr, &frame) < 0
+			: writeStreamData(stream, writer, dirStr, &frame) < 0) {
+			return -1;
+		}
+		if (stream->isOpen && stream->received == stream->size) {
+			// Files are not synced one by one since that would cost a disk flush per file
+			int status = queueFileClose(writer, stream->fd, 0);
+			removeStream(streams, stream);
+			if (status < 0) {
+				return -1;
+			}
+		}
+	}
+	if (frameLen < 0) {
+		fprintf(stderr, "error: malformed session\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Close the files of streams that were not completely received. Return the number of them.
+ */
+static int closeStreams(struct StreamTable *streams, struct FileWriter *writer)
+{
+	int count = streams->count;
+	struct Stream *stream;
+	while ((stream = firstStream(streams))) {
+		if (stream->fd >= 0) {
+			queueFileClose(writer, stream->fd, 0);
+		}
+		removeStream(streams, stream);
+	}
+	return count;
+}
+
+/*
+ * Open the old copy of fileStr and write its signature to *signature for a client that sends a delta.
+ * Return the old copy's fd, or -1 if there is no copy to send a delta against (which is not an error).
+ */
+static int openOldCopy(const char *fileStr, struct HandshakeOptions *synAckOptions, char **signature,
+	uint32_t *signatureLen)
+{
+	int oldFd = open(fileStr, O_RDONLY);
+	if (oldFd < 0) {
+		if (errno != ENOENT) {
+			perror("open");
+		}
+		return -1;
+	}
+	struct stat fileStat;
+	if (fstat(oldFd, &fileStat) < 0) {
+		perror("fstat");
+		goto fail;
+	}
+	int blockSize = getDeltaBlockSize(fileStat.st_size);
+	uint64_t numBlocks = fileStat.st_size / blockSize;
+	if (!S_ISREG(fileStat.st_mode) || numBlocks == 0 || numBlocks > MAX_SIGNATURE_BLOCKS) {
+		goto fail;
+	}
+
+	*signatureLen = SIPHASH_KEY_LEN + numBlocks * SIGNATURE_ENTRY_LEN;
+	if (!(*signature = malloc(*signatureLen))) {
+		perror("malloc");
+		goto fail;
+	}
+	if (makeSignature(oldFd, blockSize, numBlocks, *signature) < 0) {
+		free(*signature);
+		*signature = NULL;
+		goto fail;
+	}
+	synAckOptions->signatureBlockSize = blockSize;
+	synAckOptions->signatureBlocks = numBlocks;
+	synAckOptions->hasSignature = 1;
+	fprintf(stderr, "log: made a signature of %lu blocks of %d bytes of the old copy\n", numBlocks, blockSize);
+	return oldFd;
+
+fail:
+	close(oldFd);
+	return -1;
+}
+
+/*
+ * Look for a checkpoint at checkpointPath left by an earlier transfer of the same version of the file,
+ * and offer the client to resume at it in the SYNACK. A checkpoint of another transfer is deleted.
+ * Return the offset to resume at, or 0 to start over.
+ */
+static uint64_t findResumeOffset(const char *fileStr, const char *checkpointPath, const struct HandshakeOptions *options,
+	struct HandshakeOptions *synAckOptions)
+{
+	struct Checkpoint checkpoint;
+	if (!loadCheckpoint(checkpointPath, &checkpoint)) {
+		return 0;
+	}
+	// The file has to still be there with everything the checkpoint claims
+	struct stat fileStat;
+	if (memcmp(checkpoint.resumeId, options->resumeId, RESUME_ID_LEN) || checkpoint.fileSize != options->fileSize
+		|| checkpoint.offset > checkpoint.fileSize || stat(fileStr, &fileStat) < 0
+		|| (uint64_t)fileStat.st_size < checkpoint.offset) {
+		fprintf(stderr, "log: discarding a checkpoint of another transfer\n");
+		unlink(checkpointPath);
+		return 0;
+	}
+	synAckOptions->resumeOffset = checkpoint.offset;
+	memcpy(synAckOptions->resumeState, checkpoint.state, sizeof(checkpoint.state));
+	synAckOptions->hasResumeOffset = 1;
+	fprintf(stderr, "log: resuming at byte %lu from a checkpoint\n", checkpoint.offset);
+	return checkpoint.offset;
+}
+
+/*
+ * Answer a request for the MSS-sized chunk of the signature at the request's seq
+ */
+static int sendSignatureChunk(int sock, const struct sockaddr_in *addr, uint16_t sourcePort, uint16_t destPort,
+	const struct TCPSegment *request, const char *signature, uint32_t signatureLen)
+{
+	if (!signature || request->seqNum >= signatureLen || request->seqNum % MSS) {
+		return 0;
+	}
+	struct TCPSegment reply;
+	int len = signatureLen - request->seqNum < MSS ? (int)(signatureLen - request->seqNum) : MSS;
+	encodeTCPSegment(&reply, sourcePort, destPort, request->seqNum, ISN + 1, SIGNATURE_FLAG,
+		getMicroTimestamp(), request->tsVal, signature + request->seqNum, len);
+	if (sendto(sock, &reply, HEADER_LEN + len, 0, (struct sockaddr *)addr, sizeof(*addr)) != HEADER_LEN + len) {
+		perror("sendto");
+		return -1;
+	}
+	addMetric(&metrics.segmentsSent, 1);
+	return 0;
+}
+
+/*
+ * Handle data delivered in order: decompress it if there is a decompressor, apply it to the old copy
+ * if there is a delta decoder, and queue what comes out to be written to fd.
+ * Return -1 if the data is malformed or cannot be written.
+ */
+static int writeInOrder(struct Decompressor *decompressor, struct DeltaDecoder *delta, struct FileWriter *writer,
+	int fd, const char *data, int len)
+{
+	if (!decompressor) {
+		return applyDelta(delta, writer, fd, data, len);
+	}
+	while (len > 0) {
+		const char *block;
+		int blockLen;
+		int consumed = decompressData(decompressor, data, len, &block, &blockLen);
+		if (consumed < 0) {
+			fprintf(stderr, "error: malformed compressed data\n");
+			return -1;
+		}
+		if (block && (delta ? applyDelta(delta, writer, fd, block, blockLen)
+			: queueFileWrite(writer, fd, decompressor->rawBytes - blockLen, block, blockLen)) < 0) {
+			return -1;
+		}
+		data += consumed;
+		len -= consumed;
+	}
+	return 0;
+}
+
+/*
+ * Receive a file into fileStr, or a session of files into the directory fileStr if isSession is set.
+ * If tokenSecret is set, clients are given tokens, and data sent before the handshake is done is accepted
+ * from a client with a valid one. If isBusyPolling is set, waiting for segments spins instead of sleeping.
+ * A client may send a single file as a delta against an existing copy of fileStr, which is replaced once
+ * the new file has been rebuilt. A single file sent as it is can be resumed: how much of it is on the disk
+ * is checkpointed as it arrives, and a client that sends the same file again only sends the rest.
+ */
+int runServer(const char *fileStr, int isSession, const uint8_t *tokenSecret, int isBusyPolling,
+	int listenPort, const char *ackAddress, int ackPort)
+{
+	int oldFd = -1;  // Old copy of the file that a delta is applied to
+	char *signature = NULL;  // Signature of the old copy, which the client fetches
+	uint32_t signatureLen = 0;
+	char tempPath[PATH_MAX] = "";  // Where the file is rebuilt from a delta
+	char checkpointPath[PATH_MAX] = "";  // Where a resumable transfer's checkpoint is kept
+
 	// Create socket
 	int serverSocket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	if (serverSocket < 0) {
@@ -37,6 +359,10 @@ int runServer(const char *fileStr, int listenPort, const char *ackAddress, int a
 		perror("bind");
 		goto fail;
 	}
+	struct SocketTuner tuner;
+	if (initSocketTuner(&tuner, serverSocket, isBusyPolling) < 0) {
+		goto fail;
+	}
 
 	struct sockaddr_in ackAddr;  // Address for sending ACKs
 	memset(&ackAddr, 0, sizeof(ackAddr));
@@ -56,30 +382,95 @@ int runServer(const char *fileStr, int listenPort, const char *ackAddress, int a
 	 *  - When segment is received, check that it is not corrupted and the SYN flag is set.
 	 *    If so, break from loop; else, repeat.
 	 */
+	struct sockaddr_in clientAddr;  // Where the SYN came from, which tokens are tied to
+	socklen_t clientAddrLen;
 	fprintf(stderr, "log: listening for SYN\n");
 	for (;;) {
+		clientAddrLen = sizeof(clientAddr);
 		clientSegmentLen = recvfrom(serverSocket, &clientSegment,
-			sizeof(struct TCPSegment), 0, NULL, NULL);
+			sizeof(struct TCPSegment), 0, (struct sockaddr *)&clientAddr, &clientAddrLen);
 		if (clientSegmentLen < 0) {
 			perror("recvfrom");
 			goto fail;
 		}
+		addMetric(&metrics.segmentsReceived, 1);
 
-		convertTCPSegment(&clientSegment, 0);
-		if (isChecksumValid(&clientSegment) && isFlagSet(&clientSegment, SYN_FLAG)) {
+		int isValid = decodeTCPSegment(&clientSegment);
+		if (isValid && isFlagSet(&clientSegment, SYN_FLAG)) {
 			break;
+		} else if (!isValid) {
+			addMetric(&metrics.checksumFailures, 1);
 		}
 	}
 
 	// Get client's ISN from segment
 	nextExpectedClientSeq = clientSegment.seqNum + 1;
+	struct HandshakeOptions options;
+	if (readHandshakeOptions(&options, clientSegment.data, clientSegmentLen - HEADER_LEN) < 0) {
+		fprintf(stderr, "warning: ignoring malformed SYN options\n");
+		memset(&options, 0, sizeof(options));
+	}
+	// Make room for everything the client may have in flight, with a parity segment for every other segment
+	if (options.hasWindowSize) {
+		int maxInFlight = options.windowSize / MSS;
+		sizeSocketBuffers(&tuner, maxInFlight + maxInFlight / MIN_FEC_GROUP + 1, 0, HEADER_LEN + MSS);
+	}
+	if (options.isSession != isSession) {
+		fprintf(stderr, "error: the client %s a session\n", options.isSession ? "sent" : "did not send");
+		goto fail;
+	}
+	// The timestamp echoed back to the client. It is only taken from in-order segments
+	// so that the client's RTT samples measure segments that advanced the ACK.
+	uint32_t tsRecent = clientSegment.tsVal;
+
+	// Data sent right after the SYN is only accepted with a token this server gave to the same address,
+	// so that nobody can inject a transfer without having received a SYNACK
+	int isEarlyDataAccepted = tokenSecret && options.hasEarlyData && options.hasToken
+		&& isTokenValid(options.token, tokenSecret, clientAddr.sin_addr.s_addr, time(NULL));
+	if (options.hasEarlyData && !isEarlyDataAccepted) {
+		fprintf(stderr, "log: rejecting early data\n");
+	}
+	// A single file can be compressed, but frames in a session are handled as soon as they arrive
+	// and compressed data can only be decompressed in order
+	const int codec = !isSession && options.codec == CODEC_LZ ? CODEC_LZ : CODEC_NONE;
+	// Give the client a new token for its next connection
+	struct HandshakeOptions synAckOptions = { .hasEarlyData = isEarlyDataAccepted, .codec = codec };
+	if (tokenSecret) {
+		makeToken(synAckOptions.token, tokenSecret, clientAddr.sin_addr.s_addr, time(NULL));
+		synAckOptions.hasToken = 1;
+	}
+	// A single file can be sent as a delta if there is an old copy to rebuild it from
+	if (!isSession && options.isDelta) {
+		oldFd = openOldCopy(fileStr, &synAckOptions, &signature, &signatureLen);
+	}
+	// A file sent as it is can be resumed, since what is on the disk lines up with the data.
+	// The checkpoint keeps the digest's state too, so the part already received is never read again.
+	const int isCheckpointing = !isSession && options.hasResumeId && options.hasFileSize && options.hasDigest
+		&& !codec && oldFd < 0;
+	uint64_t resumeOffset = 0;  // Where the first segment's data goes in the file
+	if (!isSession) {
+		if (snprintf(checkpointPath, sizeof(checkpointPath), "%s.checkpoint", fileStr) >= (int)sizeof(checkpointPath)) {
+			fprintf(stderr, "error: file name is too long\n");
+			goto fail;
+		}
+		if (isCheckpointing) {
+			resumeOffset = findResumeOffset(fileStr, checkpointPath, &options, &synAckOptions);
+		} else {
+			// The file is about to be overwritten, so a checkpoint of it would no longer hold
+			unlink(checkpointPath);
+		}
+	}
+	char optionsBuffer[MAX_OPTIONS_LEN];
+	int synAckLen = HEADER_LEN + writeHandshakeOptions(&synAckOptions, optionsBuffer, MAX_OPTIONS_LEN);
 
 	// Create SYNACK segment
-	fillTCPSegment(&serverSegment, listenPort, ackPort, ISN,
-		nextExpectedClientSeq, SYN_FLAG | ACK_FLAG, NULL, 0);
-	convertTCPSegment(&serverSegment, 1);
+	encodeTCPSegment(&serverSegment, listenPort, ackPort, ISN, nextExpectedClientSeq, SYN_FLAG | ACK_FLAG,
+		getMicroTimestamp(), tsRecent, optionsBuffer, synAckLen - HEADER_LEN);
 
-	int timeoutMicros = INITIAL_TIMEOUT * SI_MICRO;  // transmission timeout
+	struct RTTEstimator rttEstimator;  // Only used for backoff since the server takes no samples
+	initRTTEstimator(&rttEstimator, INITIAL_TIMEOUT * SI_MICRO,
+		MIN_TIMEOUT * 1000, MAX_TIMEOUT * 1000);
+	int timeoutMicros = getRTO(&rttEstimator);  // transmission timeout
 	int timeRemaining = timeoutMicros;
 	int timeElapsed;
 	struct timeval timeout, startTime, endTime;
@@ -92,14 +483,21 @@ int runServer(const char *fileStr, int listenPort, const char *ackAddress, int a
 	 *  - Call recvfrom. If nothing is received within the timeout, increase it and repeat.
 	 *  - If a segment is received, check that is it not corrupted, the ACK is ISN + 1,
 	 *    and the ACK flag is set. If so, break from loop; else, repeat.
+	 *  - If early data was accepted, send the SYNACK once and break right away, since the client's data
+	 *    is already on its way. A lost SYNACK is made up for by the ACKs for that data.
 	 */
-	fprintf(stderr, "log: received SYN, sending SYNACK and listening for ACK\n");
+	fprintf(stderr, isEarlyDataAccepted ? "log: received SYN with early data, sending SYNACK\n"
+		: "log: received SYN, sending SYNACK and listening for ACK\n");
 	for (;;) {
-		if (sendto(serverSocket, &serverSegment, HEADER_LEN, 0,
-			(struct sockaddr *)&ackAddr, sizeof(ackAddr)) != HEADER_LEN) {
+		if (sendto(serverSocket, &serverSegment, synAckLen, 0,
+			(struct sockaddr *)&ackAddr, sizeof(ackAddr)) != synAckLen) {
 			perror("sendto");
 			goto fail;
 		}
+		addMetric(&metrics.segmentsSent, 1);
+		if (isEarlyDataAccepted) {
+			break;
+		}
 
 		FD_ZERO(&readFds);
 		FD_SET(serverSocket, &readFds);
@@ -114,7 +512,13 @@ int runServer(const char *fileStr, int listenPort, const char *ackAddress, int a
 		} else if (fdsReady == 0) {
 			// Timed out
 			fprintf(stderr, "warning: failed to receive ACK for SYNACK\n");
-			timeRemaining = timeoutMicros = (int)(timeoutMicros * TIMEOUT_MULTIPLIER);
+			backOffRTO(&rttEstimator);
+			timeRemaining = timeoutMicros = getRTO(&rttEstimator);
+			addMetric(&metrics.timeouts, 1);
+			addMetric(&metrics.retransmissions, 1);
+			recordRTO(&metrics, timeoutMicros);
+			traceEvent(trace, &(struct TraceRecord){ .event = TRACE_TIMEOUT,
+				.seqNum = ISN, .flags = SYN_FLAG | ACK_FLAG, .rto = timeoutMicros });
 			continue;
 		}
 
@@ -125,11 +529,14 @@ int runServer(const char *fileStr, int listenPort, const char *ackAddress, int a
 			perror("recvfrom");
 			goto fail;
 		}
+		addMetric(&metrics.segmentsReceived, 1);
 
-		convertTCPSegment(&clientSegment, 0);
-		if (isChecksumValid(&clientSegment) && clientSegment.ackNum == ISN + 1
+		int isValid = decodeTCPSegment(&clientSegment);
+		if (isValid && clientSegment.ackNum == ISN + 1
 			&& isFlagSet(&clientSegment, ACK_FLAG)) {
 			break;
+		} else if (!isValid) {
+			addMetric(&metrics.checksumFailures, 1);
 		}
 
 		timeElapsed = getMicroDiff(&startTime, &endTime);
@@ -138,89 +545,289 @@ int runServer(const char *fileStr, int listenPort, const char *ackAddress, int a
 
 	nextExpectedClientSeq++;
 
-	// Open file for writing
-	int fd = open(fileStr, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
-	if (fd < 0) {
+	// Open file for writing. In a session, files are opened as their frames arrive.
+	int fd = -1;
+	if (!isSession) {
+		// A delta is rebuilt in a temporary file so that the old copy can be read until the new one is complete
+		if (oldFd >= 0 && snprintf(tempPath, sizeof(tempPath), "%s.part", fileStr) >= (int)sizeof(tempPath)) {
+			fprintf(stderr, "error: file name is too long\n");
+			*tempPath = '\0';
+			goto fail;
+		}
+		if ((fd = open(oldFd >= 0 ? tempPath : fileStr, O_WRONLY | O_CREAT | (resumeOffset ? 0 : O_TRUNC),
+			S_IRWXU)) < 0) {
+			perror("open");
+			goto fail;
+		}
+		if (options.hasFileSize) {
+			allocateFile(fd, options.fileSize);
+		}
+	}
+	struct StreamTable streams;  // Streams of a session that have not been completely received
+	initStreamTable(&streams);
+	// The offset of a segment's data in the file is the data delivered in order so far plus its distance past
+	// the next expected seq, past the part of the file that was received before the transfer was resumed.
+	// Sequence numbers wrap around every 4 GB, so offsets are never taken from them directly.
+	uint64_t deliveredBytes = 0;
+	int checkpointFd = -1;
+	// Writes happen in the background so that a slow disk does not delay ACKs
+	struct FileWriter writer;
+	if (startFileWriter(&writer, DEFAULT_WRITER_BLOCKS) < 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		goto fail;
+	}
+	// Compressed data is decompressed as it is delivered in order
+	struct Decompressor decompressor = { 0 };
+	if (codec && initDecompressor(&decompressor) < 0) {
+		perror("malloc");
+		goto failWriting;
+	}
+	// So is a delta, which is applied to the old copy
+	struct DeltaDecoder deltaDecoder;
+	struct DeltaDecoder *delta = NULL;
+	if (oldFd >= 0) {
+		initDeltaDecoder(&deltaDecoder, oldFd, synAckOptions.signatureBlockSize, synAckOptions.signatureBlocks);
+		delta = &deltaDecoder;
+	}
+	const int isInOrder = codec || delta;  // Whether data is only written once it is delivered in order
+	// The data is hashed as it is delivered in order and checked against the digest in the client's FIN.
+	// Data written in order is hashed by the writer thread (which sees copied blocks too).
+	const int isHashing = !isSession && options.hasDigest;
+	struct Sha256 digest;
+	initSha256(&digest);
+	if (isHashing && isInOrder) {
+		hashFileWrites(&writer, &digest);
+	}
+	if (resumeOffset) {
+		resumeSha256(&digest, synAckOptions.resumeState, resumeOffset);
+	}
+	// Checkpoints are written by the writer thread, after it has synced the data they cover
+	struct Checkpoint checkpoint = { .fileSize = options.fileSize };
+	memcpy(checkpoint.resumeId, options.resumeId, RESUME_ID_LEN);
+	uint64_t nextCheckpoint = resumeOffset + CHECKPOINT_INTERVAL;
+	if (isCheckpointing && (checkpointFd = open(checkpointPath, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR)) < 0) {
 		perror("open");
-		return 1;
+		fprintf(stderr, "warning: the transfer cannot be resumed if it is interrupted\n");
 	}
+	uint8_t clientDigest[SHA256_LEN];
+	int hasClientDigest = 0;
 	ssize_t clientDataLen;  // amount of data excluding the TCP header
-	uint32_t bytesReceived = 0;  // the number of bytes received, used for logging
+	// The FEC decoder is where out-of-order segments are kept, so it has a slot for every segment the client
+	// may have in flight (up to what an ACK can report), and room for the rest of a group behind the ACK
+	int numSlots = options.hasWindowSize ? options.windowSize / MSS + 1 : DEFAULT_FEC_SLOTS;
+	numSlots = (numSlots < SACK_MAX_SEGMENTS ? numSlots : SACK_MAX_SEGMENTS) + MAX_FEC_GROUP;
+	// Segments are received into pooled buffers, which the FEC decoder keeps without copying
+	struct BufferPool *pool = newBufferPool(sizeof(struct TCPSegment), numSlots + 2, POOL_ONE_THREAD);
+	if (!pool) {
+		perror("malloc");
+		goto failWriting;
+	}
+	struct FECDecoder *decoder = newFECDecoder(numSlots, nextExpectedClientSeq, pool);
+	if (!decoder) {
+		perror("malloc");
+		freeBufferPool(pool);
+		goto failWriting;
+	}
+	const struct FECSlot *storedSegment;
+	struct TCPSegment *segment;  // Segment being received
+	uint32_t highestSeq = nextExpectedClientSeq;  // End of the furthest segment kept
+	char sackBitmap[SACK_BITMAP_LEN];
 
 	/*
 	 * Receive file:
 	 *  - The client sends the file, so all the server has to do is listen
 	 *  - When a segment is received, check if it is corrupted. If it is, then ignore it.
+	 *  - Else, if it asks for part of the signature of the old copy, send that part back.
 	 *  - Else, check if the FIN flag is set. If so, break from loop.
-	 *  - Else, check the segment's seq. If the seq is the next expected one, write to the file
-	 *    and update the next expected seq.
+	 *  - Else, if the segment is new, write it to the file at its offset, even if it is out of order.
+	 *    A segment past the receive window or the end of the file is dropped.
+	 *    Compressed data and deltas are only written once they are in order, since they are decoded as a stream.
+	 *    In a session, each frame in the segment is written to its stream's file at its offset,
+	 *    so a loss in one stream does not hold up the others.
+	 *  - Keep the segment (or parity segment) in the FEC decoder and rebuild any segment that
+	 *    is the only one missing from its group. Rebuilt segments are written to the file too.
+	 *  - Update the next expected seq to skip past every kept segment.
 	 *  - Regardless if the seq is the next expected one, send an ACK to the client
 	 *    specifying the next expected seq
 	 */
 	fprintf(stderr, "log: receiving file\n");
 	for (;;) {
-		if ((clientSegmentLen = recvfrom(serverSocket, &clientSegment,
-			sizeof(struct TCPSegment), 0, NULL, NULL)) < 0) {
-			perror("recvfrom");
-			close(fd);
-			goto fail;
+		if (!(segment = allocBuffer(pool))) {
+			perror("mmap");
+			goto failReceiving;
 		}
-		convertTCPSegment(&clientSegment, 0);
-		if (isChecksumValid(&clientSegment)) {
-			if (clientSegment.seqNum == nextExpectedClientSeq) {
-				if (isFlagSet(&clientSegment, FIN_FLAG)) {
-					break;
+		int numDropped;
+		if ((clientSegmentLen = receiveDatagram(&tuner, segment, sizeof(struct TCPSegment), &numDropped)) < 0) {
+			goto failReceiving;
+		}
+		addMetric(&metrics.segmentsReceived, 1);
+		addMetric(&metrics.kernelDrops, numDropped);
+		addMetric(&metrics.bytesReceived, clientSegmentLen - HEADER_LEN);
+		int isValid = decodeTCPSegment(segment);
+		if (isValid) {
+			traceEvent(trace, &(struct TraceRecord){ .event = TRACE_RECV,
+				.seqNum = segment->seqNum, .ackNum = segment->ackNum,
+				.length = clientSegmentLen - HEADER_LEN, .flags = segment->flags });
+			clientDataLen = clientSegmentLen - HEADER_LEN;
+			if (isFlagSet(segment, SIGNATURE_FLAG)) {
+				// Requests come before any data and are answered on their own, without an ACK
+				if (sendSignatureChunk(serverSocket, &ackAddr, listenPort, ackPort, segment,
+					signature, signatureLen) < 0) {
+					goto failReceiving;
+				}
+				releaseBuffer(segment);
+				continue;
+			}
+			if (isFlagSet(segment, FEC_FLAG)) {
+				storeFECParity(decoder, segment, clientDataLen);
+			} else if (segment->seqNum == nextExpectedClientSeq
+				&& isFlagSet(segment, FIN_FLAG)) {
+				tsRecent = segment->tsVal;
+				if ((hasClientDigest = clientDataLen == SHA256_LEN)) {
+					memcpy(clientDigest, segment->data, SHA256_LEN);
 				}
+				releaseBuffer(segment);
+				break;
+			} else if ((int32_t)(segment->seqNum - nextExpectedClientSeq) >= 0
+				&& !getFECSegment(decoder, segment->seqNum)) {
+				uint64_t offset = resumeOffset + deliveredBytes + (segment->seqNum - nextExpectedClientSeq);
+				// A segment past the end of the file (a stray seq, or corruption the checksum missed) is dropped,
+				// so that it cannot grow the file
+				int isInFile = isSession || isInOrder || !options.hasFileSize
+					|| (offset <= options.fileSize && (uint64_t)clientDataLen <= options.fileSize - offset);
+				// A segment is only handled if it is kept (which it is if it is within the receive window),
+				// since otherwise it will arrive again
+				int isKept = isInFile && storeFECSegment(decoder, nextExpectedClientSeq, segment, clientDataLen);
+				if (isKept && (int32_t)(segment->seqNum + clientDataLen - highestSeq) > 0) {
+					highestSeq = segment->seqNum + clientDataLen;
+				}
+				if (isKept && (isSession ? handleStreamFrames(&streams, &writer, fileStr,
+					segment->data, clientDataLen) < 0
+					: !isInOrder && queueFileWrite(&writer, fd, offset, segment->data, clientDataLen) < 0)) {
+					goto failReceiving;
+				}
+			}
+			int numRecovered = recoverFECSegments(decoder, nextExpectedClientSeq);
+			if (numRecovered) {
+				addMetric(&metrics.recoveredSegments, numRecovered);
+				traceEvent(trace, &(struct TraceRecord){ .event = TRACE_RECOVER,
+					.seqNum = nextExpectedClientSeq, .sample = numRecovered });
+			}
 
-				clientDataLen = clientSegmentLen - HEADER_LEN;
-				fprintf(stderr, "log: received %d bytes\r", (bytesReceived += clientDataLen));
-				if (write(fd, clientSegment.data, clientDataLen) != clientDataLen) {
-					perror("write");
-					close(fd);
-					goto fail;
+			if (!(storedSegment = getFECSegment(decoder, nextExpectedClientSeq))) {
+				addMetric(&metrics.duplicateACKs, 1);
+			} else {
+				tsRecent = segment->tsVal;
+			}
+			for ( ; storedSegment; storedSegment = getFECSegment(decoder, nextExpectedClientSeq)) {
+				if (isInOrder ? writeInOrder(codec ? &decompressor : NULL, delta, &writer, fd,
+					storedSegment->data, storedSegment->dataLen) < 0
+					: storedSegment->isRecovered && (isSession
+					? handleStreamFrames(&streams, &writer, fileStr, storedSegment->data, storedSegment->dataLen) < 0
+					: queueFileWrite(&writer, fd, resumeOffset + deliveredBytes,
+					storedSegment->data, storedSegment->dataLen) < 0)) {
+					goto failReceiving;
+				}
+				if (isHashing && !isInOrder) {
+					updateSha256(&digest, storedSegment->data, storedSegment->dataLen);
+				}
+				nextExpectedClientSeq += storedSegment->dataLen;
+				deliveredBytes += storedSegment->dataLen;
+				addMetric(&metrics.bytesDelivered, storedSegment->dataLen);
+
+				// Everything before the in-order offset has been queued, so it is all synced before the checkpoint
+				uint64_t offset = resumeOffset + deliveredBytes;
+				if (checkpointFd >= 0 && offset >= nextCheckpoint && offset % SHA256_BLOCK_LEN == 0) {
+					checkpoint.offset = offset;
+					memcpy(checkpoint.state, digest.state, sizeof(checkpoint.state));
+					if (queueCheckpoint(&writer, fd, checkpointFd, &checkpoint) < 0) {
+						goto failReceiving;
+					}
+					nextCheckpoint = offset + CHECKPOINT_INTERVAL;
 				}
-				nextExpectedClientSeq += clientDataLen;
 			}
 
-			fillTCPSegment(&serverSegment, listenPort, ackPort, ISN + 1,
-				nextExpectedClientSeq, ACK_FLAG, NULL, 0);
-			convertTCPSegment(&serverSegment, 1);
-			if (sendto(serverSocket, &serverSegment, HEADER_LEN, 0,
-				(struct sockaddr *)&ackAddr, sizeof(ackAddr)) != HEADER_LEN) {
+			// Past a gap, the ACK reports which later segments have arrived, so the client only resends what is missing
+			int sackLen = fillSackBitmap(decoder, nextExpectedClientSeq, highestSeq, sackBitmap);
+			encodeACKSegment(&serverSegment, listenPort, ackPort, ISN + 1,
+				nextExpectedClientSeq, getMicroTimestamp(), tsRecent, sackBitmap, sackLen);
+			if (sendto(serverSocket, &serverSegment, HEADER_LEN + sackLen, 0,
+				(struct sockaddr *)&ackAddr, sizeof(ackAddr)) != HEADER_LEN + sackLen) {
 				perror("sendto");
-				close(fd);
-				goto fail;
+				goto failReceiving;
 			}
+			addMetric(&metrics.segmentsSent, 1);
+			traceEvent(trace, &(struct TraceRecord){ .event = TRACE_SEND,
+				.seqNum = ISN + 1, .ackNum = nextExpectedClientSeq, .flags = ACK_FLAG });
+		} else {
+			addMetric(&metrics.checksumFailures, 1);
+			traceEvent(trace, &(struct TraceRecord){ .event = TRACE_CORRUPT });
 		}
+		releaseBuffer(segment);
 	}
 
-	fprintf(stderr, "\n");
-	fsync(fd);
-	close(fd);
+	fprintf(stderr, "log: received %lu bytes\n", getMetric(&metrics.bytesDelivered));
+	if (codec) {
+		fprintf(stderr, "log: decompressed them into %lu bytes\n", decompressor.rawBytes);
+		if (decompressor.headerLen) {
+			fprintf(stderr, "warning: compressed data ended in the middle of a block\n");
+		}
+		freeDecompressor(&decompressor);
+	}
+	if (delta) {
+		fprintf(stderr, "log: rebuilt %lu bytes, %lu of them copied from the old copy\n",
+			delta->offset, delta->copiedBytes);
+		if (delta->headerLen || delta->literalLeft) {
+			fprintf(stderr, "warning: delta ended in the middle of a record\n");
+		}
+	}
+	free(signature);
+	signature = NULL;
+	freeFECDecoder(decoder);
+	freeBufferPool(pool);
+	if (isSession) {
+		int numIncomplete = closeStreams(&streams, &writer);
+		if (numIncomplete) {
+			fprintf(stderr, "warning: %d files were not completely received\n", numIncomplete);
+		}
+	} else {
+		// The rest of the file is written and synced during teardown
+		queueFileClose(&writer, fd, 1);
+		fd = -1;
+		if (checkpointFd >= 0) {
+			queueFileClose(&writer, checkpointFd, 0);
+			checkpointFd = -1;
+		}
+	}
+	finishFileWriter(&writer);
 
 	// Create and send ACK for client's FIN
-	fillTCPSegment(&serverSegment, listenPort, ackPort, ISN + 1,
-		nextExpectedClientSeq + 1, ACK_FLAG, NULL, 0);
-	convertTCPSegment(&serverSegment, 1);
+	encodeACKSegment(&serverSegment, listenPort, ackPort, ISN + 1,
+		nextExpectedClientSeq + 1, getMicroTimestamp(), tsRecent, NULL, 0);
 	fprintf(stderr, "log: received FIN, sending ACK\n");
 	if (sendto(serverSocket, &serverSegment, HEADER_LEN, 0,
 		(struct sockaddr *)&ackAddr, sizeof(ackAddr)) != HEADER_LEN) {
 		perror("sento");
-		goto fail;
+		goto failWriting;
 	}
+	addMetric(&metrics.segmentsSent, 1);
 
 	// Create FIN segment
 	struct TCPSegment finSegment;
-	fillTCPSegment(&finSegment, listenPort, ackPort, ISN + 1,
-		nextExpectedClientSeq + 1, FIN_FLAG, NULL, 0);
-	convertTCPSegment(&finSegment, 1);
+	encodeTCPSegment(&finSegment, listenPort, ackPort, ISN + 1,
+		nextExpectedClientSeq + 1, FIN_FLAG, getMicroTimestamp(), tsRecent, NULL, 0);
 
 	timeRemaining = timeoutMicros;
+	int numFinRetries = 0;
 
 	/*
 	 * Send FIN:
 	 *  - Send FIN
 	 *  - Call recvfrom. If nothing is received within the timeout, increase it and repeat.
+	 *    After MAX_FIN_RETRIES timeouts, break from loop, since everything has been received
+	 *    and the client has most likely already gone.
 	 *  - If a segment is received, check that it is not corrupted. If it is, then ignore it.
 	 *  - Else, check for two cases:
 	 *    - If the ACK is ISN + 1 and the ACK flag is set, then break from loop
@@ -233,8 +840,9 @@ int runServer(const char *fileStr, int listenPort, const char *ackAddress, int a
 		if (sendto(serverSocket, &finSegment, HEADER_LEN, 0,
 			(struct sockaddr *)&ackAddr, sizeof(ackAddr)) != HEADER_LEN) {
 			perror("sendto");
-			goto fail;
+			goto failWriting;
 		}
+		addMetric(&metrics.segmentsSent, 1);
 
 		FD_ZERO(&readFds);
 		FD_SET(serverSocket, &readFds);
@@ -245,10 +853,19 @@ int runServer(const char *fileStr, int listenPort, const char *ackAddress, int a
 		gettimeofday(&endTime, NULL);
 		if (fdsReady < 0) {
 			perror("select");
-			goto fail;
+			goto failWriting;
+		} else if (fdsReady == 0 && numFinRetries++ == MAX_FIN_RETRIES) {
+			fprintf(stderr, "warning: giving up on ACK for FIN\n");
+			break;
 		} else if (fdsReady == 0) {
 			fprintf(stderr, "warning: failed to receive ACK for FIN\n");
-			timeRemaining = timeoutMicros = (int)(timeoutMicros * TIMEOUT_MULTIPLIER);
+			backOffRTO(&rttEstimator);
+			timeRemaining = timeoutMicros = getRTO(&rttEstimator);
+			addMetric(&metrics.timeouts, 1);
+			addMetric(&metrics.retransmissions, 1);
+			recordRTO(&metrics, timeoutMicros);
+			traceEvent(trace, &(struct TraceRecord){ .event = TRACE_TIMEOUT,
+				.seqNum = ISN + 1, .flags = FIN_FLAG, .rto = timeoutMicros });
 			continue;
 		}
 
@@ -257,11 +874,12 @@ int runServer(const char *fileStr, int listenPort, const char *ackAddress, int a
 			sizeof(struct TCPSegment), 0, NULL, NULL);
 		if (clientSegmentLen < 0) {
 			perror("recvfrom");
-			goto fail;
+			goto failWriting;
 		}
+		addMetric(&metrics.segmentsReceived, 1);
 
-		convertTCPSegment(&clientSegment, 0);
-		if (isChecksumValid(&clientSegment)) {
+		int isValid = decodeTCPSegment(&clientSegment);
+		if (isValid) {
 			if (clientSegment.ackNum == ISN + 2 && isFlagSet(&clientSegment, ACK_FLAG)) {
 				break;
 			}
@@ -269,30 +887,120 @@ int runServer(const char *fileStr, int listenPort, const char *ackAddress, int a
 				if (sendto(serverSocket, &serverSegment, HEADER_LEN, 0,
 					(struct sockaddr *)&ackAddr, sizeof(ackAddr)) != HEADER_LEN) {
 					perror("sendto");
-					goto fail;
+					goto failWriting;
 				}
+				addMetric(&metrics.segmentsSent, 1);
 			}
+		} else {
+			addMetric(&metrics.checksumFailures, 1);
 		}
 
 		timeElapsed = getMicroDiff(&startTime, &endTime);
 		timeRemaining = MAX(timeRemaining - timeElapsed, 0);
 	}
 
+	if (fd >= 0) {
+		queueFileClose(&writer, fd, 0);
+	}
+	if (stopFileWriter(&writer) < 0) {
+		goto fail;
+	}
+	// The file is complete, or it failed verification and the part that was checkpointed cannot be trusted
+	if (*checkpointPath) {
+		unlink(checkpointPath);
+	}
+	if (isHashing) {
+		uint8_t serverDigest[SHA256_LEN];
+		finishSha256(&digest, serverDigest);
+		if (!hasClientDigest) {
+			fprintf(stderr, "warning: the client's FIN did not carry a digest\n");
+		} else if (memcmp(serverDigest, clientDigest, SHA256_LEN)) {
+			// A rebuilt file is discarded so that the old copy stays intact
+			fprintf(stderr, "error: the SHA-256 of the received file does not match the client's\n");
+			goto fail;
+		} else {
+			fprintf(stderr, "log: the SHA-256 of the received file matches the client's\n");
+		}
+	}
+	if (oldFd >= 0) {
+		close(oldFd);
+		oldFd = -1;
+		if (rename(tempPath, fileStr) < 0) {
+			perror("rename");
+			goto fail;
+		}
+	}
 	close(serverSocket);
 	fprintf(stderr, "log: goodbye\n");
 	return 0;
 
+failReceiving:
+	freeFECDecoder(decoder);
+	freeBufferPool(pool);
+failWriting:
+	freeDecompressor(&decompressor);
+	if (fd >= 0) {
+		queueFileClose(&writer, fd, 0);
+	}
+	if (checkpointFd >= 0) {
+		queueFileClose(&writer, checkpointFd, 0);
+	}
+	closeStreams(&streams, &writer);
+	stopFileWriter(&writer);
+
 fail:
+	if (oldFd >= 0) {
+		close(oldFd);
+	}
+	if (*tempPath) {
+		unlink(tempPath);
+	}
+	free(signature);
 	close(serverSocket);
 	return 1;
 }
 
 int main(int argc, char **argv)
 {
-	if (argc != 5) {
-		fprintf(stderr, "usage: tcpserver <file> <listening port> <ack address> <ack port>\n");
-		return 1;
+	const char *metricsPath = NULL;
+	const char *metricsSocketPath = NULL;
+	const char *tracePath = NULL;
+	int showProgress = 0;
+	int isSession = 0;
+	int isBusyPolling = 0;
+	const char *tokenSecretPath = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "bdm:pt:u:z:")) != -1) {
+		switch (opt) {
+		case 'b':
+			isBusyPolling = 1;
+			break;
+		case 'd':
+			isSession = 1;
+			break;
+		case 'm':
+			metricsPath = optarg;
+			break;
+		case 'p':
+			showProgress = 1;
+			break;
+		case 't':
+			tracePath = optarg;
+			break;
+		case 'u':
+			metricsSocketPath = optarg;
+			break;
+		case 'z':
+			tokenSecretPath = optarg;
+			break;
+		default:
+			goto usage;
+		}
 	}
+	if (argc - optind != 4) {
+		goto usage;
+	}
+	argv += optind - 1;
 
 	const char *fileStr = argv[1];
 	int listenPort = getPort(argv[2]);
@@ -311,5 +1019,34 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	return runServer(fileStr, listenPort, ackAddress, ackPort);
+	uint8_t tokenSecret[TOKEN_SECRET_LEN];
+	if (tokenSecretPath && loadTokenSecret(tokenSecretPath, tokenSecret) < 0) {
+		return 1;
+	}
+
+	struct MetricsReporter reporter;
+	initMetrics(&metrics);
+	if (startMetricsReporter(&reporter, &metrics, metricsPath, metricsSocketPath,
+		showProgress ? "received" : NULL) < 0) {
+		return 1;
+	}
+	struct Trace traceStorage;
+	if (tracePath) {
+		if (startTrace(&traceStorage, tracePath, DEFAULT_TRACE_CAPACITY) < 0) {
+			stopMetricsReporter(&reporter);
+			return 1;
+		}
+		trace = &traceStorage;
+	}
+	int status = runServer(fileStr, isSession, tokenSecretPath ? tokenSecret : NULL, isBusyPolling, listenPort, ackAddress, ackPort);
+	if (trace) {
+		stopTrace(trace);
+	}
+	stopMetricsReporter(&reporter);
+	return status;
+
+usage:
+	fprintf(stderr, "usage: tcpserver [-bdp] [-m metrics file] [-u metrics socket] [-t trace file] [-z token secret file] "
+		"<file or directory> <listening port> <ack address> <ack port>\n");
+	return 1;
 }
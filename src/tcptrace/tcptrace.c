@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MODE_SUMMARY 0
+#define MODE_SEQUENCE 1
+#define MODE_WINDOW 2
+#define MODE_LOSS 3
+
+static const char *eventNames[] = {
+	[TRACE_SEND] = "send",
+	[TRACE_RECV] = "recv",
+	[TRACE_RETRANSMIT] = "retransmit",
+	[TRACE_TIMEOUT] = "timeout",
+	[TRACE_RTT] = "rtt",
+	[TRACE_CORRUPT] = "corrupt",
+	[TRACE_SPURIOUS] = "spurious",
+	[TRACE_RECOVER] = "recover",
+};
+#define NUM_EVENTS (sizeof(eventNames) / sizeof(*eventNames))
+
+/*
+ * A loss episode starts at the first timeout or retransmission and ends
+ * when an ACK covers everything that was retransmitted
+ */
+struct LossEpisode {
+	int isActive;
+	uint64_t startTime;
+	uint32_t firstSeq;
+	uint32_t endSeq;  // One past the highest retransmitted byte
+	unsigned long retransmissions;
+	unsigned long timeouts;
+};
+
+static double toSeconds(uint64_t micros)
+{
+	return micros / 1e6;
+}
+
+/*
+ * Print one line per segment for a time-sequence plot (e.g., with gnuplot)
+ */
+static void printSequence(const struct TraceRecord *record)
+{
+	switch (record->event) {
+	case TRACE_SEND:
+	case TRACE_RETRANSMIT:
+		printf("%.6f\t%s\t%u\t%u\n", toSeconds(record->timestamp),
+			eventNames[record->event], record->seqNum, record->length);
+		break;
+	case TRACE_RECV:
+		printf("%.6f\t%s\t%u\t%u\n", toSeconds(record->timestamp),
+			eventNames[record->event], record->ackNum, record->length);
+		break;
+	}
+}
+
+/*
+ * Print the window length and timeout whenever either changes
+ */
+static void printWindow(const struct TraceRecord *record, uint32_t *lastWindowLength,
+	uint32_t *lastRTO)
+{
+	if (record->event == TRACE_RTT) {
+		printf("%.6f\t%u\t%u\t%u\n", toSeconds(record->timestamp),
+			record->windowLength, record->rto, record->sample);
+	} else if (record->windowLength != *lastWindowLength || record->rto != *lastRTO) {
+		printf("%.6f\t%u\t%u\t-\n", toSeconds(record->timestamp),
+			record->windowLength, record->rto);
+	}
+	*lastWindowLength = record->windowLength;
+	*lastRTO = record->rto;
+}
+
+static void printEpisode(const struct LossEpisode *episode, uint64_t endTime)
+{
+	printf("%.6f\t%.6f\t%u\t%u\t%lu\t%lu\n", toSeconds(episode->startTime),
+		toSeconds(endTime - episode->startTime), episode->firstSeq, episode->endSeq,
+		episode->retransmissions, episode->timeouts);
+}
+
+/*
+ * Track loss episodes, printing each one when it ends. Returns whether an episode ended.
+ */
+static int trackLoss(const struct TraceRecord *record, struct LossEpisode *episode, int shouldPrint)
+{
+	switch (record->event) {
+	case TRACE_TIMEOUT:
+	case TRACE_RETRANSMIT:
+		if (!episode->isActive) {
+			memset(episode, 0, sizeof(struct LossEpisode));
+			episode->isActive = 1;
+			episode->startTime = record->timestamp;
+			episode->firstSeq = record->seqNum;
+			episode->endSeq = record->seqNum;
+		}
+		if (record->event == TRACE_TIMEOUT) {
+			episode->timeouts++;
+		} else {
+			episode->retransmissions++;
+			// Sequence numbers wrap around, so they are compared by their distance
+			if ((int32_t)(record->seqNum + record->length - episode->endSeq) > 0) {
+				episode->endSeq = record->seqNum + record->length;
+			}
+		}
+		break;
+	case TRACE_RECV:
+		if (episode->isActive && episode->retransmissions && (int32_t)(record->ackNum - episode->endSeq) >= 0) {
+			if (shouldPrint) {
+				printEpisode(episode, record->timestamp);
+			}
+			episode->isActive = 0;
+			return 1;
+		}
+		break;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int mode = MODE_SUMMARY;
+	int opt;
+	while ((opt = getopt(argc, argv, "lsw")) != -1) {
+		switch (opt) {
+		case 'l':
+			mode = MODE_LOSS;
+			break;
+		case 's':
+			mode = MODE_SEQUENCE;
+			break;
+		case 'w':
+			mode = MODE_WINDOW;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (argc - optind != 1) {
+		goto usage;
+	}
+
+	FILE *file = fopen(argv[optind], "rb");
+	if (!file) {
+		perror("fopen");
+		return 1;
+	}
+	struct TraceFileHeader header;
+	if (readTraceHeader(file, &header) < 0) {
+		fprintf(stderr, "error: not a trace file\n");
+		fclose(file);
+		return 1;
+	}
+
+	switch (mode) {
+	case MODE_SEQUENCE:
+		printf("# time(s)\tevent\tseq/ack\tlength\n");
+		break;
+	case MODE_WINDOW:
+		printf("# time(s)\twindow(segments)\trto(us)\trtt sample(us)\n");
+		break;
+	case MODE_LOSS:
+		printf("# start(s)\tduration(s)\tfirst seq\tend seq\tretransmissions\ttimeouts\n");
+		break;
+	}
+
+	struct TraceRecord record;
+	unsigned long eventCounts[NUM_EVENTS] = { 0 };
+	unsigned long bytesSent = 0, bytesRetransmitted = 0;
+	unsigned long numRTTs = 0, numEpisodes = 0;
+	uint64_t totalRTT = 0, lastTimestamp = 0;
+	uint32_t minRTT = UINT32_MAX, maxRTT = 0;
+	uint32_t lastWindowLength = 0, lastRTO = 0;
+	struct LossEpisode episode = { 0 };
+
+	while (fread(&record, sizeof(record), 1, file) == 1) {
+		if (record.event >= NUM_EVENTS || !eventNames[record.event]) {
+			fprintf(stderr, "warning: unknown event %d\n", record.event);
+			continue;
+		}
+		lastTimestamp = record.timestamp;
+		eventCounts[record.event]++;
+		if (record.event == TRACE_SEND) {
+			bytesSent += record.length;
+		} else if (record.event == TRACE_RETRANSMIT) {
+			bytesRetransmitted += record.length;
+		} else if (record.event == TRACE_RTT) {
+			numRTTs++;
+			totalRTT += record.sample;
+			minRTT = record.sample < minRTT ? record.sample : minRTT;
+			maxRTT = record.sample > maxRTT ? record.sample : maxRTT;
+		}
+		numEpisodes += trackLoss(&record, &episode, mode == MODE_LOSS);
+
+		if (mode == MODE_SEQUENCE) {
+			printSequence(&record);
+		} else if (mode == MODE_WINDOW) {
+			printWindow(&record, &lastWindowLength, &lastRTO);
+		}
+	}
+	if (episode.isActive) {
+		numEpisodes++;
+		if (mode == MODE_LOSS) {
+			printEpisode(&episode, lastTimestamp);
+		}
+	}
+	fclose(file);
+
+	if (mode == MODE_SUMMARY) {
+		printf("duration: %.6f s\n", toSeconds(lastTimestamp));
+		for (int i = 0; i < NUM_EVENTS; i++) {
+			if (eventNames[i]) {
+				printf("%s events: %lu\n", eventNames[i], eventCounts[i]);
+			}
+		}
+		printf("bytes sent: %lu\n", bytesSent);
+		printf("bytes retransmitted: %lu\n", bytesRetransmitted);
+		if (numRTTs) {
+			printf("rtt (us): min %u, avg %lu, max %u\n", minRTT,
+				(unsigned long)(totalRTT / numRTTs), maxRTT);
+		}
+		printf("loss episodes: %lu\n", numEpisodes);
+	}
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: tcptrace [-s | -w | -l] <trace file>\n");
+	return 1;
+}